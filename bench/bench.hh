@@ -0,0 +1,64 @@
+// Copyright 2017-2018 ccls Authors
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+#include <llvm/ADT/StringRef.h>
+#include <llvm/ADT/Twine.h>
+#include <llvm/Support/CommandLine.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include <chrono>
+#include <functional>
+#include <string>
+
+namespace ccls::bench {
+// Options of benchmarks are in this category.
+extern llvm::cl::OptionCategory C;
+
+// Upper bound of thread counts for scaling benchmarks (-j).
+extern unsigned max_threads;
+
+// Run fn(0), ..., fn(n-1) on n threads which start at the same time and return
+// the wall time in seconds.
+double runThreads(unsigned n, const std::function<void(unsigned)> &fn);
+
+// Append a result of the running benchmark to the file given by -results, as
+// one JSON object per line for tracking regressions:
+// {"benchmark":"cache","name":"binary/j1","value":1234.5,"unit":"files/s"}
+void result(const llvm::Twine &name, double value, llvm::StringRef unit);
+// The file given by -results, or empty.
+extern std::string results_path;
+
+// Print a result as a line of a table and record it with result().
+void report(llvm::raw_ostream &os, const llvm::Twine &name, double value,
+            llvm::StringRef unit);
+
+template <typename Fn> double seconds(Fn &&fn) {
+  auto start = std::chrono::steady_clock::now();
+  fn();
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                       start)
+      .count();
+}
+
+// 1, 2, 4, ..., max_threads.
+template <typename Fn> void forEachThreadCount(Fn fn) {
+  for (unsigned n = 1;; n *= 2) {
+    if (n > max_threads)
+      n = max_threads;
+    fn(n);
+    if (n == max_threads)
+      break;
+  }
+}
+
+void cache(llvm::raw_ostream &os);
+void intern(llvm::raw_ostream &os);
+void project(llvm::raw_ostream &os);
+void query(llvm::raw_ostream &os);
+
+// The child process of `project` if -project-run is given: index the project
+// and report. Returns the exit code, or -1 if -project-run is not given.
+int projectChild(llvm::raw_ostream &os);
+} // namespace ccls::bench
@@ -0,0 +1,184 @@
+// Copyright 2017-2018 ccls Authors
+// SPDX-License-Identifier: Apache-2.0
+
+#include "bench.hh"
+
+#include "config.hh"
+#include "indexer.hh"
+#include "query.hh"
+#include "serializer.hh"
+#include "utils.hh"
+
+#include <llvm/Support/CommandLine.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Format.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/Path.h>
+
+#include <random>
+
+using namespace llvm;
+
+namespace ccls::bench {
+namespace {
+cl::opt<unsigned> opt_cache_files("cache-files",
+                                  cl::desc("number of files for `cache`"),
+                                  cl::init(4000), cl::cat(C));
+
+// An IndexFile shaped like that of a medium-sized header: a few hundred
+// entities, each with a handful of declarations and uses.
+std::unique_ptr<IndexFile> makeFile(unsigned seed) {
+  std::mt19937 rng(seed);
+  std::string path = "/bench/src/file" + std::to_string(seed) + ".cc";
+  auto file = std::make_unique<IndexFile>(path, "", false);
+  file->mtime = 1;
+  file->hash = 1;
+  file->language = LanguageId::Cpp;
+  file->lid2path.emplace_back(0, path);
+  for (const char *arg : {"clang++", "-std=c++17", "-I/bench/include",
+                          "-DNDEBUG", "-c", path.c_str()})
+    file->args.push_back(ccls::intern(arg));
+  for (int i = 0; i < 20; i++) {
+    std::string dep = "/bench/include/header" + std::to_string(rng() % 500) +
+                      ".h";
+    file->dependencies[internH(dep)] = {1, 1};
+    file->includes.push_back({i, ccls::intern(dep)});
+  }
+
+  auto use = [&] {
+    Use u;
+    u.range = {{uint16_t(rng() % 2000), int16_t(rng() % 80)},
+               {uint16_t(rng() % 2000), int16_t(rng() % 80)}};
+    u.role = Role::Reference;
+    u.file_id = 0;
+    return u;
+  };
+  auto decl = [&] {
+    DeclRef d;
+    static_cast<Use &>(d) = use();
+    d.extent = d.range;
+    return d;
+  };
+  auto name = [&](const char *kind, Usr usr) {
+    return "ns" + std::to_string(usr % 31) + "::" + kind +
+           std::to_string(usr % 100000);
+  };
+  for (int i = 0; i < 200; i++) {
+    Usr usr = rng();
+    IndexFunc &func = file->toFunc(usr);
+    std::string detailed =
+        "int " + name("func", usr) + "(const std::string &, int)";
+    func.def.detailed_name = ccls::intern(detailed);
+    func.def.hover = ccls::intern(detailed + " const");
+    func.def.comments =
+        ccls::intern("Does something with " + name("func", usr));
+    func.def.spell = decl();
+    func.def.short_name_size = 8;
+    func.def.kind = SymbolKind::Function;
+    for (int j = 0; j < 4; j++) {
+      func.def.vars.push_back(rng());
+      func.def.callees.push_back({use().range, rng(), Kind::Func, Role::Call});
+    }
+    func.declarations.push_back(decl());
+    for (int j = 0; j < 8; j++)
+      func.uses.push_back(use());
+  }
+  for (int i = 0; i < 50; i++) {
+    Usr usr = rng();
+    IndexType &type = file->toType(usr);
+    type.def.detailed_name = ccls::intern("class " + name("Class", usr));
+    type.def.spell = decl();
+    type.def.kind = SymbolKind::Class;
+    for (int j = 0; j < 6; j++) {
+      type.def.funcs.push_back(rng());
+      type.def.vars.emplace_back(rng(), j * 64);
+    }
+    type.declarations.push_back(decl());
+    for (int j = 0; j < 12; j++)
+      type.uses.push_back(use());
+  }
+  for (int i = 0; i < 300; i++) {
+    Usr usr = rng();
+    IndexVar &var = file->toVar(usr);
+    var.def.detailed_name = ccls::intern("int " + name("var", usr));
+    var.def.spell = decl();
+    var.def.kind = SymbolKind::Variable;
+    var.def.type = rng();
+    for (int j = 0; j < 4; j++)
+      var.uses.push_back(use());
+  }
+  return file;
+}
+
+std::unique_ptr<IndexFile> load(SerializeFormat format,
+                                const std::string &path) {
+  if (format == SerializeFormat::Flat) {
+    auto buf = mapFile(path);
+    if (!buf)
+      return nullptr;
+    return deserialize(
+        format, path,
+        std::string_view(buf->getBufferStart(), buf->getBufferSize()), "",
+        IndexFile::kMajorVersion);
+  }
+  std::optional<std::string> content = readContent(path);
+  if (!content)
+    return nullptr;
+  return deserialize(format, path, *content, "", IndexFile::kMajorVersion);
+}
+} // namespace
+
+void cache(raw_ostream &os) {
+  g_config = new Config;
+  SmallString<256> dir;
+  if (sys::fs::createUniqueDirectory("ccls-bench", dir)) {
+    os << "failed to create a temporary directory\n";
+    return;
+  }
+  const unsigned n = opt_cache_files;
+  const std::pair<SerializeFormat, const char *> formats[] = {
+      {SerializeFormat::Binary, "binary"}, {SerializeFormat::Flat, "flat"}};
+  std::vector<std::string> paths[2];
+  uint64_t bytes[2] = {};
+  for (unsigned i = 0; i < n; i++) {
+    auto file = makeFile(i);
+    for (int f = 0; f < 2; f++) {
+      std::string data = serialize(formats[f].first, *file);
+      bytes[f] += data.size();
+      paths[f].push_back((dir + "/" + std::to_string(i) + "." +
+                          formats[f].second)
+                             .str());
+      writeToFile(paths[f].back(), data);
+    }
+  }
+  for (int f = 0; f < 2; f++)
+    os << formats[f].second << ": " << n << " files, "
+       << bytes[f] / n << " bytes/file\n";
+
+  // Load and build IndexUpdate as pipeline does for a cache hit. The first
+  // round warms up the page cache and the intern table.
+  os << "threads   format   files/s\n";
+  for (int f = 0; f < 2; f++)
+    for (auto &path : paths[f])
+      load(formats[f].first, path);
+  forEachThreadCount([&](unsigned threads) {
+    for (int f = 0; f < 2; f++) {
+      double t = runThreads(threads, [&](unsigned tid) {
+        for (unsigned i = tid; i < n; i += threads) {
+          auto file = load(formats[f].first, paths[f][i]);
+          if (file)
+            IndexUpdate::createDelta(nullptr, file.get());
+        }
+      });
+      os << format("%7u %8s %9.0f\n", threads, formats[f].second, n / t);
+      result(Twine(formats[f].second) + "/j" + Twine(threads), n / t,
+             "files/s");
+    }
+  });
+
+  for (int f = 0; f < 2; f++)
+    for (auto &path : paths[f])
+      sys::fs::remove(path);
+  sys::fs::remove(dir);
+}
+} // namespace ccls::bench
@@ -0,0 +1,92 @@
+// Copyright 2017-2018 ccls Authors
+// SPDX-License-Identifier: Apache-2.0
+
+#include "bench.hh"
+
+#include "intern.hh"
+
+#include <llvm/ADT/DenseSet.h>
+#include <llvm/Support/Allocator.h>
+#include <llvm/Support/Format.h>
+
+#include <algorithm>
+#include <mutex>
+#include <random>
+#include <string.h>
+#include <string>
+#include <vector>
+
+using namespace llvm;
+
+namespace ccls::bench {
+namespace {
+// The implementation before sharding: one lock and one set.
+struct GlobalIntern {
+  BumpPtrAllocator alloc;
+  DenseSet<CachedHashStringRef> strings;
+  std::mutex mutex;
+
+  const char *intern(StringRef s) {
+    CachedHashString hs(s);
+    std::lock_guard lock(mutex);
+    auto r = strings.insert(hs);
+    if (r.second) {
+      char *p = alloc.Allocate<char>(s.size() + 1);
+      memcpy(p, s.data(), s.size());
+      p[s.size()] = '\0';
+      *r.first = CachedHashStringRef(StringRef(p, s.size()), hs.hash());
+    }
+    return r.first->val().data();
+  }
+};
+
+// Strings shaped like detailed names. Each thread interns the whole pool in its
+// own order, similar to indexer threads loading caches of files that include
+// the same headers.
+std::vector<std::string> makePool(size_t n) {
+  std::vector<std::string> pool;
+  for (size_t i = 0; i < n; i++)
+    pool.push_back("void ns" + std::to_string(i % 97) + "::Class" +
+                   std::to_string(i / 97) + "::method(int, const char *)");
+  return pool;
+}
+} // namespace
+
+void intern(raw_ostream &os) {
+  const size_t kStrings = 200000, kRounds = 5;
+  std::vector<std::string> pool = makePool(kStrings);
+  std::vector<std::vector<unsigned>> orders(max_threads);
+  for (unsigned i = 0; i < max_threads; i++) {
+    auto &order = orders[i];
+    for (unsigned j = 0; j < kStrings; j++)
+      order.push_back(j);
+    std::shuffle(order.begin(), order.end(), std::mt19937(i));
+  }
+
+  // Both tables are populated before timing, so the runs measure lookups of
+  // existing strings, the common case.
+  for (auto &s : pool)
+    ccls::intern(s);
+  os << "threads   global Mops/s   sharded Mops/s\n";
+  forEachThreadCount([&](unsigned n) {
+    double ops = double(n) * kStrings * kRounds / 1e6;
+    GlobalIntern *global = new GlobalIntern;
+    for (auto &s : pool)
+      global->intern(s);
+    double t0 = runThreads(n, [&](unsigned i) {
+      for (size_t r = 0; r < kRounds; r++)
+        for (unsigned j : orders[i])
+          global->intern(pool[j]);
+    });
+    delete global;
+    double t1 = runThreads(n, [&](unsigned i) {
+      for (size_t r = 0; r < kRounds; r++)
+        for (unsigned j : orders[i])
+          ccls::intern(pool[j]);
+    });
+    os << format("%7u %16.1f %16.1f\n", n, ops / t0, ops / t1);
+    result("global/j" + Twine(n), ops / t0, "Mops/s");
+    result("sharded/j" + Twine(n), ops / t1, "Mops/s");
+  });
+}
+} // namespace ccls::bench
@@ -0,0 +1,138 @@
+// Copyright 2017-2018 ccls Authors
+// SPDX-License-Identifier: Apache-2.0
+
+#include "bench.hh"
+
+#include <llvm/ADT/STLExtras.h>
+#include <llvm/Support/CommandLine.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Format.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace llvm;
+using namespace llvm::cl;
+
+namespace ccls {
+// Defined in src/main.cc, which is not linked.
+std::vector<std::string> g_init_options;
+} // namespace ccls
+
+namespace ccls::bench {
+OptionCategory C("ccls-bench options");
+unsigned max_threads;
+// The benchmark being run and the output of -results.
+const char *running;
+std::unique_ptr<raw_fd_ostream> results;
+std::string results_path;
+
+void result(const Twine &name, double value, StringRef unit) {
+  if (!results)
+    return;
+  *results << "{\"benchmark\":\"" << running << "\",\"name\":\"" << name
+           << "\",\"value\":" << format("%.6g", value) << ",\"unit\":\""
+           << unit << "\"}\n";
+  results->flush();
+}
+
+void report(raw_ostream &os, const Twine &name, double value,
+            StringRef unit) {
+  os << format("%-36s %12.1f ", name.str().c_str(), value) << unit << "\n";
+  result(name, value, unit);
+}
+
+double runThreads(unsigned n, const std::function<void(unsigned)> &fn) {
+  std::mutex mutex;
+  std::condition_variable cv;
+  unsigned ready = 0;
+  bool go = false;
+  std::vector<std::thread> threads;
+  for (unsigned i = 0; i < n; i++)
+    threads.emplace_back([&, i] {
+      {
+        std::unique_lock lock(mutex);
+        if (++ready == n)
+          cv.notify_all();
+        cv.wait(lock, [&] { return go; });
+      }
+      fn(i);
+    });
+  std::chrono::steady_clock::time_point start;
+  {
+    std::unique_lock lock(mutex);
+    cv.wait(lock, [&] { return ready == n; });
+    go = true;
+    start = std::chrono::steady_clock::now();
+  }
+  cv.notify_all();
+  for (auto &thread : threads)
+    thread.join();
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                       start)
+      .count();
+}
+} // namespace ccls::bench
+
+namespace {
+using ccls::bench::C;
+
+list<std::string> opt_names(Positional, desc("[benchmark...]"), cat(C));
+opt<unsigned> opt_threads("j", desc("maximum number of threads"), init(0),
+                          cat(C));
+opt<std::string> opt_results("results",
+                             desc("append results to file as JSON lines"),
+                             value_desc("file"), cat(C));
+
+struct Benchmark {
+  const char *name;
+  void (*run)(raw_ostream &os);
+} benchmarks[] = {
+    {"cache", ccls::bench::cache},
+    {"intern", ccls::bench::intern},
+    {"project", ccls::bench::project},
+    {"query", ccls::bench::query},
+};
+} // namespace
+
+int main(int argc, char **argv) {
+  HideUnrelatedOptions(C);
+  ParseCommandLineOptions(argc, argv, "ccls microbenchmarks\n");
+  unsigned n = opt_threads;
+  if (!n)
+    n = std::max(1u, std::thread::hardware_concurrency());
+  ccls::bench::max_threads = n;
+
+  for (auto &name : opt_names)
+    if (llvm::none_of(benchmarks,
+                      [&](const Benchmark &b) { return name == b.name; })) {
+      errs() << "unknown benchmark: " << name << "\n";
+      return 1;
+    }
+  if (opt_results.size()) {
+    ccls::bench::results_path = opt_results;
+    std::error_code ec;
+    ccls::bench::results = std::make_unique<raw_fd_ostream>(
+        opt_results, ec, sys::fs::OF_Append);
+    if (ec) {
+      errs() << "failed to open " << opt_results << ": " << ec.message()
+             << "\n";
+      return 1;
+    }
+  }
+  // -project-run makes this a child process of `project`.
+  ccls::bench::running = "project";
+  if (int ret = ccls::bench::projectChild(outs()); ret >= 0)
+    return ret;
+  for (const Benchmark &b : benchmarks)
+    if (opt_names.empty() || llvm::is_contained(opt_names, b.name)) {
+      ccls::bench::running = b.name;
+      outs() << "== " << b.name << "\n";
+      b.run(outs());
+    }
+  return 0;
+}
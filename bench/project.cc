@@ -0,0 +1,254 @@
+// Copyright 2017-2018 ccls Authors
+// SPDX-License-Identifier: Apache-2.0
+
+#include "bench.hh"
+
+#include "cache_store.hh"
+#include "pipeline.hh"
+#include "platform.hh"
+#include "query.hh"
+#include "trace.hh"
+#include "utils.hh"
+
+#include <llvm/ADT/SmallString.h>
+#include <llvm/Support/CommandLine.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Program.h>
+
+#include <rapidjson/document.h>
+
+#include <atomic>
+#include <map>
+#include <random>
+#include <thread>
+
+using namespace llvm;
+
+namespace ccls {
+extern std::vector<std::string> g_init_options;
+
+namespace bench {
+namespace {
+cl::opt<unsigned> opt_tus("project-tus",
+                          cl::desc("number of translation units for `project`"),
+                          cl::init(200), cl::cat(C));
+cl::opt<unsigned> opt_headers("project-headers",
+                              cl::desc("number of headers for `project`"),
+                              cl::init(64), cl::cat(C));
+cl::opt<unsigned> opt_funcs("project-funcs",
+                            cl::desc("functions per file for `project`"),
+                            cl::init(20), cl::cat(C));
+cl::opt<std::string>
+    opt_dir("project-dir",
+            cl::desc("generate the project of `project` in this directory "
+                     "and keep it"),
+            cl::value_desc("dir"), cl::cat(C));
+cl::opt<std::string> opt_run("project-run", cl::Hidden,
+                             cl::desc("internal: index a generated project"),
+                             cl::cat(C));
+cl::opt<bool> opt_warm("project-warm", cl::Hidden,
+                       cl::desc("internal: the cache is warm"), cl::cat(C));
+
+std::string str(unsigned i) { return std::to_string(i); }
+
+// Headers form a lattice of layers: each includes up to three headers of the
+// layer above it, so that translation units including headers of the bottom
+// layers see most of them. The top layer includes standard headers.
+std::vector<std::vector<unsigned>> headerDeps(unsigned n) {
+  unsigned width = 1;
+  while (width * width < n)
+    width++;
+  std::vector<std::vector<unsigned>> deps(n);
+  for (unsigned j = width; j < n; j++) {
+    std::mt19937 rng(j);
+    unsigned above = j / width * width - width;
+    for (int d = 0; d < 3; d++) {
+      unsigned dep = above + rng() % width;
+      if (!llvm::is_contained(deps[j], dep))
+        deps[j].push_back(dep);
+    }
+  }
+  return deps;
+}
+
+std::string makeHeader(unsigned j, const std::vector<unsigned> &deps) {
+  std::string ns = "lib" + str(j), m = "H" + str(j) + "_";
+  std::string s = "#pragma once\n";
+  if (deps.empty())
+    s += "#include <string>\n#include <vector>\n";
+  for (unsigned dep : deps)
+    s += "#include \"h" + str(dep) + ".h\"\n";
+  s += "\n#define " + m + "SQUARE(x) ((x) * (x))\n";
+  s += "#define " + m + "DECLARE(name) int name##_" + str(j) + "(int)\n\n";
+  s += "namespace " + ns + " {\n";
+  s += "template <typename T> struct Box {\n"
+       "  T value;\n"
+       "  T get() const { return value; }\n"
+       "  template <typename U> Box<U> map(U (*f)(T)) const {\n"
+       "    return {f(value)};\n"
+       "  }\n"
+       "};\n\n";
+  s += m + "DECLARE(declared);\n\n";
+  s += "struct Widget : Box<int> {\n";
+  s += "  int area() const { return " + m + "SQUARE(value); }\n";
+  for (unsigned k = 0; k < opt_funcs; k++)
+    s += "  int method" + str(k) + "(int a) const { return a + " + str(k) +
+         "; }\n";
+  s += "};\n\n";
+  s += "template <typename T> T twice(T x) { return x + x; }\n\n";
+  s += "inline int helper(int x) {\n  int r = " + m + "SQUARE(x);\n";
+  for (unsigned dep : deps)
+    s += "  r += lib" + str(dep) + "::helper(x);\n";
+  s += "  return r;\n}\n";
+  s += "} // namespace " + ns + "\n";
+  return s;
+}
+
+std::string makeTU(unsigned i, const std::vector<unsigned> &headers) {
+  std::string s;
+  for (unsigned h : headers)
+    s += "#include \"h" + str(h) + ".h\"\n";
+  s += "\nnamespace {\nint local(int x) { return x * 2; }\n} // namespace\n\n";
+  for (unsigned k = 0; k < opt_funcs; k++) {
+    std::string ns = "lib" + str(headers[k % headers.size()]);
+    s += "int tu" + str(i) + "_f" + str(k) + "(int a) {\n";
+    s += "  " + ns + "::Box<int> b{a};\n";
+    s += "  " + ns + "::Widget w{};\n";
+    s += "  return " + ns + "::helper(a) + " + ns + "::twice(b.get()) + " +
+         "w.method" + str(k) + "(a) + w.area() + local(a);\n}\n\n";
+  }
+  return s;
+}
+
+std::string escapeJson(StringRef s) {
+  std::string ret;
+  for (char c : s) {
+    if (c == '"' || c == '\\')
+      ret += '\\';
+    ret += c;
+  }
+  return ret;
+}
+
+void generate(const std::string &root) {
+  sys::fs::create_directories(root + "/include");
+  sys::fs::create_directories(root + "/src");
+  const unsigned n_headers = std::max(1u, opt_headers.getValue());
+  auto deps = headerDeps(n_headers);
+  for (unsigned j = 0; j < n_headers; j++)
+    writeToFile(root + "/include/h" + str(j) + ".h", makeHeader(j, deps[j]));
+
+  // Translation units include headers of the bottom half of the lattice.
+  std::string compdb = "[\n";
+  for (unsigned i = 0; i < opt_tus; i++) {
+    std::mt19937 rng(i);
+    std::vector<unsigned> headers;
+    for (int d = 0; d < 4; d++) {
+      unsigned h = n_headers / 2 + rng() % (n_headers - n_headers / 2);
+      if (!llvm::is_contained(headers, h))
+        headers.push_back(h);
+    }
+    std::string file = "src/tu" + str(i) + ".cc";
+    writeToFile(root + "/" + file, makeTU(i, headers));
+    compdb += std::string(i ? ",\n" : "") + "  {\"directory\": \"" +
+              escapeJson(root) + "\", \"file\": \"" + file +
+              "\", \"arguments\": [\"c++\", \"-std=c++17\", \"-Iinclude\", "
+              "\"-c\", \"" +
+              file + "\"]}";
+  }
+  compdb += "\n]\n";
+  writeToFile(root + "/compile_commands.json", compdb);
+}
+} // namespace
+
+void project(raw_ostream &os) {
+  SmallString<256> root;
+  if (opt_dir.size()) {
+    root = opt_dir;
+    sys::fs::make_absolute(root);
+  } else if (sys::fs::createUniqueDirectory("ccls-bench-project", root)) {
+    os << "failed to create a temporary directory\n";
+    return;
+  }
+  generate(root.str().str());
+  os << opt_tus << " TUs, " << opt_headers << " headers, " << opt_funcs
+     << " functions/file\n";
+
+  // pipeline::standalone can only run once per process, so each run is a
+  // child process.
+  static char anchor;
+  std::string exe = sys::fs::getMainExecutable("ccls-bench", &anchor);
+  std::string run = ("-project-run=" + root).str(),
+              threads = "-j=" + str(max_threads),
+              results = "-results=" + results_path;
+  sys::fs::remove_directories(root + "/.ccls-cache");
+  for (bool warm : {false, true}) {
+    SmallVector<StringRef, 5> args{exe, run, threads};
+    if (warm)
+      args.push_back("-project-warm");
+    if (results_path.size())
+      args.push_back(results);
+    std::string err;
+    outs().flush();
+    if (sys::ExecuteAndWait(exe, args, {}, {}, 0, 0, &err) != 0) {
+      os << (warm ? "warm" : "cold") << " run failed " << err << "\n";
+      break;
+    }
+  }
+  if (opt_dir.empty())
+    sys::fs::remove_directories(root);
+}
+
+int projectChild(raw_ostream &os) {
+  if (opt_run.empty())
+    return -1;
+  const std::string root = opt_run;
+  const char *label = opt_warm ? "warm" : "cold";
+  g_init_options.push_back(
+      ("{\"index\":{\"threads\":" + Twine(max_threads) + "}}").str());
+  std::string trace_path = root + "/.ccls-bench-trace.json";
+  if (!trace::init(trace_path)) {
+    os << "failed to open " << trace_path << "\n";
+    return 1;
+  }
+
+  pipeline::init();
+  std::atomic<bool> done{false};
+  size_t peak = 0;
+  std::thread sampler([&] {
+    while (!done) {
+      peak = std::max(peak, getResidentSetSize());
+      std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    }
+  });
+  DB db;
+  double t = seconds([&] { pipeline::standalone(root, &db); });
+  done = true;
+  sampler.join();
+  trace::finish();
+
+  // Sum the spans of each stage over all threads.
+  std::map<std::string, double> stages;
+  if (std::optional<std::string> content = readContent(trace_path)) {
+    rapidjson::Document doc;
+    doc.Parse(content->data(), content->size());
+    if (!doc.HasParseError() && doc.IsArray())
+      for (auto &event : doc.GetArray())
+        if (event.HasMember("dur"))
+          stages[event["name"].GetString()] +=
+              event["dur"].GetInt64() / 1e6;
+  }
+  sys::fs::remove(trace_path);
+
+  int64_t tus = pipeline::stats.completed;
+  report(os, Twine(label) + "/TUs/s", tus / t, "TUs/s");
+  report(os, Twine(label) + "/wall", t, "s");
+  report(os, Twine(label) + "/written",
+         cache_store::bytesWritten() / 1048576.0, "MiB");
+  report(os, Twine(label) + "/peak RSS", peak / 1048576.0, "MiB");
+  for (auto &[stage, secs] : stages)
+    report(os, Twine(label) + "/" + stage, secs, "thread-s");
+  return 0;
+}
+} // namespace bench
+} // namespace ccls
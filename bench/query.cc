@@ -0,0 +1,266 @@
+// Copyright 2017-2018 ccls Authors
+// SPDX-License-Identifier: Apache-2.0
+
+#include "bench.hh"
+
+#include "config.hh"
+#include "fuzzy_match.hh"
+#include "indexer.hh"
+#include "query.hh"
+#include "serializer.hh"
+#include "utils.hh"
+
+#include <llvm/Support/CommandLine.h>
+#include <llvm/Support/Format.h>
+
+#include <random>
+
+using namespace llvm;
+
+namespace ccls::bench {
+namespace {
+cl::opt<unsigned> opt_files("query-files",
+                            cl::desc("number of files for `query`"),
+                            cl::init(2000), cl::cat(C));
+cl::opt<unsigned> opt_symbols("query-symbols",
+                              cl::desc("symbols per file for `query`"),
+                              cl::init(400), cl::cat(C));
+cl::opt<unsigned> opt_uses("query-uses",
+                           cl::desc("uses per symbol and file for `query`"),
+                           cl::init(4), cl::cat(C));
+cl::opt<unsigned>
+    opt_fanout("query-fanout",
+               cl::desc("number of files referencing a symbol for `query`"),
+               cl::init(8), cl::cat(C));
+
+template <typename Def>
+void setName(Def &def, StringRef prefix, unsigned idx, StringRef kind,
+             StringRef suffix) {
+  std::string ns = "ns" + std::to_string(idx % 31) + "::",
+              name = kind.str() + std::to_string(idx);
+  def.detailed_name = ccls::intern((prefix + ns + name + suffix).str());
+  def.qual_name_offset = prefix.size();
+  def.short_name_offset = prefix.size() + ns.size();
+  def.short_name_size = name.size();
+}
+
+// File |i| references opt_symbols symbols, shared with the other files of its
+// group of opt_fanout files and defined in the first of them. Symbol k of a
+// file is used on lines [k*opt_uses, (k+1)*opt_uses). |version| shifts the
+// uses by a line, as an edit at the top of the file does.
+std::unique_ptr<IndexFile> makeFile(unsigned i, unsigned version) {
+  std::string path = "/bench/query/file" + std::to_string(i) + ".cc";
+  auto file = std::make_unique<IndexFile>(path, "", false);
+  file->mtime = 1 + version;
+  file->hash = 1 + version;
+  file->language = LanguageId::Cpp;
+  file->lid2path.emplace_back(0, path);
+  for (const char *arg : {"clang++", "-std=c++17", "-c", path.c_str()})
+    file->args.push_back(ccls::intern(arg));
+
+  const unsigned fanout = std::max(1u, opt_fanout.getValue());
+  const bool owner = i % fanout == 0;
+  for (unsigned k = 0; k < opt_symbols; k++) {
+    unsigned idx = i / fanout * opt_symbols + k;
+    Usr usr = (idx + 1) * 0x9e3779b97f4a7c15ULL;
+    auto use = [&](unsigned j) {
+      Use u;
+      uint16_t line = (k * opt_uses + j + version) % 65535;
+      u.range = {{line, 4}, {line, 20}};
+      u.role = Role::Reference;
+      u.file_id = 0;
+      return u;
+    };
+    auto decl = [&] {
+      DeclRef d;
+      static_cast<Use &>(d) = use(0);
+      d.role = Role::Definition;
+      d.extent = d.range;
+      return d;
+    };
+    switch (idx % 10) {
+    case 0: {
+      IndexType &type = file->toType(usr);
+      if (owner) {
+        setName(type.def, "class ", idx, "Class", "");
+        type.def.spell = decl();
+        type.def.kind = SymbolKind::Class;
+      }
+      for (unsigned j = owner; j < opt_uses; j++)
+        type.uses.push_back(use(j));
+      break;
+    }
+    case 1:
+    case 2:
+    case 3:
+    case 4: {
+      IndexFunc &func = file->toFunc(usr);
+      if (owner) {
+        setName(func.def, "int ", idx, "func", "(int, const char *)");
+        func.def.spell = decl();
+        func.def.kind = SymbolKind::Function;
+      }
+      for (unsigned j = owner; j < opt_uses; j++)
+        func.uses.push_back(use(j));
+      break;
+    }
+    default: {
+      IndexVar &var = file->toVar(usr);
+      if (owner) {
+        setName(var.def, "int ", idx, "var", "");
+        var.def.spell = decl();
+        var.def.kind = SymbolKind::Variable;
+      }
+      for (unsigned j = owner; j < opt_uses; j++)
+        var.uses.push_back(use(j));
+    }
+    }
+  }
+  return file;
+}
+
+} // namespace
+
+void query(raw_ostream &os) {
+  if (!g_config)
+    g_config = new Config;
+  const unsigned n = opt_files;
+  std::vector<std::unique_ptr<IndexFile>> files;
+  for (unsigned i = 0; i < n; i++)
+    files.push_back(makeFile(i, 0));
+  os << n << " files, " << opt_symbols << " symbols/file, " << opt_uses
+     << " uses/symbol, fan-out " << opt_fanout << "\n";
+
+  // serialize and deserialize as cache writes and loads do.
+  const std::pair<SerializeFormat, const char *> formats[] = {
+      {SerializeFormat::Binary, "binary"},
+      {SerializeFormat::Json, "json"},
+      {SerializeFormat::Flat, "flat"}};
+  for (auto [format, name] : formats) {
+    std::vector<std::string> data(n);
+    double t = seconds([&] {
+      for (unsigned i = 0; i < n; i++)
+        data[i] = serialize(format, *files[i]);
+    });
+    uint64_t bytes = 0;
+    for (auto &d : data)
+      bytes += d.size();
+    report(os, Twine("serialize/") + name, n / t, "files/s");
+    t = seconds([&] {
+      for (unsigned i = 0; i < n; i++)
+        deserialize(format, files[i]->path, data[i], "",
+                    IndexFile::kMajorVersion);
+    });
+    report(os, Twine("deserialize/") + name, n / t, "files/s");
+    report(os, Twine("size/") + name, double(bytes) / n, "bytes/file");
+  }
+
+  // createDelta destroys its arguments, so each round uses fresh files.
+  std::vector<IndexUpdate> updates;
+  updates.reserve(n);
+  double t = seconds([&] {
+    for (auto &file : files)
+      updates.push_back(IndexUpdate::createDelta(nullptr, file.get()));
+  });
+  report(os, "createDelta/new", n / t, "files/s");
+
+  // Apply one update at a time as the main thread does for small batches.
+  DB db;
+  t = seconds([&] {
+    for (IndexUpdate &u : updates)
+      db.applyIndexUpdates({&u});
+  });
+  report(os, "applyIndexUpdate/new", n / t, "files/s");
+
+  // Re-index every file after an edit: the delta removes and re-adds all uses
+  // of the file.
+  std::vector<std::unique_ptr<IndexFile>> prev, curr;
+  for (unsigned i = 0; i < n; i++) {
+    prev.push_back(makeFile(i, 0));
+    curr.push_back(makeFile(i, 1));
+  }
+  updates.clear();
+  t = seconds([&] {
+    for (unsigned i = 0; i < n; i++)
+      updates.push_back(
+          IndexUpdate::createDelta(prev[i].get(), curr[i].get()));
+  });
+  report(os, "createDelta/changed", n / t, "files/s");
+  t = seconds([&] {
+    for (IndexUpdate &u : updates)
+      db.applyIndexUpdates({&u});
+  });
+  report(os, "applyIndexUpdate/changed", n / t, "files/s");
+
+  std::mt19937 rng(0);
+  const unsigned kQueries = 100000;
+  std::vector<int> file_ids;
+  for (unsigned i = 0; i < n; i++)
+    file_ids.push_back(db.getFileId("/bench/query/file" + std::to_string(i) +
+                                    ".cc"));
+  t = seconds([&] {
+    for (unsigned q = 0; q < kQueries; q++) {
+      Position pos{int(rng() % std::max(1u, opt_symbols * opt_uses)),
+                   int(rng() % 24)};
+      findSymbolsAtLocation(nullptr, &db.files[file_ids[rng() % n]], pos);
+    }
+  });
+  report(os, "findSymbolsAtLocation", kQueries / t, "queries/s");
+
+  // The candidate scan of workspace/symbol, without building the results.
+  const char *queries[] = {"func1", "ns3::Class", "nsv12", "Cls9f", "zzz"};
+  t = seconds([&] {
+    for (const char *q : queries) {
+      auto match = [&](SymbolIdx sym) {
+        reverseSubseqMatch(q, db.getSymbolName(sym, true), false);
+      };
+      for (auto &func : db.funcs)
+        match({func.usr, Kind::Func});
+      for (auto &type : db.types)
+        match({type.usr, Kind::Type});
+      for (auto &var : db.vars)
+        if (var.def.size() && !var.def[0].is_local())
+          match({var.usr, Kind::Var});
+    }
+  });
+  report(os, "workspace_symbol/scan", t * 1000 / std::size(queries),
+         "ms/query");
+
+  // The same matches, narrowed by the name indexes first.
+  size_t candidates = 0;
+  t = seconds([&] {
+    for (const char *q : queries) {
+      auto match = [&](SymbolIdx sym) {
+        candidates++;
+        reverseSubseqMatch(q, db.getSymbolName(sym, true), false);
+        return false;
+      };
+      db.func_names.forEachCandidate(
+          q, [&](size_t i) { return match({db.funcs[i].usr, Kind::Func}); });
+      db.type_names.forEachCandidate(
+          q, [&](size_t i) { return match({db.types[i].usr, Kind::Type}); });
+      db.var_names.forEachCandidate(q, [&](size_t i) {
+        auto &var = db.vars[i];
+        return var.def.size() && !var.def[0].is_local() &&
+               match({var.usr, Kind::Var});
+      });
+    }
+  });
+  report(os, "workspace_symbol/indexed", t * 1000 / std::size(queries),
+         "ms/query");
+  report(os, "workspace_symbol/candidates",
+         double(candidates) / std::size(queries), "names/query");
+
+  std::vector<std::string_view> names;
+  for (auto &func : db.funcs)
+    names.push_back(db.getSymbolName({func.usr, Kind::Func}, true));
+  for (auto &type : db.types)
+    names.push_back(db.getSymbolName({type.usr, Kind::Type}, true));
+  FuzzyMatcher fuzzy("nsfunc", 0);
+  t = seconds([&] {
+    for (std::string_view name : names)
+      fuzzy.match(name, false);
+  });
+  report(os, "FuzzyMatcher::match", names.size() / t / 1e6, "Mmatches/s");
+}
+} // namespace ccls::bench
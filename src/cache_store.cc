@@ -0,0 +1,497 @@
+// Copyright 2017-2018 ccls Authors
+// SPDX-License-Identifier: Apache-2.0
+
+#include "cache_store.hh"
+
+#include "config.hh"
+#include "log.hh"
+#include "platform.hh"
+#include "utils.hh"
+
+#include <llvm/ADT/StringMap.h>
+#include <llvm/ADT/StringSet.h>
+#include <llvm/Config/llvm-config.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/MathExtras.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/Process.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include <atomic>
+#include <mutex>
+#include <shared_mutex>
+#include <string.h>
+
+using namespace llvm;
+
+namespace ccls::cache_store {
+namespace {
+constexpr uint32_t kRecordMagic = 0x52534343; // "CCSR"
+constexpr uint32_t kTrailerMagic = 0x54534343; // "CCST"
+// Compact when the pack is larger than this and more than half of it is stale.
+constexpr uint64_t kMinCompactSize = 64 << 20;
+
+enum RecordKind : uint32_t { kPut = 1, kRemove, kFooter };
+
+// A record is a header, the key and the data, each padded to 8 bytes so that
+// mmap'ed data is suitably aligned for SerializeFormat::Flat.
+struct RecordHeader {
+  uint32_t magic;
+  uint32_t kind;
+  uint32_t key_size;
+  uint32_t reserved;
+  uint64_t data_size;
+};
+
+// The data of a footer record is a FooterEntry and the padded key for each
+// live entry, followed by a Trailer, which ends the file if nothing has been
+// appended since.
+struct FooterEntry {
+  uint64_t offset, size;
+  uint32_t key_size, reserved;
+};
+struct Trailer {
+  uint64_t footer_offset;
+  uint32_t magic, count;
+};
+
+uint64_t recordSize(uint64_t key_size, uint64_t data_size) {
+  return sizeof(RecordHeader) + alignTo(key_size, 8) + alignTo(data_size, 8);
+}
+
+// Returns the offset of the data.
+uint64_t writeRecord(raw_ostream &os, uint64_t &end, uint32_t kind,
+                     StringRef key, StringRef data) {
+  static const char zeros[8] = {};
+  RecordHeader h{kRecordMagic, kind, uint32_t(key.size()), 0, data.size()};
+  os.write(reinterpret_cast<const char *>(&h), sizeof h);
+  os << key;
+  os.write(zeros, alignTo(key.size(), 8) - key.size());
+  uint64_t offset = end + sizeof h + alignTo(key.size(), 8);
+  os << data;
+  os.write(zeros, alignTo(data.size(), 8) - data.size());
+  end += recordSize(key.size(), data.size());
+  return offset;
+}
+
+struct Store {
+  virtual ~Store() = default;
+  virtual std::unique_ptr<MemoryBuffer> read(const std::string &path) = 0;
+  virtual void write(const std::string &path, const std::string &content) = 0;
+  virtual void remove(const std::string &path) = 0;
+  virtual void flush() {}
+};
+
+struct DirectoryStore : Store {
+  std::unique_ptr<MemoryBuffer> read(const std::string &path) override {
+    return mapFile(path);
+  }
+  void write(const std::string &path, const std::string &content) override {
+    if (g_config->cache.hierarchicalPath)
+      sys::fs::create_directories(
+          sys::path::parent_path(path, sys::path::Style::posix), true);
+    writeToFile(path, content);
+  }
+  void remove(const std::string &path) override {
+    (void)sys::fs::remove(path);
+  }
+};
+
+class PackStore : public Store {
+  struct Location {
+    uint64_t offset, size;
+  };
+
+  std::string pack_path;
+  // Held for the lifetime of the store so that another ccls process sharing
+  // cache.directory does not append to the same pack.
+  int lock_fd = -1;
+  // Exclusive for appends and for swapping in a compacted pack. Appends do not
+  // move existing data, so readers only need a shared lock.
+  std::shared_mutex mutex;
+  // Serializes compactions.
+  std::mutex compact_mutex;
+  int read_fd = -1, write_fd = -1;
+  // Null if the pack could not be reopened after compaction.
+  std::unique_ptr<raw_fd_ostream> out;
+  uint64_t end = 0, live = 0;
+  // Records appended since the last footer.
+  int unindexed = 0;
+  StringMap<Location> entries;
+
+  std::string key(const std::string &path) {
+    StringRef dir = g_config->cache.directory;
+    return StringRef(path).startswith(dir) ? path.substr(dir.size()) : path;
+  }
+
+  std::unique_ptr<MemoryBuffer> readAt(uint64_t offset, uint64_t size) {
+#if LLVM_VERSION_MAJOR >= 9
+    sys::fs::file_t fd = sys::fs::convertFDToNativeFile(read_fd);
+#else
+    int fd = read_fd;
+#endif
+    auto buf = MemoryBuffer::getOpenFileSlice(fd, pack_path, size, offset);
+    if (!buf || (*buf)->getBufferSize() != size)
+      return nullptr;
+    return std::move(*buf);
+  }
+  template <typename T> bool readStruct(uint64_t offset, T &v) {
+    auto buf = readAt(offset, sizeof v);
+    if (!buf)
+      return false;
+    memcpy(&v, buf->getBufferStart(), sizeof v);
+    return true;
+  }
+
+  void put(StringRef key, Location loc) {
+    auto [it, inserted] = entries.try_emplace(key, loc);
+    if (!inserted) {
+      live -= recordSize(key.size(), it->second.size);
+      it->second = loc;
+    }
+    live += recordSize(key.size(), loc.size);
+  }
+
+  bool loadFooter(uint64_t size) {
+    Trailer t;
+    RecordHeader h;
+    if (size < sizeof h + sizeof t || !readStruct(size - sizeof t, t) ||
+        t.magic != kTrailerMagic || t.footer_offset > size - sizeof h ||
+        !readStruct(t.footer_offset, h) || h.magic != kRecordMagic ||
+        h.kind != kFooter || h.data_size < sizeof t ||
+        t.footer_offset + recordSize(h.key_size, h.data_size) != size)
+      return false;
+    auto buf = readAt(size - h.data_size, h.data_size - sizeof t);
+    if (!buf)
+      return false;
+    StringRef data = buf->getBuffer();
+    for (uint32_t i = 0; i < t.count; i++) {
+      FooterEntry e;
+      if (data.size() < sizeof e)
+        return false;
+      memcpy(&e, data.data(), sizeof e);
+      data = data.drop_front(sizeof e);
+      if (data.size() < alignTo(e.key_size, 8) || e.offset > size ||
+          e.size > size - e.offset)
+        return false;
+      put(data.take_front(e.key_size), {e.offset, e.size});
+      data = data.drop_front(alignTo(e.key_size, 8));
+    }
+    end = size;
+    return true;
+  }
+
+  // Replay the log. A damaged tail, e.g. after a crash, is truncated.
+  void scan(uint64_t size) {
+    entries.clear();
+    live = 0;
+    uint64_t pos = 0;
+    RecordHeader h;
+    while (pos + sizeof h <= size && readStruct(pos, h) &&
+           h.magic == kRecordMagic && h.kind >= kPut && h.kind <= kFooter &&
+           h.data_size <= size &&
+           recordSize(h.key_size, h.data_size) <= size - pos) {
+      if (h.kind != kFooter) {
+        auto buf = readAt(pos + sizeof h, h.key_size);
+        if (!buf)
+          break;
+        StringRef key = buf->getBuffer();
+        if (h.kind == kPut) {
+          put(key, {pos + sizeof h + alignTo(h.key_size, 8), h.data_size});
+        } else {
+          auto it = entries.find(key);
+          if (it != entries.end()) {
+            live -= recordSize(key.size(), it->second.size);
+            entries.erase(it);
+          }
+        }
+        unindexed++;
+      }
+      pos += recordSize(h.key_size, h.data_size);
+    }
+    if (pos != size) {
+      LOG_S(WARNING) << "truncate damaged " << pack_path << " from " << size
+                     << " to " << pos;
+      sys::fs::resize_file(write_fd, pos);
+    }
+    end = pos;
+  }
+
+  std::string footer(const StringMap<Location> &entries, uint64_t offset) {
+    std::string data;
+    for (auto &e : entries) {
+      FooterEntry fe{e.second.offset, e.second.size,
+                     uint32_t(e.first().size()), 0};
+      data.append(reinterpret_cast<const char *>(&fe), sizeof fe);
+      data += e.first();
+      data.resize(alignTo(data.size(), 8));
+    }
+    Trailer t{offset, kTrailerMagic, uint32_t(entries.size())};
+    data.append(reinterpret_cast<const char *>(&t), sizeof t);
+    return data;
+  }
+
+  bool append(uint32_t kind, StringRef key, StringRef data, Location *loc) {
+    if (!out)
+      return false;
+    uint64_t offset = writeRecord(*out, end, kind, key, data);
+    out->flush();
+    if (out->has_error()) {
+      LOG_S(ERROR) << "failed to write to " << pack_path;
+      out->clear_error();
+    }
+    if (loc)
+      *loc = {offset, data.size()};
+    unindexed++;
+    return true;
+  }
+
+  void writeFooter() {
+    if (append(kFooter, "", footer(entries, end), nullptr))
+      unindexed = 0;
+  }
+
+  bool openFiles() {
+    std::error_code ec = sys::fs::openFileForWrite(
+        pack_path, write_fd, sys::fs::CD_OpenAlways, sys::fs::OF_Append);
+    if (!ec)
+      ec = sys::fs::openFileForRead(pack_path, read_fd);
+    if (ec) {
+      LOG_S(ERROR) << "failed to open " << pack_path << ": " << ec.message();
+      return false;
+    }
+    out = std::make_unique<raw_fd_ostream>(write_fd, false);
+    return true;
+  }
+  void closeFiles() {
+    out.reset();
+    sys::Process::SafelyCloseFileDescriptor(write_fd);
+    sys::Process::SafelyCloseFileDescriptor(read_fd);
+    write_fd = read_fd = -1;
+  }
+
+  // Copy live entries to a new pack under a shared lock so that readers are not
+  // blocked, then replace the current one unless records have been appended
+  // in between.
+  void compact() {
+    std::unique_lock compacting(compact_mutex, std::try_to_lock);
+    if (!compacting)
+      return;
+    std::string tmp = pack_path + ".tmp";
+    StringMap<Location> entries1;
+    uint64_t end0, end1 = 0;
+    {
+      std::shared_lock lock(mutex);
+      if (!out)
+        return;
+      end0 = end;
+      std::error_code ec;
+      raw_fd_ostream os(tmp, ec, sys::fs::OF_None);
+      if (ec) {
+        LOG_S(ERROR) << "failed to open " << tmp << ": " << ec.message();
+        return;
+      }
+      for (auto &e : entries)
+        if (auto buf = readAt(e.second.offset, e.second.size)) {
+          uint64_t offset =
+              writeRecord(os, end1, kPut, e.first(), buf->getBuffer());
+          entries1[e.first()] = {offset, e.second.size};
+        }
+      writeRecord(os, end1, kFooter, "", footer(entries1, end1));
+      os.close();
+      if (os.has_error()) {
+        os.clear_error();
+        LOG_S(ERROR) << "failed to write to " << tmp;
+        (void)sys::fs::remove(tmp);
+        return;
+      }
+    }
+
+    std::lock_guard lock(mutex);
+    if (end != end0) {
+      // Retried by a later write.
+      (void)sys::fs::remove(tmp);
+      return;
+    }
+    // Open descriptors keep referring to the old pack if this fails.
+    if (std::error_code ec = sys::fs::rename(tmp, pack_path)) {
+      LOG_S(ERROR) << "failed to rename " << tmp << ": " << ec.message();
+      (void)sys::fs::remove(tmp);
+      return;
+    }
+    LOG_S(INFO) << "compacted " << pack_path << " from " << end << " to "
+                << end1 << " bytes";
+    closeFiles();
+    if (!openFiles()) {
+      LOG_S(ERROR) << "disable " << pack_path;
+      entries.clear();
+      return;
+    }
+    uint64_t size = 0;
+    std::error_code ec = sys::fs::file_size(pack_path, size);
+    if (ec || size == end1) {
+      entries = std::move(entries1);
+      end = end1;
+      live = 0;
+      for (auto &e : entries)
+        live += recordSize(e.first().size(), e.second.size);
+      unindexed = 0;
+    } else {
+      scan(size);
+    }
+  }
+
+public:
+  PackStore(std::string pack_path) : pack_path(std::move(pack_path)) {}
+
+  bool open() {
+    std::string lock_path = pack_path + ".lock";
+    if (std::error_code ec = sys::fs::openFileForWrite(
+            lock_path, lock_fd, sys::fs::CD_OpenAlways, sys::fs::OF_None)) {
+      LOG_S(ERROR) << "failed to open " << lock_path << ": " << ec.message();
+      return false;
+    }
+    if (!tryLockFile(lock_fd)) {
+      LOG_S(WARNING) << pack_path << " is locked by another process";
+      sys::Process::SafelyCloseFileDescriptor(lock_fd);
+      lock_fd = -1;
+      return false;
+    }
+    if (!openFiles())
+      return false;
+    uint64_t size = 0;
+    sys::fs::file_size(pack_path, size);
+    if (!loadFooter(size))
+      scan(size);
+    LOG_S(INFO) << "opened " << pack_path << " with " << entries.size()
+                << " entries, " << end << " bytes";
+    return true;
+  }
+
+  std::unique_ptr<MemoryBuffer> read(const std::string &path) override {
+    std::shared_lock lock(mutex);
+    if (!out)
+      return nullptr;
+    auto it = entries.find(key(path));
+    if (it == entries.end())
+      return nullptr;
+    return readAt(it->second.offset, it->second.size);
+  }
+
+  void write(const std::string &path, const std::string &content) override {
+    std::string k = key(path);
+    {
+      std::lock_guard lock(mutex);
+      Location loc;
+      if (!append(kPut, k, content, &loc))
+        return;
+      put(k, loc);
+      if (end < kMinCompactSize || end - live <= live)
+        return;
+    }
+    compact();
+  }
+
+  void remove(const std::string &path) override {
+    std::string k = key(path);
+    std::lock_guard lock(mutex);
+    auto it = entries.find(k);
+    if (it == entries.end())
+      return;
+    if (!append(kRemove, k, "", nullptr))
+      return;
+    live -= recordSize(k.size(), it->second.size);
+    entries.erase(it);
+  }
+
+  void flush() override {
+    std::lock_guard lock(mutex);
+    if (unindexed)
+      writeFooter();
+  }
+};
+
+Store *g_store;
+std::atomic<uint64_t> bytes_written;
+
+// Move cache files under cache.directory into |pack|: index files, the source
+// contents stored next to them and index.costs. Other files such as
+// db.snapshot and leftovers of interrupted writes are left alone.
+void migrate(PackStore &pack, const std::string &pack_path) {
+  std::error_code ec;
+  StringSet<> regular;
+  for (sys::fs::recursive_directory_iterator it(g_config->cache.directory, ec),
+       end;
+       it != end && !ec; it.increment(ec))
+    if (it->type() == sys::fs::file_type::regular_file)
+      regular.insert(it->path());
+  std::vector<std::string> files;
+  for (auto &e : regular) {
+    StringRef file = e.first(), ext = sys::path::extension(file);
+    if (ext == ".blob" || ext == ".json" || ext == ".flat") {
+      files.push_back(file.str());
+      StringRef content = file.drop_back(ext.size());
+      if (regular.count(content))
+        files.push_back(content.str());
+    }
+  }
+  std::string costs = g_config->cache.directory + "index.costs";
+  if (regular.count(costs))
+    files.push_back(costs);
+  if (files.empty())
+    return;
+  LOG_S(INFO) << "migrate " << files.size() << " cache files into "
+              << pack_path;
+  for (auto &file : files)
+    if (std::optional<std::string> content = readContent(file)) {
+      pack.write(file, *content);
+      (void)sys::fs::remove(file);
+    }
+  pack.flush();
+}
+} // namespace
+
+void init() {
+  if (g_config->cache.directory.empty())
+    return;
+  if (g_config->cache.store == "pack") {
+    std::string pack_path = g_config->cache.directory + "cache.pack";
+    bool exists = sys::fs::exists(pack_path);
+    auto pack = std::make_unique<PackStore>(pack_path);
+    if (pack->open()) {
+      if (!exists)
+        migrate(*pack, pack_path);
+      g_store = pack.release();
+      return;
+    }
+    LOG_S(WARNING) << "fall back to cache.store \"directory\"";
+  } else if (g_config->cache.store != "directory") {
+    LOG_S(WARNING) << "unknown cache.store: " << g_config->cache.store;
+  }
+  g_store = new DirectoryStore;
+}
+
+std::unique_ptr<MemoryBuffer> read(const std::string &path) {
+  return g_store ? g_store->read(path) : nullptr;
+}
+
+void write(const std::string &path, const std::string &content) {
+  bytes_written.fetch_add(content.size(), std::memory_order_relaxed);
+  if (g_store)
+    g_store->write(path, content);
+}
+
+void remove(const std::string &path) {
+  if (g_store)
+    g_store->remove(path);
+}
+
+uint64_t bytesWritten() {
+  return bytes_written.load(std::memory_order_relaxed);
+}
+
+void flush() {
+  if (g_store)
+    g_store->flush();
+}
+} // namespace ccls::cache_store
@@ -0,0 +1,34 @@
+// Copyright 2017-2018 ccls Authors
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+#include <llvm/Support/MemoryBuffer.h>
+
+#include <memory>
+#include <stdint.h>
+#include <string>
+
+namespace ccls::cache_store {
+// Where cache files live, selected by cache.store. Cache files are named by
+// their path under cache.directory, e.g. getCachePath(path) and the serialized
+// index next to it.
+//
+// "directory" stores each cache file as a regular file. "pack" appends them to
+// the log-structured $directory/cache.pack, which ends with an index of live
+// entries after a flush and is compacted when most of it is stale.
+
+// Open the store. If cache.store is "pack" and the pack file does not exist,
+// cache files of the "directory" layout are moved into it.
+void init();
+
+// Large files are mmap'ed. Returns nullptr if |path| does not exist.
+std::unique_ptr<llvm::MemoryBuffer> read(const std::string &path);
+void write(const std::string &path, const std::string &content);
+void remove(const std::string &path);
+// Bytes passed to write() by this process.
+uint64_t bytesWritten();
+
+// Make the store fast to open next time, e.g. write the index of a pack.
+void flush();
+} // namespace ccls::cache_store
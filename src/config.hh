@@ -46,6 +46,9 @@ struct Config {
     // "binary" uses a compact binary serialization format.
     // It is not schema-aware and you need to re-index whenever an internal
     // struct member has changed.
+    //
+    // "flat" is larger than "binary" but is mmap'ed and read in place, which
+    // makes loading the cache faster.
     SerializeFormat format = SerializeFormat::Binary;
 
     // If false, store cache files as $directory/@a@b/c.cc.blob
@@ -63,6 +66,23 @@ struct Config {
     // 0: never retain; 1: retain after initial load; 2: retain after 2 loads
     // (initial load+first save)
     int retainInMemory = 2;
+
+    // If true, save the query database to $directory/db.snapshot on exit and
+    // when indexing is idle, and load it on startup instead of loading every
+    // cache file. Files are then re-indexed only if they have changed.
+    bool snapshot = false;
+
+    // Minimum number of seconds between two snapshots taken when idle.
+    int snapshotInterval = 300;
+
+    // Where cache files are stored.
+    //
+    // "directory" stores two files per source under $directory.
+    //
+    // "pack" appends them to the single file $directory/cache.pack, which is
+    // cheaper on file systems with slow metadata operations. Existing
+    // "directory" caches are moved into it on first use.
+    std::string store = "directory";
   } cache;
 
   struct ServerCap {
@@ -265,6 +285,11 @@ struct Config {
     // lines, include the initializer in detailed_name.
     int maxInitializerLines = 5;
 
+    // If not 0, the number of indexer threads parsing at the same time is
+    // halved while the resident set size of ccls and its index workers
+    // exceeds this many MiB, and raised by one while it is below 80% of it.
+    int memoryBudget = 0;
+
     // If not 0, a file will be indexed in each tranlation unit that includes
     // it.
     int multiVersion = 0;
@@ -286,6 +311,13 @@ struct Config {
     // If true, index parameters in declarations.
     bool parametersInDeclarations = true;
 
+    // If positive, background indexing groups translation units by compile
+    // flags, builds a precompiled preamble for the include prefix shared by
+    // most translation units of a group, and parses them on top of it. Headers
+    // in the prefix are then indexed once per group. At most this many
+    // preambles are kept in memory.
+    int sharedPreamble = 0;
+
     // Number of indexer threads. If 0, 80% of cores are used.
     int threads = 0;
 
@@ -294,13 +326,39 @@ struct Config {
     // 0: no, 1: only during initial load of project, 2: yes
     int trackDependency = 2;
 
+    // If true, watch the workspace folders and the directories of indexed
+    // files with inotify (Linux only) and re-index files changed on disk. If
+    // the watch limit (fs.inotify.max_user_watches) is reached, or on other
+    // platforms, workspace/didChangeWatchedFiles from the client is used.
+    bool watch = false;
+
     std::vector<std::string> whitelist;
+
+    struct Worker {
+      // If true, translation units are parsed in `ccls --index-worker`
+      // processes, one per indexer thread, instead of in the ccls process. A
+      // crash or leak in clang then does not affect the ccls process. Only
+      // supported on POSIX systems.
+      bool enabled = false;
+
+      // A worker is restarted after its resident set size exceeds this many
+      // MiB. 0: no limit
+      int maxRss = 0;
+
+      // A worker is restarted after it has parsed this many translation units.
+      // 0: no limit
+      int maxTUs = 100;
+    } worker;
   } index;
 
   struct Request {
     // If the document of a request has not been indexed, wait up to this many
     // milleseconds before reporting error.
     int64_t timeout = 5000;
+
+    // If not 0, log per-method latency statistics (see $ccls/stats) every
+    // this many seconds.
+    int statsInterval = 0;
   } request;
 
   struct Session {
@@ -323,7 +381,7 @@ struct Config {
   } xref;
 };
 REFLECT_STRUCT(Config::Cache, directory, format, hierarchicalPath,
-               retainInMemory);
+               retainInMemory, snapshot, snapshotInterval, store);
 REFLECT_STRUCT(Config::ServerCap::DocumentOnTypeFormattingOptions,
                firstTriggerCharacter, moreTriggerCharacter);
 REFLECT_STRUCT(Config::ServerCap::Workspace::WorkspaceFolders, supported,
@@ -345,12 +403,14 @@ REFLECT_STRUCT(Config::Diagnostics, blacklist, onChange, onOpen, onSave,
                spellChecking, whitelist)
 REFLECT_STRUCT(Config::Highlight, largeFileSize, lsRanges, blacklist, whitelist)
 REFLECT_STRUCT(Config::Index::Name, suppressUnwrittenScope);
+REFLECT_STRUCT(Config::Index::Worker, enabled, maxRss, maxTUs);
 REFLECT_STRUCT(Config::Index, blacklist, comments, initialNoLinkage,
                initialBlacklist, initialWhitelist, maxInitializerLines,
-               multiVersion, multiVersionBlacklist, multiVersionWhitelist, name,
-               onChange, parametersInDeclarations, threads, trackDependency,
-               whitelist);
-REFLECT_STRUCT(Config::Request, timeout);
+               memoryBudget, multiVersion, multiVersionBlacklist,
+               multiVersionWhitelist, name, onChange, parametersInDeclarations,
+               sharedPreamble, threads, trackDependency, watch, whitelist,
+               worker);
+REFLECT_STRUCT(Config::Request, timeout, statsInterval);
 REFLECT_STRUCT(Config::Session, maxNum);
 REFLECT_STRUCT(Config::WorkspaceSymbol, caseSensitivity, maxNum, sort);
 REFLECT_STRUCT(Config::Xref, maxNum);
@@ -0,0 +1,262 @@
+// Copyright 2017-2018 ccls Authors
+// SPDX-License-Identifier: Apache-2.0
+
+#include "file_cache.hh"
+
+#include "utils.hh"
+
+#include <llvm/ADT/StringMap.h>
+#include <llvm/Support/Errc.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/Path.h>
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+using namespace llvm;
+namespace chrono = std::chrono;
+
+namespace ccls::file_cache {
+namespace {
+constexpr auto kRevalidateInterval = chrono::seconds(1);
+constexpr int kShards = 64;
+// Contents are evicted across all shards to keep their total within this.
+constexpr size_t kMaxBytes = size_t(1) << 30;
+
+struct Entry {
+  vfs::Status status;
+  std::error_code err;
+  chrono::steady_clock::time_point checked;
+  std::shared_ptr<MemoryBuffer> buf;
+  // Valid while status is unchanged.
+  uint64_t hash = 0;
+  // Set when buf is used, cleared by the eviction sweep.
+  bool referenced = false;
+};
+
+struct Shard {
+  std::mutex mutex;
+  StringMap<Entry> entries;
+} shards[kShards];
+std::atomic<size_t> total_bytes{0};
+// Serializes eviction sweeps. |hand| is the next shard to sweep.
+std::mutex evict_mutex;
+int hand = 0;
+
+Shard &getShard(StringRef path) { return shards[hash_value(path) % kShards]; }
+
+bool sameFile(const vfs::Status &a, const vfs::Status &b) {
+  return a.getType() == b.getType() && a.getSize() == b.getSize() &&
+         a.getLastModificationTime() == b.getLastModificationTime();
+}
+
+void dropBuffer(Entry &e) {
+  if (e.buf) {
+    total_bytes -= e.buf->getBufferSize();
+    e.buf.reset();
+  }
+}
+
+// Make room for |size| bytes with a clock sweep over the shards: buffers used
+// since the last visit get a second chance, others are dropped. Only one shard
+// is locked at a time.
+void evict(size_t size) {
+  std::lock_guard evict_lock(evict_mutex);
+  for (int i = 0; i < 2 * kShards && total_bytes + size > kMaxBytes; i++) {
+    Shard &shard = shards[hand];
+    hand = (hand + 1) % kShards;
+    std::lock_guard lock(shard.mutex);
+    for (auto &it : shard.entries) {
+      Entry &e = it.second;
+      if (!e.buf)
+        continue;
+      if (e.referenced) {
+        e.referenced = false;
+      } else {
+        dropBuffer(e);
+        if (total_bytes + size <= kMaxBytes)
+          break;
+      }
+    }
+  }
+}
+
+ErrorOr<vfs::Status> getStatus(vfs::FileSystem &fs, StringRef path) {
+  Shard &shard = getShard(path);
+  auto now = chrono::steady_clock::now();
+  {
+    std::lock_guard lock(shard.mutex);
+    auto it = shard.entries.find(path);
+    if (it != shard.entries.end() &&
+        now - it->second.checked < kRevalidateInterval) {
+      if (it->second.err)
+        return it->second.err;
+      return it->second.status;
+    }
+  }
+  ErrorOr<vfs::Status> st = fs.status(path);
+  std::lock_guard lock(shard.mutex);
+  Entry &e = shard.entries[path];
+  if (!st || !sameFile(*st, e.status)) {
+    dropBuffer(e);
+    e.hash = 0;
+  }
+  if (st) {
+    e.status = *st;
+    e.err = {};
+  } else {
+    e.err = st.getError();
+  }
+  e.checked = now;
+  return st;
+}
+
+ErrorOr<std::pair<vfs::Status, std::shared_ptr<MemoryBuffer>>>
+getContent(vfs::FileSystem &fs, StringRef path) {
+  ErrorOr<vfs::Status> st = getStatus(fs, path);
+  if (!st)
+    return st.getError();
+  if (st->isDirectory())
+    return make_error_code(errc::is_a_directory);
+  Shard &shard = getShard(path);
+  {
+    std::lock_guard lock(shard.mutex);
+    Entry &e = shard.entries[path];
+    if (e.buf && sameFile(e.status, *st)) {
+      e.referenced = true;
+      return std::make_pair(*st, e.buf);
+    }
+  }
+
+  auto file = fs.openFileForRead(path);
+  if (!file)
+    return file.getError();
+  // Large files are mmap'ed by MemoryBuffer.
+  auto buf = (*file)->getBuffer(path, st->getSize(), true, false);
+  if (!buf)
+    return buf.getError();
+  std::shared_ptr<MemoryBuffer> shared(std::move(*buf));
+  size_t size = shared->getBufferSize();
+  if (size > kMaxBytes)
+    return std::make_pair(*st, shared);
+  if (total_bytes + size > kMaxBytes)
+    evict(size);
+
+  std::lock_guard lock(shard.mutex);
+  Entry &e = shard.entries[path];
+  if (!e.buf && sameFile(e.status, *st)) {
+    e.buf = shared;
+    e.referenced = false;
+    total_bytes += size;
+  }
+  return std::make_pair(*st, shared);
+}
+
+// Keeps the cached buffer alive while clang uses it.
+class SharedBuffer : public MemoryBuffer {
+  std::shared_ptr<MemoryBuffer> buf;
+
+public:
+  SharedBuffer(std::shared_ptr<MemoryBuffer> buf) : buf(std::move(buf)) {
+    init(this->buf->getBufferStart(), this->buf->getBufferEnd(), true);
+  }
+  BufferKind getBufferKind() const override { return buf->getBufferKind(); }
+  StringRef getBufferIdentifier() const override {
+    return buf->getBufferIdentifier();
+  }
+};
+
+class CachedFile : public vfs::File {
+  vfs::Status status_;
+  std::shared_ptr<MemoryBuffer> buf;
+
+public:
+  CachedFile(vfs::Status status, std::shared_ptr<MemoryBuffer> buf)
+      : status_(std::move(status)), buf(std::move(buf)) {}
+  ErrorOr<vfs::Status> status() override { return status_; }
+  ErrorOr<std::unique_ptr<MemoryBuffer>> getBuffer(const Twine &, int64_t,
+                                                   bool, bool) override {
+    return std::unique_ptr<MemoryBuffer>(new SharedBuffer(buf));
+  }
+  std::error_code close() override { return {}; }
+};
+
+class CachingFileSystem : public vfs::ProxyFileSystem {
+public:
+  using ProxyFileSystem::ProxyFileSystem;
+
+  ErrorOr<vfs::Status> status(const Twine &path) override {
+    SmallString<256> storage;
+    StringRef p = path.toStringRef(storage);
+    if (!sys::path::is_absolute(p))
+      return ProxyFileSystem::status(path);
+    return getStatus(getUnderlyingFS(), p);
+  }
+
+  ErrorOr<std::unique_ptr<vfs::File>>
+  openFileForRead(const Twine &path) override {
+    SmallString<256> storage;
+    StringRef p = path.toStringRef(storage);
+    if (!sys::path::is_absolute(p))
+      return ProxyFileSystem::openFileForRead(path);
+    auto content = getContent(getUnderlyingFS(), p);
+    if (!content)
+      return content.getError();
+    return std::unique_ptr<vfs::File>(
+        new CachedFile(content->first, std::move(content->second)));
+  }
+};
+} // namespace
+
+IntrusiveRefCntPtr<vfs::FileSystem> getFileSystem() {
+  static IntrusiveRefCntPtr<vfs::FileSystem> fs =
+      new CachingFileSystem(vfs::getRealFileSystem());
+  return fs;
+}
+
+std::optional<std::string> read(const std::string &path) {
+  auto content = getContent(*vfs::getRealFileSystem(), path);
+  if (!content)
+    return {};
+  return content->second->getBuffer().str();
+}
+
+std::optional<uint64_t> hash(const std::string &path) {
+  auto content = getContent(*vfs::getRealFileSystem(), path);
+  if (!content)
+    return {};
+  Shard &shard = getShard(path);
+  {
+    std::lock_guard lock(shard.mutex);
+    Entry &e = shard.entries[path];
+    if (e.hash && sameFile(e.status, content->first))
+      return e.hash;
+  }
+  uint64_t h = hashContent(content->second->getBuffer());
+  std::lock_guard lock(shard.mutex);
+  Entry &e = shard.entries[path];
+  if (sameFile(e.status, content->first))
+    e.hash = h;
+  return h;
+}
+
+void invalidate(const std::string &path) {
+  Shard &shard = getShard(path);
+  std::lock_guard lock(shard.mutex);
+  auto it = shard.entries.find(path);
+  if (it != shard.entries.end()) {
+    dropBuffer(it->second);
+    shard.entries.erase(it);
+  }
+}
+
+void clear() {
+  for (Shard &shard : shards) {
+    std::lock_guard lock(shard.mutex);
+    for (auto &it : shard.entries)
+      dropBuffer(it.second);
+    shard.entries.clear();
+  }
+}
+} // namespace ccls::file_cache
@@ -0,0 +1,34 @@
+// Copyright 2017-2018 ccls Authors
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+#include <llvm/ADT/IntrusiveRefCntPtr.h>
+#include <llvm/Support/VirtualFileSystem.h>
+
+#include <stdint.h>
+
+#include <optional>
+#include <string>
+
+namespace ccls::file_cache {
+// A process-wide cache of stat results and file contents, shared by indexer
+// threads. A cached result is revalidated with a stat(2) once it is older than
+// a second, and contents are dropped when the modification time or size
+// changes. Large files are mmap'ed.
+
+// Returns a file system that serves absolute paths from the cache and forwards
+// other operations to the real file system.
+llvm::IntrusiveRefCntPtr<llvm::vfs::FileSystem> getFileSystem();
+
+std::optional<std::string> read(const std::string &path);
+
+// hashContent of |path|, computed at most once per version of the file.
+std::optional<uint64_t> hash(const std::string &path);
+
+// Forget the cached state of |path|, e.g. after the editor has saved it.
+void invalidate(const std::string &path);
+
+// Forget everything.
+void clear();
+} // namespace ccls::file_cache
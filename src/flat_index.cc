@@ -0,0 +1,425 @@
+// Copyright 2017-2018 ccls Authors
+// SPDX-License-Identifier: Apache-2.0
+
+#include "flat_index.hh"
+
+#include "log.hh"
+
+#include <llvm/ADT/ArrayRef.h>
+#include <llvm/ADT/DenseMap.h>
+#include <llvm/Support/MathExtras.h>
+
+#include <initializer_list>
+#include <stdexcept>
+#include <string.h>
+#include <type_traits>
+
+using namespace llvm;
+
+namespace ccls {
+namespace {
+constexpr char kMagic[8] = {'c', 'c', 'l', 's', 'f', 'l', 'a', 't'};
+
+// Elements [offset, offset+size) of an array section.
+struct Span {
+  uint32_t offset, size;
+};
+
+// An array starting at a byte offset, aligned to 8.
+struct Section {
+  uint64_t offset, size;
+};
+
+struct FlatFunc {
+  Usr usr;
+  uint32_t detailed_name, hover, comments;
+  Maybe<DeclRef> spell;
+  Span bases, vars, callees; // usrs, usrs, refs
+  Span declarations, derived, uses;
+  int16_t qual_name_offset, short_name_offset, short_name_size;
+  SymbolKind kind, parent_kind;
+  uint8_t storage;
+};
+
+struct FlatType {
+  Usr usr;
+  uint32_t detailed_name, hover, comments;
+  Maybe<DeclRef> spell;
+  Span bases, funcs, types, vars; // usrs, usrs, usrs, members
+  Usr alias_of;
+  Span declarations, derived, instances, uses;
+  int16_t qual_name_offset, short_name_offset, short_name_size;
+  SymbolKind kind, parent_kind;
+};
+
+struct FlatVar {
+  Usr usr;
+  uint32_t detailed_name, hover, comments;
+  Maybe<DeclRef> spell;
+  Usr type;
+  Span declarations, uses;
+  int16_t qual_name_offset, short_name_offset, short_name_size;
+  SymbolKind kind, parent_kind;
+  uint8_t storage;
+};
+
+// TypeDef::vars
+struct FlatMember {
+  Usr usr;
+  int64_t offset;
+};
+
+struct FlatLid {
+  int32_t lid;
+  uint32_t path;
+};
+
+struct FlatDependency {
+  uint32_t path;
+  int64_t mtime;
+  uint64_t hash;
+};
+
+struct FlatInclude {
+  int32_t line;
+  uint32_t resolved_path;
+};
+
+struct Header {
+  char magic[8];
+  int32_t major, minor;
+  uint32_t layout;
+  int32_t language;
+  int64_t mtime;
+  uint64_t hash;
+  uint32_t import_file;
+  uint8_t no_linkage;
+  Section strings, usrs, uses, decls, refs, members, ranges;
+  Section funcs, types, vars, lid2path, args, dependencies, includes;
+};
+
+// Changes when a record changes size, which also rejects files written by a
+// build with a different ABI.
+constexpr uint32_t computeLayout() {
+  uint32_t h = 0;
+  for (size_t size :
+       {sizeof(Header), sizeof(FlatFunc), sizeof(FlatType), sizeof(FlatVar),
+        sizeof(FlatMember), sizeof(FlatLid), sizeof(FlatDependency),
+        sizeof(FlatInclude), sizeof(Use), sizeof(DeclRef), sizeof(SymbolRef),
+        sizeof(Range), sizeof(Usr)})
+    h = h * 31 + uint32_t(size);
+  return h;
+}
+constexpr uint32_t kLayout = computeLayout();
+
+struct FlatWriter {
+  std::string strings;
+  DenseMap<StringRef, uint32_t> string2offset;
+  std::vector<Usr> usrs;
+  std::vector<Use> uses;
+  std::vector<DeclRef> decls;
+  std::vector<SymbolRef> refs;
+  std::vector<FlatMember> members;
+  std::vector<FlatFunc> funcs;
+  std::vector<FlatType> types;
+  std::vector<FlatVar> vars;
+
+  // |s| must outlive the writer.
+  uint32_t str(StringRef s) {
+    auto [it, inserted] = string2offset.try_emplace(s, strings.size());
+    if (inserted) {
+      strings.append(s.data(), s.size());
+      strings += '\0';
+    }
+    return it->second;
+  }
+
+  template <typename T, typename C>
+  Span add(std::vector<T> &to, const C &from) {
+    Span span{uint32_t(to.size()), uint32_t(from.size())};
+    to.insert(to.end(), from.begin(), from.end());
+    return span;
+  }
+};
+
+template <typename T>
+void appendSection(std::string &out, Section &sec, const T *data, size_t n) {
+  static_assert(std::is_trivially_copyable_v<T>);
+  out.resize(alignTo(out.size(), 8));
+  sec = {out.size(), n};
+  out.append(reinterpret_cast<const char *>(data), n * sizeof(T));
+}
+template <typename T>
+void appendSection(std::string &out, Section &sec, const std::vector<T> &v) {
+  appendSection(out, sec, v.data(), v.size());
+}
+
+struct FlatReader {
+  std::string_view data;
+  ArrayRef<char> strings;
+  DenseMap<uint32_t, const char *> interned;
+
+  template <typename T> ArrayRef<T> section(const Section &sec) {
+    if (sec.offset % alignof(T) || sec.offset > data.size() ||
+        sec.size > (data.size() - sec.offset) / sizeof(T))
+      throw std::invalid_argument("invalid section");
+    return {reinterpret_cast<const T *>(data.data() + sec.offset),
+            size_t(sec.size)};
+  }
+
+  template <typename T> ArrayRef<T> slice(ArrayRef<T> a, Span span) {
+    if (span.offset > a.size() || span.size > a.size() - span.offset)
+      throw std::invalid_argument("invalid span");
+    return a.slice(span.offset, span.size);
+  }
+  template <typename T> std::vector<T> vec(ArrayRef<T> a, Span span) {
+    ArrayRef<T> r = slice(a, span);
+    return {r.begin(), r.end()};
+  }
+
+  // The string table ends with a NUL, so strlen stops inside it.
+  StringRef strRef(uint32_t offset) {
+    if (offset >= strings.size())
+      throw std::invalid_argument("invalid string");
+    return StringRef(strings.data() + offset);
+  }
+  const char *str(uint32_t offset) {
+    auto [it, inserted] = interned.try_emplace(offset, nullptr);
+    if (inserted)
+      it->second = intern(strRef(offset));
+    return it->second;
+  }
+};
+} // namespace
+
+std::string serializeFlat(IndexFile &file) {
+  FlatWriter w;
+  Header h;
+  memset(&h, 0, sizeof h);
+  memcpy(h.magic, kMagic, sizeof kMagic);
+  h.major = IndexFile::kMajorVersion;
+  h.minor = IndexFile::kMinorVersion;
+  h.layout = kLayout;
+  h.language = int32_t(file.language);
+  h.mtime = file.mtime;
+  h.hash = file.hash;
+  h.import_file = w.str(file.import_file);
+  h.no_linkage = file.no_linkage;
+
+  for (auto &[usr, func] : file.usr2func) {
+    auto &def = func.def;
+    FlatFunc &f = w.funcs.emplace_back();
+    f.usr = usr;
+    f.detailed_name = w.str(def.detailed_name);
+    f.hover = w.str(def.hover);
+    f.comments = w.str(def.comments);
+    f.spell = def.spell;
+    f.bases = w.add(w.usrs, def.bases);
+    f.vars = w.add(w.usrs, def.vars);
+    f.callees = w.add(w.refs, def.callees);
+    f.declarations = w.add(w.decls, func.declarations);
+    f.derived = w.add(w.usrs, func.derived);
+    f.uses = w.add(w.uses, func.uses);
+    f.qual_name_offset = def.qual_name_offset;
+    f.short_name_offset = def.short_name_offset;
+    f.short_name_size = def.short_name_size;
+    f.kind = def.kind;
+    f.parent_kind = def.parent_kind;
+    f.storage = def.storage;
+  }
+  for (auto &[usr, type] : file.usr2type) {
+    auto &def = type.def;
+    FlatType &t = w.types.emplace_back();
+    t.usr = usr;
+    t.detailed_name = w.str(def.detailed_name);
+    t.hover = w.str(def.hover);
+    t.comments = w.str(def.comments);
+    t.spell = def.spell;
+    t.bases = w.add(w.usrs, def.bases);
+    t.funcs = w.add(w.usrs, def.funcs);
+    t.types = w.add(w.usrs, def.types);
+    t.vars = {uint32_t(w.members.size()), uint32_t(def.vars.size())};
+    for (auto &[var, offset] : def.vars)
+      w.members.push_back({var, offset});
+    t.alias_of = def.alias_of;
+    t.declarations = w.add(w.decls, type.declarations);
+    t.derived = w.add(w.usrs, type.derived);
+    t.instances = w.add(w.usrs, type.instances);
+    t.uses = w.add(w.uses, type.uses);
+    t.qual_name_offset = def.qual_name_offset;
+    t.short_name_offset = def.short_name_offset;
+    t.short_name_size = def.short_name_size;
+    t.kind = def.kind;
+    t.parent_kind = def.parent_kind;
+  }
+  for (auto &[usr, var] : file.usr2var) {
+    auto &def = var.def;
+    FlatVar &v = w.vars.emplace_back();
+    v.usr = usr;
+    v.detailed_name = w.str(def.detailed_name);
+    v.hover = w.str(def.hover);
+    v.comments = w.str(def.comments);
+    v.spell = def.spell;
+    v.type = def.type;
+    v.declarations = w.add(w.decls, var.declarations);
+    v.uses = w.add(w.uses, var.uses);
+    v.qual_name_offset = def.qual_name_offset;
+    v.short_name_offset = def.short_name_offset;
+    v.short_name_size = def.short_name_size;
+    v.kind = def.kind;
+    v.parent_kind = def.parent_kind;
+    v.storage = def.storage;
+  }
+
+  std::vector<FlatLid> lid2path;
+  for (auto &[lid, path] : file.lid2path)
+    lid2path.push_back({lid, w.str(path)});
+  std::vector<uint32_t> args;
+  for (const char *arg : file.args)
+    args.push_back(w.str(arg));
+  std::vector<FlatDependency> dependencies;
+  for (auto &it : file.dependencies)
+    dependencies.push_back(
+        {w.str(it.first.val()), it.second.mtime, it.second.hash});
+  std::vector<FlatInclude> includes;
+  for (auto &include : file.includes)
+    includes.push_back({include.line, w.str(include.resolved_path)});
+
+  // The header is patched after the section offsets are known.
+  std::string out(sizeof h, '\0');
+  appendSection(out, h.usrs, w.usrs);
+  appendSection(out, h.uses, w.uses);
+  appendSection(out, h.decls, w.decls);
+  appendSection(out, h.refs, w.refs);
+  appendSection(out, h.members, w.members);
+  appendSection(out, h.ranges, file.skipped_ranges);
+  appendSection(out, h.funcs, w.funcs);
+  appendSection(out, h.types, w.types);
+  appendSection(out, h.vars, w.vars);
+  appendSection(out, h.lid2path, lid2path);
+  appendSection(out, h.args, args);
+  appendSection(out, h.dependencies, dependencies);
+  appendSection(out, h.includes, includes);
+  appendSection(out, h.strings, w.strings.data(), w.strings.size());
+  memcpy(&out[0], &h, sizeof h);
+  return out;
+}
+
+std::unique_ptr<IndexFile> deserializeFlat(std::string_view data,
+                                           const std::string &path,
+                                           const std::string &file_content) {
+  Header h;
+  if (data.size() < sizeof h ||
+      reinterpret_cast<uintptr_t>(data.data()) % alignof(Header))
+    return nullptr;
+  memcpy(&h, data.data(), sizeof h);
+  if (memcmp(h.magic, kMagic, sizeof kMagic) ||
+      h.major != IndexFile::kMajorVersion ||
+      h.minor != IndexFile::kMinorVersion || h.layout != kLayout)
+    return nullptr;
+
+  auto file = std::make_unique<IndexFile>(path, file_content, false);
+  FlatReader r;
+  r.data = data;
+  try {
+    r.strings = r.section<char>(h.strings);
+    if (r.strings.empty() || r.strings.back() != '\0')
+      throw std::invalid_argument("invalid string table");
+    auto usrs = r.section<Usr>(h.usrs);
+    auto uses = r.section<Use>(h.uses);
+    auto decls = r.section<DeclRef>(h.decls);
+    auto refs = r.section<SymbolRef>(h.refs);
+    auto members = r.section<FlatMember>(h.members);
+
+    file->mtime = h.mtime;
+    file->hash = h.hash;
+    file->language = LanguageId(h.language);
+    file->no_linkage = h.no_linkage;
+    file->import_file = r.strRef(h.import_file).str();
+    for (const FlatLid &lid : r.section<FlatLid>(h.lid2path))
+      file->lid2path.emplace_back(lid.lid, r.strRef(lid.path).str());
+    for (uint32_t arg : r.section<uint32_t>(h.args))
+      file->args.push_back(r.str(arg));
+    for (const FlatDependency &dep : r.section<FlatDependency>(h.dependencies))
+      file->dependencies[internH(r.strRef(dep.path))] = {dep.mtime, dep.hash};
+    for (const FlatInclude &include : r.section<FlatInclude>(h.includes))
+      file->includes.push_back({include.line, r.str(include.resolved_path)});
+    auto ranges = r.section<Range>(h.ranges);
+    file->skipped_ranges.assign(ranges.begin(), ranges.end());
+
+    auto funcs = r.section<FlatFunc>(h.funcs);
+    file->usr2func.reserve(funcs.size());
+    for (const FlatFunc &f : funcs) {
+      IndexFunc &func = file->usr2func[f.usr];
+      auto &def = func.def;
+      func.usr = f.usr;
+      def.detailed_name = r.str(f.detailed_name);
+      def.hover = r.str(f.hover);
+      def.comments = r.str(f.comments);
+      def.spell = f.spell;
+      def.bases = r.vec(usrs, f.bases);
+      def.vars = r.vec(usrs, f.vars);
+      def.callees = r.vec(refs, f.callees);
+      func.declarations = r.vec(decls, f.declarations);
+      func.derived = r.vec(usrs, f.derived);
+      func.uses = r.vec(uses, f.uses);
+      def.qual_name_offset = f.qual_name_offset;
+      def.short_name_offset = f.short_name_offset;
+      def.short_name_size = f.short_name_size;
+      def.kind = f.kind;
+      def.parent_kind = f.parent_kind;
+      def.storage = f.storage;
+    }
+    auto types = r.section<FlatType>(h.types);
+    file->usr2type.reserve(types.size());
+    for (const FlatType &t : types) {
+      IndexType &type = file->usr2type[t.usr];
+      auto &def = type.def;
+      type.usr = t.usr;
+      def.detailed_name = r.str(t.detailed_name);
+      def.hover = r.str(t.hover);
+      def.comments = r.str(t.comments);
+      def.spell = t.spell;
+      def.bases = r.vec(usrs, t.bases);
+      def.funcs = r.vec(usrs, t.funcs);
+      def.types = r.vec(usrs, t.types);
+      for (const FlatMember &m : r.slice(members, t.vars))
+        def.vars.emplace_back(m.usr, m.offset);
+      def.alias_of = t.alias_of;
+      type.declarations = r.vec(decls, t.declarations);
+      type.derived = r.vec(usrs, t.derived);
+      type.instances = r.vec(usrs, t.instances);
+      type.uses = r.vec(uses, t.uses);
+      def.qual_name_offset = t.qual_name_offset;
+      def.short_name_offset = t.short_name_offset;
+      def.short_name_size = t.short_name_size;
+      def.kind = t.kind;
+      def.parent_kind = t.parent_kind;
+    }
+    auto vars = r.section<FlatVar>(h.vars);
+    file->usr2var.reserve(vars.size());
+    for (const FlatVar &v : vars) {
+      IndexVar &var = file->usr2var[v.usr];
+      auto &def = var.def;
+      var.usr = v.usr;
+      def.detailed_name = r.str(v.detailed_name);
+      def.hover = r.str(v.hover);
+      def.comments = r.str(v.comments);
+      def.spell = v.spell;
+      def.type = v.type;
+      var.declarations = r.vec(decls, v.declarations);
+      var.uses = r.vec(uses, v.uses);
+      def.qual_name_offset = v.qual_name_offset;
+      def.short_name_offset = v.short_name_offset;
+      def.short_name_size = v.short_name_size;
+      def.kind = v.kind;
+      def.parent_kind = v.parent_kind;
+      def.storage = v.storage;
+    }
+  } catch (std::invalid_argument &e) {
+    LOG_S(INFO) << "failed to deserialize '" << path << "': " << e.what();
+    return nullptr;
+  }
+  return file;
+}
+} // namespace ccls
@@ -0,0 +1,26 @@
+// Copyright 2017-2018 ccls Authors
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+#include "indexer.hh"
+
+#include <memory>
+#include <string>
+#include <string_view>
+
+namespace ccls {
+// SerializeFormat::Flat lays out an IndexFile as a header followed by arrays of
+// fixed-size records. Variable-length members refer to ranges of shared arrays
+// and strings are offsets into a string table, so a file can be mmap'ed and
+// read in place: each vector of Use/DeclRef/SymbolRef/Usr is filled with one
+// copy and each distinct string is interned once. The layout depends on the
+// ABI and is only meant for the local cache.
+std::string serializeFlat(IndexFile &file);
+
+// |data| must be 8-byte aligned. Returns nullptr if it is not a valid Flat file
+// of the current version.
+std::unique_ptr<IndexFile> deserializeFlat(std::string_view data,
+                                           const std::string &path,
+                                           const std::string &file_content);
+} // namespace ccls
@@ -0,0 +1,111 @@
+// Copyright 2017-2018 ccls Authors
+// SPDX-License-Identifier: Apache-2.0
+
+#include "index_cost.hh"
+
+#include "cache_store.hh"
+#include "config.hh"
+#include "log.hh"
+#include "serializer.hh"
+#include "utils.hh"
+
+#include <llvm/ADT/StringMap.h>
+
+#include <mutex>
+#include <string.h>
+
+using namespace llvm;
+
+namespace ccls::index_cost {
+namespace {
+constexpr char kMagic[8] = {'c', 'c', 'l', 's', 'c', 'o', 's', 't'};
+// Bump when the layout of the file changes.
+constexpr int kVersion = 1;
+
+std::mutex mtx;
+StringMap<Cost> costs;
+// Sum of Cost::ms, for the average.
+int64_t total_ms = 0;
+bool dirty = false;
+
+std::string getPath() { return g_config->cache.directory + "index.costs"; }
+} // namespace
+
+void init() {
+  if (g_config->cache.directory.empty())
+    return;
+  auto buf = cache_store::read(getPath());
+  if (!buf)
+    return;
+  StringRef data = buf->getBuffer();
+  uint64_t hash;
+  if (data.size() < sizeof kMagic + sizeof hash ||
+      memcmp(data.data(), kMagic, sizeof kMagic))
+    return;
+  memcpy(&hash, data.data() + sizeof kMagic, sizeof hash);
+  data = data.drop_front(sizeof kMagic + sizeof hash);
+  if (data.empty() || hash != hashContent(data))
+    return;
+  BinaryReader r(std::string_view(data.data(), data.size()));
+  if (r.varUInt() != kVersion)
+    return;
+  std::lock_guard lock(mtx);
+  for (size_t n = r.varUInt(); n; n--) {
+    std::string path = r.getString();
+    Cost &cost = costs[path];
+    cost.ms = r.varInt();
+    cost.rss = r.varInt();
+    cost.symbols = r.varInt();
+    total_ms += cost.ms;
+  }
+  LOG_S(INFO) << "loaded index costs of " << costs.size() << " files";
+}
+
+void record(const std::string &path, const Cost &cost) {
+  std::lock_guard lock(mtx);
+  auto [it, inserted] = costs.try_emplace(path, cost);
+  if (!inserted) {
+    total_ms -= it->second.ms;
+    int64_t rss = it->second.rss;
+    it->second = cost;
+    // Keep a known value over an unknown one.
+    if (!cost.rss)
+      it->second.rss = rss;
+  }
+  total_ms += cost.ms;
+  dirty = true;
+}
+
+int64_t estimate(const std::string &path) {
+  std::lock_guard lock(mtx);
+  auto it = costs.find(path);
+  if (it != costs.end())
+    return it->second.ms;
+  return costs.empty() ? 0 : total_ms / int64_t(costs.size());
+}
+
+void save() {
+  if (g_config->cache.directory.empty())
+    return;
+  BinaryWriter w;
+  {
+    std::lock_guard lock(mtx);
+    if (!dirty)
+      return;
+    dirty = false;
+    w.varUInt(kVersion);
+    w.varUInt(costs.size());
+    for (auto &it : costs) {
+      w.string(it.first().data(), it.first().size());
+      w.varInt(it.second.ms);
+      w.varInt(it.second.rss);
+      w.varInt(it.second.symbols);
+    }
+  }
+  std::string body = w.take(), content(kMagic, sizeof kMagic);
+  uint64_t hash = hashContent(body);
+  content.append(reinterpret_cast<const char *>(&hash), sizeof hash);
+  content += body;
+  cache_store::write(getPath(), content);
+}
+} // namespace ccls::index_cost
@@ -0,0 +1,33 @@
+// Copyright 2017-2018 ccls Authors
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+#include <stdint.h>
+#include <string>
+
+namespace ccls::index_cost {
+// What it took to parse and index a translation unit the last time. Stored in
+// $directory/index.costs through cache_store, so that later crawls can start
+// the most expensive translation units first.
+struct Cost {
+  int64_t ms = 0;
+  // Peak growth of the resident set size while parsing, in bytes, or 0 if
+  // unknown, e.g. when parsed in-process alongside other translation units.
+  int64_t rss = 0;
+  int64_t symbols = 0;
+};
+
+// Load the costs recorded by a previous session, after cache_store::init.
+void init();
+
+// Called by indexers after a translation unit has been parsed.
+void record(const std::string &path, const Cost &cost);
+
+// Estimated milliseconds to index |path|. Unknown files are assumed to cost
+// as much as the average known file. Returns 0 if nothing is known.
+int64_t estimate(const std::string &path);
+
+// Write the costs if they have changed since the last save.
+void save();
+} // namespace ccls::index_cost
@@ -0,0 +1,447 @@
+// Copyright 2017-2018 ccls Authors
+// SPDX-License-Identifier: Apache-2.0
+
+#include "index_worker.hh"
+
+#include "config.hh"
+#include "file_cache.hh"
+#include "log.hh"
+#include "pipeline.hh"
+#include "platform.hh"
+#include "serializer.hh"
+#include "working_files.hh"
+
+#include <llvm/Support/FileSystem.h>
+
+#include <rapidjson/document.h>
+#include <rapidjson/stringbuffer.h>
+#include <rapidjson/writer.h>
+
+#if defined(__unix__) || defined(__APPLE__) || defined(__HAIKU__)
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#define CCLS_INDEX_WORKER 1
+extern char **environ;
+#endif
+
+#include <atomic>
+#include <deque>
+#include <mutex>
+
+namespace ccls::index_worker {
+#if CCLS_INDEX_WORKER
+namespace {
+// Each message is a frame: a 64-bit length followed by the payload. A request
+// or a result is a header frame (serialized with BinaryWriter, starting with a
+// MessageKind) followed by raw frames of file contents, which may contain NUL.
+enum MessageKind : uint8_t { kInit, kIndex, kStamp, kStampReply, kResult };
+
+bool writeAll(int fd, const char *p, size_t n) {
+  while (n) {
+#ifdef MSG_NOSIGNAL
+    ssize_t r = send(fd, p, n, MSG_NOSIGNAL);
+#else
+    ssize_t r = write(fd, p, n);
+#endif
+    if (r < 0) {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    p += r;
+    n -= r;
+  }
+  return true;
+}
+
+bool readAll(int fd, char *p, size_t n) {
+  while (n) {
+    ssize_t r = read(fd, p, n);
+    if (r < 0 && errno == EINTR)
+      continue;
+    if (r <= 0)
+      return false;
+    p += r;
+    n -= r;
+  }
+  return true;
+}
+
+bool sendFrame(int fd, const std::string &s) {
+  uint64_t n = s.size();
+  return writeAll(fd, reinterpret_cast<const char *>(&n), sizeof n) &&
+         writeAll(fd, s.data(), n);
+}
+
+bool recvFrame(int fd, std::string &s) {
+  uint64_t n;
+  if (!readAll(fd, reinterpret_cast<char *>(&n), sizeof n))
+    return false;
+  s.resize(n);
+  return readAll(fd, s.data(), n);
+}
+
+// Paths invalidated by pipeline::index, shipped to workers with their next
+// request. Old entries are dropped; a worker that has missed some clears its
+// whole file cache.
+constexpr size_t kMaxInvalidated = 1024;
+std::mutex invalidated_mutex;
+std::deque<std::string> invalidated;
+// Sequence number of invalidated[0].
+uint64_t invalidated_base = 0;
+
+// Sum of Worker::rss of the running workers.
+std::atomic<int64_t> workers_rss{0};
+
+struct Worker {
+  pid_t pid = -1;
+  int fd = -1;
+  int n_tus = 0;
+  // Resident set size reported after the last translation unit.
+  int64_t rss = 0;
+  // Sequence number of the next invalidated path to send.
+  uint64_t seq = 0;
+
+  ~Worker() { stop(false); }
+
+  bool start();
+  void stop(bool force);
+};
+
+bool Worker::start() {
+  if (pid > 0)
+    return true;
+  int fds[2];
+#ifdef SOCK_CLOEXEC
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) < 0)
+    return false;
+#else
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+    return false;
+  fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+  fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+#endif
+#ifdef SO_NOSIGPIPE
+  int one = 1;
+  setsockopt(fds[0], SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof one);
+#endif
+
+  static char anchor;
+  std::string exe = llvm::sys::fs::getMainExecutable("ccls", &anchor);
+  std::string verbose = "-v=" + std::to_string(int(log::verbosity));
+  char *argv[] = {const_cast<char *>(exe.c_str()),
+                  const_cast<char *>("--index-worker"),
+                  const_cast<char *>(verbose.c_str()), nullptr};
+  // dup2 clears FD_CLOEXEC of stdin/stdout of the child.
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_adddup2(&actions, fds[1], 0);
+  posix_spawn_file_actions_adddup2(&actions, fds[1], 1);
+  int err = posix_spawn(&pid, exe.c_str(), &actions, nullptr, argv, environ);
+  posix_spawn_file_actions_destroy(&actions);
+  close(fds[1]);
+  if (err) {
+    LOG_S(ERROR) << "failed to spawn " << exe << ": " << strerror(err);
+    close(fds[0]);
+    pid = -1;
+    return false;
+  }
+  fd = fds[0];
+  n_tus = 0;
+  {
+    std::lock_guard lock(invalidated_mutex);
+    seq = invalidated_base + invalidated.size();
+  }
+
+  rapidjson::StringBuffer output;
+  rapidjson::Writer<rapidjson::StringBuffer> writer(output);
+  JsonWriter json_writer(&writer);
+  reflect(json_writer, *g_config);
+  std::string config = output.GetString();
+  BinaryWriter w;
+  w.pack<uint8_t>(kInit);
+  reflect(w, config);
+  if (!sendFrame(fd, w.take())) {
+    stop(true);
+    return false;
+  }
+  LOG_S(INFO) << "started index worker " << pid;
+  return true;
+}
+
+void Worker::stop(bool force) {
+  if (pid <= 0)
+    return;
+  // The worker exits when it reads EOF.
+  close(fd);
+  if (force)
+    kill(pid, SIGKILL);
+  workers_rss -= rss;
+  rss = 0;
+  while (waitpid(pid, nullptr, 0) < 0 && errno == EINTR)
+    ;
+  pid = -1;
+  fd = -1;
+}
+
+// The worker owned by the calling indexer thread.
+thread_local Worker worker;
+
+// Forwards VFS::stamp to the VFS of the ccls process, so that a file is
+// indexed by only one translation unit, as with in-process indexing.
+struct RemoteVFS : VFS {
+  bool stamp(const std::string &path, int64_t ts, int step) override {
+    BinaryWriter w;
+    w.pack<uint8_t>(kStamp);
+    std::string path1 = path;
+    reflect(w, path1);
+    reflect(w, ts);
+    reflect(w, step);
+    std::string frame;
+    if (!sendFrame(1, w.take()) || !recvFrame(0, frame))
+      exit(1);
+    BinaryReader r(frame);
+    if (r.get<uint8_t>() != kStampReply)
+      exit(1);
+    bool ret;
+    reflect(r, ret);
+    return ret;
+  }
+};
+} // namespace
+
+bool enabled() { return g_config && g_config->index.worker.enabled; }
+
+IndexResult
+index(VFS *vfs, const std::string &opt_wdir, const std::string &main,
+      const std::vector<const char *> &args,
+      const std::vector<std::pair<std::string, std::string>> &remapped,
+      bool no_linkage, bool &ok) {
+  ok = false;
+  if (!worker.start())
+    return {};
+
+  BinaryWriter w;
+  w.pack<uint8_t>(kIndex);
+  {
+    std::lock_guard lock(invalidated_mutex);
+    bool clear = worker.seq < invalidated_base;
+    reflect(w, clear);
+    std::vector<std::string> stale;
+    for (uint64_t i = std::max(worker.seq, invalidated_base) - invalidated_base;
+         i < invalidated.size(); i++)
+      stale.push_back(invalidated[i]);
+    reflect(w, stale);
+    worker.seq = invalidated_base + invalidated.size();
+  }
+  std::string wdir = opt_wdir, main1 = main;
+  std::vector<const char *> args1 = args;
+  std::vector<std::string> remapped_paths;
+  for (auto &[path, _] : remapped)
+    remapped_paths.push_back(path);
+  reflect(w, wdir);
+  reflect(w, main1);
+  reflect(w, args1);
+  reflect(w, no_linkage);
+  reflect(w, remapped_paths);
+  bool sent = sendFrame(worker.fd, w.take());
+  for (auto &[_, content] : remapped)
+    sent = sent && sendFrame(worker.fd, content);
+
+  std::string frame;
+  while (sent && recvFrame(worker.fd, frame)) {
+    BinaryReader r(frame);
+    uint8_t kind = r.get<uint8_t>();
+    if (kind == kStamp) {
+      std::string path;
+      int64_t ts;
+      int step;
+      reflect(r, path);
+      reflect(r, ts);
+      reflect(r, step);
+      bool ret = vfs->stamp(path, ts, step);
+      BinaryWriter w1;
+      w1.pack<uint8_t>(kStampReply);
+      reflect(w1, ret);
+      if (!sendFrame(worker.fd, w1.take()))
+        break;
+      continue;
+    }
+    if (kind != kResult)
+      break;
+
+    IndexResult result;
+    bool indexed;
+    int64_t rss;
+    std::vector<std::string> paths;
+    reflect(r, indexed);
+    reflect(r, result.n_errs);
+    reflect(r, result.first_error);
+    reflect(r, rss);
+    reflect(r, result.rss);
+    reflect(r, paths);
+    std::string content, serialized;
+    for (std::string &path : paths) {
+      std::unique_ptr<IndexFile> file;
+      if (recvFrame(worker.fd, content) && recvFrame(worker.fd, serialized))
+        file = deserialize(SerializeFormat::Binary, path, serialized, content,
+                           IndexFile::kMajorVersion);
+      if (!file) {
+        LOG_S(ERROR) << "bad result from index worker " << worker.pid;
+        worker.stop(true);
+        return {};
+      }
+      result.indexes.push_back(std::move(file));
+    }
+    ok = indexed;
+    workers_rss += rss - worker.rss;
+    worker.rss = rss;
+
+    auto &cfg = g_config->index.worker;
+    if ((cfg.maxTUs > 0 && ++worker.n_tus >= cfg.maxTUs) ||
+        (cfg.maxRss > 0 && rss > int64_t(cfg.maxRss) << 20)) {
+      LOG_S(INFO) << "recycle index worker " << worker.pid << " after "
+                  << worker.n_tus << " TUs, RSS " << (rss >> 20) << " MiB";
+      worker.stop(false);
+    }
+    return result;
+  }
+  LOG_S(ERROR) << "index worker " << worker.pid
+               << " exited while indexing " << main;
+  worker.stop(true);
+  ok = false;
+  return {};
+}
+
+int64_t residentSetSize() { return workers_rss; }
+
+void release() { worker.stop(false); }
+
+void invalidate(const std::string &path) {
+  if (!enabled())
+    return;
+  std::lock_guard lock(invalidated_mutex);
+  invalidated.push_back(path);
+  if (invalidated.size() > kMaxInvalidated) {
+    invalidated.pop_front();
+    invalidated_base++;
+  }
+}
+
+int main() {
+  std::string frame;
+  if (!recvFrame(0, frame))
+    return 1;
+  {
+    BinaryReader r(frame);
+    if (r.get<uint8_t>() != kInit)
+      return 1;
+    std::string config;
+    reflect(r, config);
+    rapidjson::Document reader;
+    reader.Parse(config.c_str());
+    if (reader.HasParseError())
+      return 1;
+    g_config = new Config;
+    JsonReader json_reader{&reader};
+    try {
+      reflect(json_reader, *g_config);
+    } catch (std::invalid_argument &) {
+      return 1;
+    }
+  }
+  idx::init();
+
+  RemoteVFS vfs;
+  WorkingFiles wfiles;
+  while (recvFrame(0, frame)) {
+    BinaryReader r(frame);
+    if (r.get<uint8_t>() != kIndex)
+      return 1;
+    bool clear, no_linkage;
+    std::vector<std::string> stale, remapped_paths;
+    std::string wdir, main;
+    std::vector<const char *> args;
+    reflect(r, clear);
+    reflect(r, stale);
+    reflect(r, wdir);
+    reflect(r, main);
+    reflect(r, args);
+    reflect(r, no_linkage);
+    reflect(r, remapped_paths);
+    std::vector<std::pair<std::string, std::string>> remapped;
+    for (std::string &path : remapped_paths) {
+      std::string content;
+      if (!recvFrame(0, content))
+        return 1;
+      remapped.emplace_back(path, std::move(content));
+    }
+
+    if (clear)
+      file_cache::clear();
+    for (auto &path : stale)
+      file_cache::invalidate(path);
+    // idx::index applies |remapped| only if the main file is open.
+    for (auto &[path, content] : remapped)
+      if (path == main)
+        wfiles.files[path] = std::make_unique<WorkingFile>(path, content);
+
+    bool ok;
+    int64_t rss0 = getResidentSetSize();
+    bool peak = resetPeakResidentSetSize();
+    IndexResult result = idx::index(nullptr, &wfiles, &vfs, wdir, main, args,
+                                    remapped, no_linkage, ok);
+    wfiles.files.clear();
+
+    BinaryWriter w;
+    w.pack<uint8_t>(kResult);
+    int64_t rss = getResidentSetSize();
+    std::vector<std::string> paths;
+    for (auto &file : result.indexes)
+      paths.push_back(file->path);
+    reflect(w, ok);
+    reflect(w, result.n_errs);
+    reflect(w, result.first_error);
+    reflect(w, rss);
+    int64_t growth =
+        peak ? std::max<int64_t>(getPeakResidentSetSize() - rss0, 0) : 0;
+    reflect(w, growth);
+    reflect(w, paths);
+    if (!sendFrame(1, w.take()))
+      return 1;
+    for (auto &file : result.indexes)
+      if (!sendFrame(1, file->file_contents) ||
+          !sendFrame(1, serialize(SerializeFormat::Binary, *file)))
+        return 1;
+    result.indexes.clear();
+    freeUnusedMemory();
+  }
+  return 0;
+}
+#else
+bool enabled() { return false; }
+
+IndexResult
+index(VFS *, const std::string &, const std::string &,
+      const std::vector<const char *> &,
+      const std::vector<std::pair<std::string, std::string>> &, bool,
+      bool &ok) {
+  ok = false;
+  return {};
+}
+
+int64_t residentSetSize() { return 0; }
+
+void release() {}
+
+void invalidate(const std::string &) {}
+
+int main() { return 1; }
+#endif
+} // namespace ccls::index_worker
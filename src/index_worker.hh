@@ -0,0 +1,46 @@
+// Copyright 2017-2018 ccls Authors
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+#include "indexer.hh"
+
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace ccls {
+struct VFS;
+
+namespace index_worker {
+// Whether translation units are parsed in `ccls --index-worker` processes
+// (index.worker.enabled). Always false on non-POSIX systems.
+bool enabled();
+
+// The same as idx::index, but runs in the worker process owned by the calling
+// indexer thread. The worker is started on demand and restarted after a crash,
+// index.worker.maxTUs translation units or index.worker.maxRss. VFS::stamp
+// queries of the worker are answered with |vfs|.
+IndexResult
+index(VFS *vfs, const std::string &opt_wdir, const std::string &main,
+      const std::vector<const char *> &args,
+      const std::vector<std::pair<std::string, std::string>> &remapped,
+      bool no_linkage, bool &ok);
+
+// The sum of the resident set sizes of the running workers, as reported after
+// their last translation units.
+int64_t residentSetSize();
+
+// Stop the worker of the calling indexer thread, e.g. when the thread is paused
+// to save memory. It is restarted by the next index call.
+void release();
+
+// Tell workers that |path| has changed, so that they drop its cached stat and
+// content before the next translation unit.
+void invalidate(const std::string &path);
+
+// Entry point of `ccls --index-worker`. Requests are read from stdin and
+// results are written to stdout.
+int main();
+} // namespace index_worker
+} // namespace ccls
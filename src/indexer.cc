@@ -5,6 +5,7 @@
 #include "indexer.hh"
 
 #include "clang_tu.hh"
+#include "file_cache.hh"
 #include "log.hh"
 #include "pipeline.hh"
 #include "platform.hh"
@@ -14,6 +15,7 @@
 #include <clang/Basic/TargetInfo.h>
 #include <clang/Frontend/FrontendAction.h>
 #include <clang/Frontend/MultiplexConsumer.h>
+#include <clang/Frontend/PrecompiledPreamble.h>
 #include <clang/Index/IndexDataConsumer.h>
 #include <clang/Index/IndexingAction.h>
 #include <clang/Index/USRGeneration.h>
@@ -37,7 +39,6 @@ GroupMatch *multiVersionMatcher;
 struct File {
   std::string path;
   int64_t mtime;
-  std::string content;
   std::unique_ptr<IndexFile> db;
 };
 
@@ -70,13 +71,12 @@ struct IndexParam {
       if (!it->second.mtime)
         if (auto tim = lastWriteTime(path))
           it->second.mtime = *tim;
-      if (std::optional<std::string> content = readContent(path))
-        it->second.content = *content;
 
       if (!vfs.stamp(path, it->second.mtime, no_linkage ? 3 : 1))
         return;
-      it->second.db =
-          std::make_unique<IndexFile>(path, it->second.content, no_linkage);
+      std::optional<std::string> content = file_cache::read(path);
+      it->second.db = std::make_unique<IndexFile>(
+          path, content ? *content : std::string(), no_linkage);
     }
   }
 
@@ -1228,9 +1228,220 @@ public:
       info.FormatDiagnostic(message);
   }
 };
+
+// A precompiled preamble for an include prefix shared by translation units
+// with the same compile flags.
+struct SharedPreamble {
+  std::string prefix;
+  std::unique_ptr<PrecompiledPreamble> pch;
+  // Files entered while building the preamble. They are not seen by
+  // translation units parsed on top of it but are still their dependencies.
+  std::vector<std::pair<std::string, int64_t>> headers;
+  // Include directives in the prefix, whose lines are the same for every user.
+  std::vector<std::pair<int, std::string>> includes;
+};
+
+class PreambleRecorder : public PreambleCallbacks {
+  class Callbacks : public PPCallbacks {
+    SharedPreamble &out;
+    const SourceManager &sm;
+
+  public:
+    Callbacks(SharedPreamble &out, const SourceManager &sm)
+        : out(out), sm(sm) {}
+    void FileChanged(SourceLocation sl, FileChangeReason reason,
+                     SrcMgr::CharacteristicKind, FileID) override {
+      if (reason == FileChangeReason::EnterFile)
+        if (const FileEntry *fe = sm.getFileEntryForID(sm.getFileID(sl)))
+          out.headers.emplace_back(pathFromFileEntry(*fe),
+                                   fe->getModificationTime());
+    }
+    void InclusionDirective(SourceLocation hashLoc, const Token &tok,
+                            StringRef included, bool isAngled,
+                            CharSourceRange filenameRange,
+#if LLVM_VERSION_MAJOR >= 16 // llvmorg-16-init-15080-g854c10f8d185
+                            OptionalFileEntryRef fileRef,
+#elif LLVM_VERSION_MAJOR >= 15 // llvmorg-15-init-7692-gd79ad2f1dbc2
+                            llvm::Optional<FileEntryRef> fileRef,
+#else
+                            const FileEntry *file,
+#endif
+                            StringRef searchPath, StringRef relativePath,
+                            const Module *imported,
+                            SrcMgr::CharacteristicKind fileType) override {
+#if LLVM_VERSION_MAJOR >= 15 // llvmorg-15-init-7692-gd79ad2f1dbc2
+      const FileEntry *file = fileRef ? &fileRef->getFileEntry() : nullptr;
+#endif
+      if (file && sm.isInMainFile(hashLoc))
+        out.includes.emplace_back(
+            sm.getSpellingLineNumber(filenameRange.getBegin()) - 1,
+            pathFromFileEntry(*file));
+    }
+  };
+  SharedPreamble &out;
+  SourceManager *sm = nullptr;
+
+public:
+  PreambleRecorder(SharedPreamble &out) : out(out) {}
+  void BeforeExecute(CompilerInstance &ci) override {
+    sm = &ci.getSourceManager();
+  }
+  std::unique_ptr<PPCallbacks> createPPCallbacks() override {
+    return std::make_unique<Callbacks>(out, *sm);
+  }
+};
+
+// Background index requests in the same directory (quoted includes are
+// resolved relative to it) whose compile flags are identical (ignoring the main
+// file and outputs) form a group. The first kSamples translation units of a
+// group are parsed as usual, which indexes their headers; afterwards the
+// longest line-aligned prefix of preamble text shared by at least half of the
+// samples is precompiled and reused by every member that starts with it.
+class SharedPreambles {
+  static constexpr size_t kSamples = 8;
+  struct Group {
+    std::vector<std::string> samples;
+    std::string prefix;
+    std::shared_ptr<SharedPreamble> preamble;
+    bool chosen = false, building = false, disabled = false;
+  };
+  std::mutex mutex;
+  std::unordered_map<std::string, Group> groups;
+  int built = 0;
+
+  static std::string groupKey(const std::string &main,
+                              const std::vector<const char *> &args) {
+    StringRef stem = llvm::sys::path::stem(main);
+    std::string key(llvm::sys::path::parent_path(main));
+    key += '\0';
+    for (size_t i = 0; i < args.size(); i++) {
+      StringRef arg = args[i];
+      if (arg == "-o" || arg == "-MF" || arg == "-MT" || arg == "-MQ") {
+        i++;
+        continue;
+      }
+      if (llvm::sys::path::stem(arg) == stem)
+        continue;
+      key += arg;
+      key += '\0';
+    }
+    return key;
+  }
+
+  static std::string dominantPrefix(std::vector<std::string> &samples) {
+    // After sorting, a prefix shared by m samples is shared by m consecutive
+    // ones, thus by the first and the last of them.
+    std::sort(samples.begin(), samples.end());
+    size_t m = (samples.size() + 1) / 2, best = 0;
+    const std::string *ret = nullptr;
+    for (size_t i = 0; i + m <= samples.size(); i++) {
+      const std::string &a = samples[i], &b = samples[i + m - 1];
+      size_t n = std::min(a.size(), b.size());
+      n = std::mismatch(a.begin(), a.begin() + n, b.begin()).first - a.begin();
+      n = StringRef(a.data(), n).rfind('\n') + 1;
+      if (n > best) {
+        best = n;
+        ret = &a;
+      }
+    }
+    if (!ret)
+      return {};
+    StringRef prefix(ret->data(), best);
+    if (prefix.find("#include") == StringRef::npos &&
+        prefix.find("#import") == StringRef::npos)
+      return {};
+    return prefix.str();
+  }
+
+public:
+  std::shared_ptr<SharedPreamble>
+  get(CompilerInvocation &ci, const std::string &main,
+      const std::vector<const char *> &args, llvm::MemoryBuffer &buf,
+      IntrusiveRefCntPtr<llvm::vfs::FileSystem> fs,
+      std::shared_ptr<PCHContainerOperations> pch, std::string &key) {
+#if LLVM_VERSION_MAJOR >= 12 // llvmorg-12-init-11522-g4c55c3b66de
+    PreambleBounds bounds = ComputePreambleBounds(*ci.getLangOpts(), buf, 0);
+#else
+    PreambleBounds bounds = ComputePreambleBounds(*ci.getLangOpts(), &buf, 0);
+#endif
+    StringRef text = buf.getBuffer().take_front(bounds.Size);
+    text = text.take_front(text.rfind('\n') + 1);
+    key = groupKey(main, args);
+
+    std::unique_lock lock(mutex);
+    Group &g = groups[key];
+    if (g.disabled)
+      return nullptr;
+    if (!g.chosen) {
+      g.samples.push_back(text.str());
+      if (g.samples.size() == kSamples) {
+        g.prefix = dominantPrefix(g.samples);
+        g.chosen = true;
+        std::vector<std::string>().swap(g.samples);
+      }
+      return nullptr;
+    }
+    if (g.prefix.empty() || !text.startswith(g.prefix))
+      return nullptr;
+    PreambleBounds bounds1(g.prefix.size(), true);
+    if (g.preamble) {
+#if LLVM_VERSION_MAJOR >= 12 // llvmorg-12-init-17739-gf4d02fbe418d
+      if (g.preamble->pch->CanReuse(ci, buf, bounds1, *fs))
+#else
+      if (g.preamble->pch->CanReuse(ci, &buf, bounds1, fs.get()))
+#endif
+        return g.preamble;
+      LOG_S(INFO) << "shared preamble is out of date; rebuild it for " << main;
+      g.preamble.reset();
+      built--;
+    }
+    if (g.building || built >= g_config->index.sharedPreamble)
+      return nullptr;
+    g.building = true;
+    built++;
+    lock.unlock();
+
+    auto preamble = std::make_shared<SharedPreamble>();
+    preamble->prefix = g.prefix;
+    CompilerInvocation ci1(ci);
+    ci1.getFrontendOpts().SkipFunctionBodies = true;
+    ci1.getDiagnosticOpts().IgnoreWarnings = true;
+    DiagnosticConsumer dc;
+    IntrusiveRefCntPtr<DiagnosticsEngine> de =
+        CompilerInstance::createDiagnostics(&ci1.getDiagnosticOpts(), &dc,
+                                            false);
+    PreambleRecorder recorder(*preamble);
+    auto pch1 = PrecompiledPreamble::Build(ci1, &buf, bounds1, *de, fs, pch,
+                                           true, recorder);
+
+    lock.lock();
+    Group &g1 = groups[key];
+    g1.building = false;
+    if (!pch1) {
+      LOG_S(WARNING) << "failed to build shared preamble with " << main;
+      g1.disabled = true;
+      built--;
+      return nullptr;
+    }
+    LOG_S(INFO) << "built shared preamble of " << preamble->headers.size()
+                << " files with " << main;
+    preamble->pch = std::make_unique<PrecompiledPreamble>(std::move(*pch1));
+    return g1.preamble = preamble;
+  }
+
+  // Called when a translation unit fails to parse on top of the preamble.
+  void disable(const std::string &key) {
+    std::lock_guard lock(mutex);
+    Group &g = groups[key];
+    if (g.preamble)
+      built--;
+    g.preamble.reset();
+    g.disabled = true;
+  }
+} shared_preambles;
 } // namespace
 
-const int IndexFile::kMajorVersion = 21;
+const int IndexFile::kMajorVersion = 22;
 const int IndexFile::kMinorVersion = 0;
 
 IndexFile::IndexFile(const std::string &path, const std::string &contents,
@@ -1286,7 +1497,7 @@ index(SemaManager *manager, WorkingFiles *wfiles, VFS *vfs,
   ok = true;
   auto pch = std::make_shared<PCHContainerOperations>();
   llvm::IntrusiveRefCntPtr<llvm::vfs::FileSystem> fs =
-      llvm::vfs::getRealFileSystem();
+      file_cache::getFileSystem();
   std::shared_ptr<CompilerInvocation> ci =
       buildCompilerInvocation(main, args, fs);
   // e.g. .s
@@ -1306,6 +1517,18 @@ index(SemaManager *manager, WorkingFiles *wfiles, VFS *vfs,
       ci->getPreprocessorOpts().addRemappedFile(filename, bufs.back().get());
     }
 
+  std::shared_ptr<SharedPreamble> preamble;
+  std::string preamble_key;
+  if (g_config->index.sharedPreamble > 0 && !no_linkage && buf.empty())
+    if (auto main_buf = fs->getBufferForFile(main)) {
+      preamble = shared_preambles.get(*ci, main, args, **main_buf, fs, pch,
+                                      preamble_key);
+      if (preamble) {
+        preamble->pch->AddImplicitPreamble(*ci, fs, main_buf->get());
+        bufs.push_back(std::move(*main_buf));
+      }
+    }
+
   IndexDiags dc;
   auto clang = std::make_unique<CompilerInstance>(pch);
   clang->setInvocation(std::move(ci));
@@ -1374,6 +1597,13 @@ index(SemaManager *manager, WorkingFiles *wfiles, VFS *vfs,
       return {};
     }
   }
+  if (!ok && preamble) {
+    LOG_S(WARNING) << "failed to index " << main
+                   << " with a shared preamble; retry without it";
+    shared_preambles.disable(preamble_key);
+    return index(manager, wfiles, vfs, opt_wdir, main, args, remapped,
+                 no_linkage, ok);
+  }
   if (!ok) {
     LOG_S(ERROR) << "failed to index " << main
                  << (reason.empty() ? "" : ": " + reason);
@@ -1414,11 +1644,23 @@ index(SemaManager *manager, WorkingFiles *wfiles, VFS *vfs,
       const std::string &path = file.path;
       if (path.empty())
         continue;
-      if (path == entry->path)
+      if (path == entry->path) {
         entry->mtime = file.mtime;
-      else if (path != entry->import_file)
-        entry->dependencies[llvm::CachedHashStringRef(intern(path))] =
-            file.mtime;
+        entry->hash = file_cache::hash(path).value_or(0);
+      } else if (path != entry->import_file) {
+        entry->dependencies[llvm::CachedHashStringRef(intern(path))] = {
+            file.mtime, file_cache::hash(path).value_or(0)};
+      }
+    }
+    if (preamble) {
+      for (auto &[path, mtime] : preamble->headers)
+        if (path != entry->path && path != entry->import_file)
+          entry->dependencies.try_emplace(
+              llvm::CachedHashStringRef(intern(path)),
+              IndexDependency{mtime, file_cache::hash(path).value_or(0)});
+      if (entry->path == main)
+        for (auto &[line, path] : preamble->includes)
+          entry->includes.push_back({line, intern(path)});
     }
     result.indexes.push_back(std::move(entry));
   }
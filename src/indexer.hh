@@ -274,6 +274,12 @@ struct IndexInclude {
   const char *resolved_path;
 };
 
+struct IndexDependency {
+  int64_t mtime = 0;
+  // hashContent at the time of index, 0 if unknown.
+  uint64_t hash = 0;
+};
+
 struct IndexFile {
   // For both JSON and MessagePack cache files.
   static const int kMajorVersion;
@@ -287,6 +293,9 @@ struct IndexFile {
   std::vector<const char *> args;
   // This is unfortunately time_t as used by clang::FileEntry
   int64_t mtime = 0;
+  // hashContent of the file, 0 if unknown. When the mtime changes but the
+  // hash does not, the cache is still valid.
+  uint64_t hash = 0;
   LanguageId language = LanguageId::C;
   bool no_linkage;
 
@@ -305,7 +314,7 @@ struct IndexFile {
   std::vector<Range> skipped_ranges;
 
   std::vector<IndexInclude> includes;
-  llvm::DenseMap<llvm::CachedHashStringRef, int64_t> dependencies;
+  llvm::DenseMap<llvm::CachedHashStringRef, IndexDependency> dependencies;
   std::unordered_map<Usr, IndexFunc> usr2func;
   std::unordered_map<Usr, IndexType> usr2type;
   std::unordered_map<Usr, IndexVar> usr2var;
@@ -327,6 +336,9 @@ struct IndexResult {
   std::vector<std::unique_ptr<IndexFile>> indexes;
   int n_errs = 0;
   std::string first_error;
+  // Peak growth of the resident set size of the index worker while parsing, in
+  // bytes, or 0 if unknown.
+  int64_t rss = 0;
 };
 
 struct SemaManager;
@@ -0,0 +1,62 @@
+// Copyright 2017-2018 ccls Authors
+// SPDX-License-Identifier: Apache-2.0
+
+#include "intern.hh"
+
+#include <llvm/ADT/DenseSet.h>
+#include <llvm/Support/Allocator.h>
+
+#include <mutex>
+#include <string.h>
+
+using namespace llvm;
+
+namespace ccls {
+namespace {
+constexpr unsigned kShardBits = 6;
+constexpr unsigned kLookasideSize = 1024;
+
+struct alignas(64) Shard {
+  std::mutex mutex;
+  BumpPtrAllocator alloc;
+  DenseSet<CachedHashStringRef> strings;
+} shards[1 << kShardBits];
+
+// A direct-mapped cache of interned strings. Entries never become stale
+// because interned strings are never freed.
+struct Lookaside {
+  const char *data;
+  uint32_t size, hash;
+};
+thread_local Lookaside lookaside[kLookasideSize];
+} // namespace
+
+CachedHashStringRef internH(StringRef s) {
+  if (s.empty())
+    s = "";
+  CachedHashStringRef key(s);
+  uint32_t hash = key.hash();
+  Lookaside &l = lookaside[hash % kLookasideSize];
+  if (l.data && l.hash == hash && StringRef(l.data, l.size) == s)
+    return CachedHashStringRef(StringRef(l.data, l.size), hash);
+
+  // The low bits select the bucket of DenseSet. Use the high bits for shards.
+  Shard &shard = shards[hash >> (32 - kShardBits)];
+  CachedHashStringRef ret = key;
+  {
+    std::lock_guard lock(shard.mutex);
+    auto r = shard.strings.insert(key);
+    if (r.second) {
+      char *p = shard.alloc.Allocate<char>(s.size() + 1);
+      memcpy(p, s.data(), s.size());
+      p[s.size()] = '\0';
+      *r.first = CachedHashStringRef(StringRef(p, s.size()), hash);
+    }
+    ret = *r.first;
+  }
+  l = {ret.val().data(), uint32_t(s.size()), hash};
+  return ret;
+}
+
+const char *intern(StringRef s) { return internH(s).val().data(); }
+} // namespace ccls
@@ -0,0 +1,18 @@
+// Copyright 2017-2018 ccls Authors
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+#include <llvm/ADT/CachedHashString.h>
+#include <llvm/ADT/StringRef.h>
+
+namespace ccls {
+// Return a NUL-terminated copy of |str| that lives until exit. Equal strings
+// share the same copy.
+//
+// The table is split into shards by hash, each with its own lock and bump
+// allocator, and each thread remembers its recent results, so that indexer
+// threads and cache loading rarely contend.
+const char *intern(llvm::StringRef str);
+llvm::CachedHashStringRef internH(llvm::StringRef str);
+} // namespace ccls
@@ -35,6 +35,8 @@ struct InMessage {
   std::unique_ptr<rapidjson::Document> document;
   std::chrono::steady_clock::time_point deadline;
   std::string backlog_path;
+  std::chrono::steady_clock::time_point received =
+      std::chrono::steady_clock::now();
 };
 
 enum class ErrorCode {
@@ -1,11 +1,14 @@
 // Copyright 2017-2018 ccls Authors
 // SPDX-License-Identifier: Apache-2.0
 
+#include "index_worker.hh"
 #include "log.hh"
 #include "pipeline.hh"
 #include "platform.hh"
+#include "replay.hh"
 #include "serializer.hh"
 #include "test.hh"
+#include "trace.hh"
 #include "working_files.hh"
 
 #include <clang/Basic/Version.h>
@@ -51,6 +54,18 @@ opt<std::string> opt_log_file("log-file", desc("stderr or log file"),
                               value_desc("file"), init("stderr"), cat(C));
 opt<bool> opt_log_file_append("log-file-append", desc("append to log file"),
                               cat(C));
+opt<std::string> opt_record("record",
+                            desc("record the messages from the client"),
+                            value_desc("file"), cat(C));
+opt<std::string> opt_replay(
+    "replay", desc("replay a recording and report latencies to stderr"),
+    value_desc("file"), cat(C));
+opt<std::string> opt_trace("trace",
+                           desc("write a Chrome trace of thread activity"),
+                           value_desc("file"), cat(C));
+opt<bool> opt_index_worker("index-worker", Hidden,
+                           desc("internal: parse translation units for ccls"),
+                           cat(C));
 
 void closeLog() { fclose(ccls::log::file); }
 
@@ -96,6 +111,17 @@ int main(int argc, char **argv) {
     atexit(closeLog);
   }
 
+  if (opt_index_worker)
+    return index_worker::main();
+
+  if (opt_trace.size()) {
+    if (!trace::init(opt_trace)) {
+      fprintf(stderr, "failed to open %s\n", opt_trace.c_str());
+      return 2;
+    }
+    atexit(trace::finish);
+  }
+
   if (opt_test_index != "!") {
     language_server = false;
     if (!ccls::runIndexTests(opt_test_index,
@@ -136,9 +162,21 @@ int main(int argc, char **argv) {
       sys::fs::make_absolute(root);
       pipeline::standalone(std::string(root.data(), root.size()));
     } else {
-      // The thread that reads from stdin and dispatchs commands to the main
-      // thread.
-      pipeline::launchStdin();
+      if (opt_replay.size()) {
+        // Read messages from the recording instead of stdin.
+        if (!replay::launch(opt_replay)) {
+          fprintf(stderr, "failed to read %s\n", opt_replay.c_str());
+          return 2;
+        }
+      } else {
+        if (opt_record.size() && !replay::startRecording(opt_record)) {
+          fprintf(stderr, "failed to open %s\n", opt_record.c_str());
+          return 2;
+        }
+        // The thread that reads from stdin and dispatchs commands to the main
+        // thread.
+        pipeline::launchStdin();
+      }
       // The thread that writes responses from the main thread to stdout.
       pipeline::launchStdout();
       // Main thread which also spawns indexer threads upon the "initialize"
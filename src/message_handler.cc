@@ -5,9 +5,11 @@
 #include "message_handler.hh"
 
 #include "log.hh"
+#include "metrics.hh"
 #include "pipeline.hh"
 #include "project.hh"
 #include "query.hh"
+#include "trace.hh"
 
 #include <rapidjson/document.h>
 #include <rapidjson/reader.h>
@@ -159,10 +161,12 @@ MessageHandler::MessageHandler() {
   bind("$ccls/call", &MessageHandler::ccls_call);
   bind("$ccls/fileInfo", &MessageHandler::ccls_fileInfo);
   bind("$ccls/info", &MessageHandler::ccls_info);
+  bind("$ccls/includers", &MessageHandler::ccls_includers);
   bind("$ccls/inheritance", &MessageHandler::ccls_inheritance);
   bind("$ccls/member", &MessageHandler::ccls_member);
   bind("$ccls/navigate", &MessageHandler::ccls_navigate);
   bind("$ccls/reload", &MessageHandler::ccls_reload);
+  bind("$ccls/stats", &MessageHandler::ccls_stats);
   bind("$ccls/vars", &MessageHandler::ccls_vars);
   bind("callHierarchy/incomingCalls", &MessageHandler::callHierarchy_incomingCalls);
   bind("callHierarchy/outgoingCalls", &MessageHandler::callHierarchy_outgoingCalls);
@@ -206,6 +210,9 @@ void MessageHandler::run(InMessage &msg) {
   rapidjson::Value null;
   auto it = doc.FindMember("params");
   JsonReader reader(it != doc.MemberEnd() ? &it->value : &null);
+  trace::Span span(msg.method.c_str());
+  auto start = std::chrono::steady_clock::now();
+  metrics::started(msg);
   if (msg.id.valid()) {
     ReplyOnce reply{*this, msg.id};
     auto it = method2request.find(msg.method);
@@ -236,6 +243,7 @@ void MessageHandler::run(InMessage &msg) {
         pipeline::notify(window_showMessage, param);
       }
   }
+  metrics::handled(msg, start);
 }
 
 QueryFile *MessageHandler::findFile(const std::string &path, int *out_file_id) {
@@ -255,6 +263,20 @@ QueryFile *MessageHandler::findFile(const std::string &path, int *out_file_id) {
   return ret;
 }
 
+void MessageHandler::indexDependents(const std::string &path) {
+  int file_id;
+  if (!findFile(path, &file_id))
+    return;
+  for (int id : db->getDependents(file_id)) {
+    QueryFile &file = db->files[id];
+    if (file.def)
+      pipeline::index(file.def->path, {},
+                      wfiles->getFile(file.def->path) ? IndexMode::Normal
+                                                      : IndexMode::Background,
+                      true);
+  }
+}
+
 std::pair<QueryFile *, WorkingFile *>
 MessageHandler::findOrFail(const std::string &path, ReplyOnce &reply,
                            int *out_file_id, bool allow_unopened) {
@@ -292,9 +314,7 @@ void emitSemanticHighlight(DB *db, WorkingFile *wfile, QueryFile &file) {
 
   // Group symbols together.
   std::unordered_map<SymbolIdx, CclsSemanticHighlightSymbol> grouped_symbols;
-  for (auto [sym, refcnt] : file.symbol2refcnt) {
-    if (refcnt <= 0)
-      continue;
+  for (ExtentRef sym : file.occurrences) {
     std::string_view detailed_name;
     SymbolKind parent_kind = SymbolKind::Unknown;
     SymbolKind kind = SymbolKind::Unknown;
@@ -256,6 +256,8 @@ struct MessageHandler {
                                                    ReplyOnce &reply,
                                                    int *out_file_id = nullptr,
                                                    bool allow_unopened = false);
+  // Re-index the translation units depending on |path|, nearest first.
+  void indexDependents(const std::string &path);
 
 private:
   void bind(const char *method, void (MessageHandler::*handler)(JsonReader &));
@@ -270,10 +272,12 @@ private:
   void ccls_call(JsonReader &, ReplyOnce &);
   void ccls_fileInfo(JsonReader &, ReplyOnce &);
   void ccls_info(EmptyParam &, ReplyOnce &);
+  void ccls_includers(JsonReader &, ReplyOnce &);
   void ccls_inheritance(JsonReader &, ReplyOnce &);
   void ccls_member(JsonReader &, ReplyOnce &);
   void ccls_navigate(JsonReader &, ReplyOnce &);
   void ccls_reload(JsonReader &);
+  void ccls_stats(JsonReader &, ReplyOnce &);
   void ccls_vars(JsonReader &, ReplyOnce &);
   void callHierarchy_incomingCalls(CallsParam &param, ReplyOnce &);
   void callHierarchy_outgoingCalls(CallsParam &param, ReplyOnce &);
@@ -73,6 +73,16 @@ struct Out_outgoingCall {
 };
 REFLECT_STRUCT(Out_outgoingCall, to, fromRanges);
 
+// The definition of the function calling |use|, in the file of |use|.
+Maybe<SymbolRef> getCaller(DB *db, const Use &use) {
+  if (QueryFunc *caller = db->getCaller(use))
+    for (auto &def : caller->def)
+      if (def.spell && def.spell->file_id == use.file_id)
+        return SymbolRef{def.spell->range, caller->usr, Kind::Func,
+                         def.spell->role};
+  return {};
+}
+
 bool expand(MessageHandler *m, Out_cclsCall *entry, bool callee,
             CallType call_type, bool qualified, int levels) {
   const QueryFunc &func = m->db->getFunc(entry->usr);
@@ -101,18 +111,9 @@ bool expand(MessageHandler *m, Out_cclsCall *entry, bool callee,
           if (sym.kind == Kind::Func)
             handle(sym, def->file_id, call_type);
     } else {
-      for (Use use : func.uses) {
-        const QueryFile &file1 = m->db->files[use.file_id];
-        Maybe<ExtentRef> best;
-        for (auto [sym, refcnt] : file1.symbol2refcnt)
-          if (refcnt > 0 && sym.extent.valid() && sym.kind == Kind::Func &&
-              sym.extent.start <= use.range.start &&
-              use.range.end <= sym.extent.end &&
-              (!best || best->extent.start < sym.extent.start))
-            best = sym;
-        if (best)
-          handle(*best, use.file_id, call_type);
-      }
+      for (Use use : func.uses)
+        if (auto caller = getCaller(m->db, use))
+          handle(*caller, use.file_id, call_type);
     }
   };
 
@@ -304,18 +305,9 @@ void MessageHandler::callHierarchy_incomingCalls(CallsParam &param,
   }
   const QueryFunc &func = db->getFunc(usr);
   std::map<SymbolIdx, std::pair<int, std::vector<lsRange>>> sym2ranges;
-  for (Use use : func.uses) {
-    const QueryFile &file = db->files[use.file_id];
-    Maybe<ExtentRef> best;
-    for (auto [sym, refcnt] : file.symbol2refcnt)
-      if (refcnt > 0 && sym.extent.valid() && sym.kind == Kind::Func &&
-          sym.extent.start <= use.range.start &&
-          use.range.end <= sym.extent.end &&
-          (!best || best->extent.start < sym.extent.start))
-        best = sym;
-    if (best)
-      add(sym2ranges, *best, use.file_id);
-  }
+  for (Use use : func.uses)
+    if (auto caller = getCaller(db, use))
+      add(sym2ranges, *caller, use.file_id);
   reply(toCallResult<Out_incomingCall>(db, sym2ranges));
 }
 
@@ -0,0 +1,53 @@
+// Copyright 2017-2018 ccls Authors
+// SPDX-License-Identifier: Apache-2.0
+
+#include "message_handler.hh"
+#include "query.hh"
+
+#include <unordered_set>
+
+namespace ccls {
+namespace {
+struct Param : TextDocumentParam {
+  // If true, also return files including the document indirectly.
+  bool transitive = false;
+};
+REFLECT_STRUCT(Param, textDocument, transitive);
+} // namespace
+
+void MessageHandler::ccls_includers(JsonReader &reader, ReplyOnce &reply) {
+  Param param;
+  reflect(reader, param);
+  std::vector<Location> result;
+  std::string path = param.textDocument.uri.getPath();
+  auto it = db->name2file_id.find(lowerPathIfInsensitive(path));
+  if (it == db->name2file_id.end()) {
+    reply(result);
+    return;
+  }
+
+  // Locations are the first #include lines of files in |includees|, nearest
+  // first.
+  std::vector<int> includers = db->getIncluders(it->second, param.transitive);
+  std::unordered_set<std::string_view> includees{path};
+  if (param.transitive)
+    for (int id : includers)
+      if (const auto &def = db->files[id].def)
+        includees.insert(def->path);
+  for (int id : includers) {
+    const auto &def = db->files[id].def;
+    if (!def)
+      continue;
+    for (const IndexInclude &include : def->includes)
+      if (includees.count(include.resolved_path)) {
+        Location &loc = result.emplace_back();
+        loc.uri = DocumentUri::fromPath(def->path);
+        loc.range.start.line = loc.range.end.line = include.line;
+        break;
+      }
+    if ((int)result.size() >= g_config->xref.maxNum)
+      break;
+  }
+  reply(result);
+}
+} // namespace ccls
@@ -2,8 +2,11 @@
 // Copyright 2017-2018 ccls Authors
 // SPDX-License-Identifier: Apache-2.0
 
+#include "index_worker.hh"
 #include "message_handler.hh"
+#include "metrics.hh"
 #include "pipeline.hh"
+#include "platform.hh"
 #include "project.hh"
 #include "query.hh"
 
@@ -18,14 +21,18 @@ struct Out_cclsInfo {
     int files, funcs, types, vars;
   } db;
   struct Pipeline {
-    int64_t lastIdle, completed, enqueued;
+    int64_t lastIdle, completed, enqueued, coalesced;
+    // Indexer threads allowed to parse, and RSS of ccls and its index workers
+    // in MiB.
+    int64_t concurrency, rss;
   } pipeline;
   struct Project {
     int entries;
   } project;
 };
 REFLECT_STRUCT(Out_cclsInfo::DB, files, funcs, types, vars);
-REFLECT_STRUCT(Out_cclsInfo::Pipeline, lastIdle, completed, enqueued);
+REFLECT_STRUCT(Out_cclsInfo::Pipeline, lastIdle, completed, enqueued,
+               coalesced, concurrency, rss);
 REFLECT_STRUCT(Out_cclsInfo::Project, entries);
 REFLECT_STRUCT(Out_cclsInfo, db, pipeline, project);
 } // namespace
@@ -39,12 +46,49 @@ void MessageHandler::ccls_info(EmptyParam &, ReplyOnce &reply) {
   result.pipeline.lastIdle = pipeline::stats.last_idle;
   result.pipeline.completed = pipeline::stats.completed;
   result.pipeline.enqueued = pipeline::stats.enqueued;
+  result.pipeline.coalesced = pipeline::stats.coalesced;
+  result.pipeline.concurrency = pipeline::stats.concurrency;
+  result.pipeline.rss =
+      (getResidentSetSize() + index_worker::residentSetSize()) >> 20;
   result.project.entries = 0;
   for (auto &[_, folder] : project->root2folder)
     result.project.entries += folder.entries.size();
   reply(result);
 }
 
+namespace {
+struct StatsParam {
+  // If true, clear the statistics after returning them.
+  bool reset = false;
+};
+REFLECT_STRUCT(StatsParam, reset);
+
+struct Out_Histogram {
+  uint64_t count = 0, p50 = 0, p90 = 0, p99 = 0, max = 0;
+  Out_Histogram(const Histogram &h)
+      : count(h.count()), p50(h.percentile(.5)), p90(h.percentile(.9)),
+        p99(h.percentile(.99)), max(h.max()) {}
+};
+REFLECT_STRUCT(Out_Histogram, count, p50, p90, p99, max);
+
+// Latencies are in microseconds and sizes in bytes.
+struct Out_cclsStats {
+  std::string method;
+  Out_Histogram queue, handler, serialize, size, total;
+};
+REFLECT_STRUCT(Out_cclsStats, method, queue, handler, serialize, size, total);
+} // namespace
+
+void MessageHandler::ccls_stats(JsonReader &reader, ReplyOnce &reply) {
+  StatsParam param;
+  reflect(reader, param);
+  std::vector<Out_cclsStats> result;
+  for (metrics::MethodStats &s : metrics::snapshot(param.reset))
+    result.push_back({s.method, s.queue, s.handler, s.serialize, s.size,
+                      s.total});
+  reply(result);
+}
+
 struct FileInfoParam : TextDocumentParam {
   bool dependencies = false;
   bool includes = false;
@@ -55,7 +55,8 @@ bool expandHelper(MessageHandler *m, Out_cclsInheritance *entry, bool derived,
       if (auto loc = getLsLocation(m->db, m->wfiles, *def->spell))
         entry->location = *loc;
     } else if (entity.declarations.size()) {
-      if (auto loc = getLsLocation(m->db, m->wfiles, entity.declarations[0]))
+      if (auto loc =
+              getLsLocation(m->db, m->wfiles, entity.declarations.front()))
         entry->location = *loc;
     }
   } else if (!derived) {
@@ -15,13 +15,12 @@ REFLECT_STRUCT(Param, textDocument, position, direction);
 
 Maybe<Range> findParent(QueryFile *file, Pos pos) {
   Maybe<Range> parent;
-  for (auto [sym, refcnt] : file->symbol2refcnt)
-    if (refcnt > 0 && sym.extent.valid() && sym.extent.start <= pos &&
-        pos < sym.extent.end &&
-        (!parent || (parent->start == sym.extent.start
-                         ? parent->end < sym.extent.end
-                         : parent->start < sym.extent.start)))
+  file->extents.forEachContaining(pos, [&](const ExtentRef &sym) {
+    if (!parent || (parent->start == sym.extent.start
+                        ? parent->end < sym.extent.end
+                        : parent->start < sym.extent.start))
       parent = sym.extent;
+  });
   return parent;
 }
 } // namespace
@@ -44,19 +43,25 @@ void MessageHandler::ccls_navigate(JsonReader &reader, ReplyOnce &reply) {
   switch (param.direction[0]) {
   case 'D': {
     Maybe<Range> parent = findParent(file, pos);
-    for (auto [sym, refcnt] : file->symbol2refcnt)
-      if (refcnt > 0 && pos < sym.extent.start &&
-          (!parent || sym.extent.end <= parent->end) &&
-          (!res || sym.extent.start < res->start))
-        res = sym.extent;
+    for (auto it = file->extents.upperBound(pos); it != file->extents.end();
+         ++it) {
+      if (parent && parent->end < it->extent.start)
+        break;
+      if (!parent || it->extent.end <= parent->end) {
+        res = it->extent;
+        break;
+      }
+    }
     break;
   }
   case 'L':
-    for (auto [sym, refcnt] : file->symbol2refcnt)
-      if (refcnt > 0 && sym.extent.valid() && sym.extent.end <= pos &&
-          (!res || (res->end == sym.extent.end ? sym.extent.start < res->start
-                                               : res->end < sym.extent.end)))
-        res = sym.extent;
+    // Extents ending before pos start before it.
+    for (auto it = file->extents.begin(), ie = file->extents.upperBound(pos);
+         it != ie; ++it)
+      if (it->extent.end <= pos &&
+          (!res || (res->end == it->extent.end ? it->extent.start < res->start
+                                               : res->end < it->extent.end)))
+        res = it->extent;
     break;
   case 'R': {
     Maybe<Range> parent = findParent(file, pos);
@@ -65,20 +70,20 @@ void MessageHandler::ccls_navigate(JsonReader &reader, ReplyOnce &reply) {
       if (pos.column)
         pos.column--;
     }
-    for (auto [sym, refcnt] : file->symbol2refcnt)
-      if (refcnt > 0 && sym.extent.valid() && pos < sym.extent.start &&
-          (!res ||
-           (sym.extent.start == res->start ? res->end < sym.extent.end
-                                           : sym.extent.start < res->start)))
-        res = sym.extent;
+    // The first extents starting after pos, the longest among them.
+    for (auto it = file->extents.upperBound(pos);
+         it != file->extents.end() && (!res || it->extent.start == res->start);
+         ++it)
+      if (!res || res->end < it->extent.end)
+        res = it->extent;
     break;
   }
   case 'U':
   default:
-    for (auto [sym, refcnt] : file->symbol2refcnt)
-      if (refcnt > 0 && sym.extent.valid() && sym.extent.start < pos &&
-          pos < sym.extent.end && (!res || res->start < sym.extent.start))
+    file->extents.forEachContaining(pos, [&](const ExtentRef &sym) {
+      if (sym.extent.start < pos && (!res || res->start < sym.extent.start))
         res = sym.extent;
+    });
     break;
   }
   std::vector<Location> result;
@@ -1,14 +1,19 @@
 // Copyright 2017-2018 ccls Authors
 // SPDX-License-Identifier: Apache-2.0
 
+#include "cache_store.hh"
 #include "filesystem.hh"
 #include "include_complete.hh"
+#include "index_cost.hh"
 #include "log.hh"
 #include "message_handler.hh"
 #include "pipeline.hh"
 #include "platform.hh"
 #include "project.hh"
 #include "sema_manager.hh"
+#include "snapshot.hh"
+#include "trace.hh"
+#include "watcher.hh"
 #include "working_files.hh"
 
 #include <llvm/ADT/Twine.h>
@@ -18,6 +23,7 @@
 #include <rapidjson/document.h>
 #include <rapidjson/writer.h>
 
+#include <atomic>
 #include <stdexcept>
 #include <stdlib.h>
 #include <thread>
@@ -250,6 +256,17 @@ REFLECT_STRUCT(DidChangeWatchedFilesRegistration::Option, watchers);
 REFLECT_STRUCT(DidChangeWatchedFilesRegistration, id, method, registerOptions);
 REFLECT_STRUCT(RegistrationParam, registrations);
 
+// Set when the client has sent "initialized". Registration may also be
+// requested by the watcher thread when it reaches the watch limit.
+std::atomic<bool> initialized_received{false}, registered{false};
+
+void registerWatchedFiles() {
+  if (didChangeWatchedFiles && !registered.exchange(true)) {
+    RegistrationParam param;
+    pipeline::request("client/registerCapability", param);
+  }
+}
+
 void *indexer(void *arg_) {
   MessageHandler *h;
   int idx;
@@ -264,7 +281,7 @@ void *indexer(void *arg_) {
 #if LLVM_ENABLE_THREADS && LLVM_VERSION_MAJOR >= 9 && !defined(__APPLE__)
   set_thread_priority(ThreadPriority::Background);
 #endif
-  pipeline::indexer_Main(h->manager, h->vfs, h->project, h->wfiles);
+  pipeline::indexer_Main(h->manager, h->vfs, h->project, h->wfiles, idx);
   pipeline::threadLeave();
   return nullptr;
 }
@@ -366,6 +383,8 @@ void do_initialize(MessageHandler *m, InitializeParam &param,
 
   if (g_config->cache.directory.empty())
     g_config->cache.retainInMemory = 1;
+  else if (g_config->cache.store == "pack")
+    sys::fs::create_directories(g_config->cache.directory);
   else if (!g_config->cache.hierarchicalPath)
     for (auto &[folder, _] : workspaceFolders) {
       // Create two cache directories for files inside and outside of the
@@ -374,10 +393,29 @@ void do_initialize(MessageHandler *m, InitializeParam &param,
       sys::fs::create_directories(g_config->cache.directory + escaped);
       sys::fs::create_directories(g_config->cache.directory + '@' + escaped);
     }
+  cache_store::init();
+  index_cost::init();
 
   idx::init();
-  for (auto &[folder, _] : workspaceFolders)
+  for (auto &[folder, _] : workspaceFolders) {
+    trace::Span span("load project", folder);
     m->project->load(folder);
+  }
+  if (m->db)
+    snapshot::load(m->db, m->vfs, m->project);
+  {
+    std::vector<std::string> roots;
+    for (auto &[folder, _] : workspaceFolders)
+      roots.push_back(folder);
+    if (watcher::start(roots, [] {
+          if (initialized_received)
+            registerWatchedFiles();
+        }) &&
+        m->db)
+      for (QueryFile &file : m->db->files)
+        if (file.def)
+          watcher::watch(file.def->path);
+  }
 
   // Start indexer threads. Start this after loading the project, as that
   // may take a long time. Indexer threads will emit status/progress
@@ -386,6 +424,7 @@ void do_initialize(MessageHandler *m, InitializeParam &param,
     g_config->index.threads = (int)std::thread::hardware_concurrency();
 
   LOG_S(INFO) << "start " << g_config->index.threads << " indexers";
+  pipeline::setIndexers(g_config->index.threads);
   for (int i = 0; i < g_config->index.threads; i++)
     spawnThread(indexer, new std::pair<MessageHandler *, int>{m, i});
 
@@ -428,10 +467,9 @@ void standaloneInitialize(MessageHandler &handler, const std::string &root) {
 }
 
 void MessageHandler::initialized(EmptyParam &) {
-  if (didChangeWatchedFiles) {
-    RegistrationParam param;
-    pipeline::request("client/registerCapability", param);
-  }
+  initialized_received = true;
+  if (!watcher::active())
+    registerWatchedFiles();
 }
 
 void MessageHandler::shutdown(EmptyParam &, ReplyOnce &reply) {
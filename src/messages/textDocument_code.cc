@@ -104,8 +104,8 @@ void MessageHandler::textDocument_codeLens(TextDocumentParam &param,
   };
 
   std::unordered_set<Range> seen;
-  for (auto [sym, refcnt] : file->symbol2refcnt) {
-    if (refcnt <= 0 || !sym.extent.valid() || !seen.insert(sym.range).second)
+  for (const ExtentRef &sym : file->extents) {
+    if (!seen.insert(sym.range).second)
       continue;
     switch (sym.kind) {
     case Kind::Func: {
@@ -129,13 +129,21 @@ void MessageHandler::textDocument_definition(TextDocumentPositionParam &param,
           }
         }
       };
-      for (auto &func : db->funcs)
-        fn({func.usr, Kind::Func});
-      for (auto &type : db->types)
-        fn({type.usr, Kind::Type});
-      for (auto &var : db->vars)
+      // Qualified names containing the characters of |short_query|.
+      db->func_names.forEachCandidate(short_query, [&](size_t i) {
+        fn({db->funcs[i].usr, Kind::Func});
+        return false;
+      });
+      db->type_names.forEachCandidate(short_query, [&](size_t i) {
+        fn({db->types[i].usr, Kind::Type});
+        return false;
+      });
+      db->var_names.forEachCandidate(short_query, [&](size_t i) {
+        auto &var = db->vars[i];
         if (var.def.size() && !var.def[0].is_local())
           fn({var.usr, Kind::Var});
+        return false;
+      });
 
       if (best_sym.kind != Kind::Invalid) {
         Maybe<DeclRef> dr = getDefinitionSpell(db, best_sym);
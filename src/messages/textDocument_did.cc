@@ -55,6 +55,7 @@ void MessageHandler::textDocument_didOpen(DidOpenTextDocumentParam &param) {
 void MessageHandler::textDocument_didSave(TextDocumentParam &param) {
   const std::string &path = param.textDocument.uri.getPath();
   pipeline::index(path, {}, IndexMode::Normal, false);
+  indexDependents(path);
   manager->onSave(path);
 }
 } // namespace ccls
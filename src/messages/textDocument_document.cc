@@ -41,9 +41,7 @@ void MessageHandler::textDocument_documentHighlight(
   std::vector<DocumentHighlight> result;
   std::vector<SymbolRef> syms =
       findSymbolsAtLocation(wf, file, param.position, true);
-  for (auto [sym, refcnt] : file->symbol2refcnt) {
-    if (refcnt <= 0)
-      continue;
+  for (const ExtentRef &sym : file->occurrences) {
     Usr usr = sym.usr;
     Kind kind = sym.kind;
     if (std::none_of(syms.begin(), syms.end(), [&](auto &sym1) {
@@ -145,22 +143,18 @@ void MessageHandler::textDocument_documentSymbol(JsonReader &reader,
 
   if (param.startLine >= 0) {
     std::vector<lsRange> result;
-    for (auto [sym, refcnt] : file->symbol2refcnt) {
-      if (refcnt <= 0 || !allows(sym) ||
-          !(param.startLine <= sym.range.start.line &&
-            sym.range.start.line <= param.endLine))
-        continue;
-      if (auto loc = getLsLocation(db, wfiles, sym, file_id))
-        result.push_back(loc->range);
-    }
+    auto &occurrences = file->occurrences;
+    if (param.startLine <= UINT16_MAX)
+      for (auto it = occurrences.lowerBound({uint16_t(param.startLine), 0});
+           it != occurrences.end() && it->range.start.line <= param.endLine;
+           ++it)
+        if (allows(*it))
+          if (auto loc = getLsLocation(db, wfiles, *it, file_id))
+            result.push_back(loc->range);
     std::sort(result.begin(), result.end());
     reply(result);
   } else if (g_config->client.hierarchicalDocumentSymbolSupport) {
-    std::vector<ExtentRef> syms;
-    syms.reserve(file->symbol2refcnt.size());
-    for (auto [sym, refcnt] : file->symbol2refcnt)
-      if (refcnt > 0 && sym.extent.valid())
-        syms.push_back(sym);
+    std::vector<ExtentRef> syms(file->extents.begin(), file->extents.end());
     // Global variables `int i, j, k;` have the same extent.start. Sort them by
     // range.start instead. In case of a tie, prioritize the widest ExtentRef.
     std::sort(syms.begin(), syms.end(),
@@ -210,8 +204,8 @@ void MessageHandler::textDocument_documentSymbol(JsonReader &reader,
     reply(res);
   } else {
     std::vector<SymbolInformation> result;
-    for (auto [sym, refcnt] : file->symbol2refcnt) {
-      if (refcnt <= 0 || !allows(sym))
+    for (const ExtentRef &sym : file->occurrences) {
+      if (!allows(sym))
         continue;
       if (std::optional<SymbolInformation> info =
               getSymbolInfo(db, sym, false)) {
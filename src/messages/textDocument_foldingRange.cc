@@ -25,9 +25,8 @@ void MessageHandler::textDocument_foldingRange(TextDocumentParam &param,
   std::vector<FoldingRange> result;
   std::optional<lsRange> ls_range;
 
-  for (auto [sym, refcnt] : file->symbol2refcnt)
-    if (refcnt > 0 && sym.extent.valid() &&
-        (sym.kind == Kind::Func || sym.kind == Kind::Type) &&
+  for (const ExtentRef &sym : file->extents)
+    if ((sym.kind == Kind::Func || sym.kind == Kind::Type) &&
         (ls_range = getLsRange(wf, sym.extent))) {
       FoldingRange &fold = result.emplace_back();
       fold.startLine = ls_range->start.line;
@@ -106,8 +106,10 @@ void MessageHandler::textDocument_references(JsonReader &reader,
         path = include.resolved_path;
         break;
       }
-    if (path.size())
-      for (QueryFile &file1 : db->files)
+    auto it = db->name2file_id.find(lowerPathIfInsensitive(path));
+    if (path.size() && it != db->name2file_id.end())
+      for (int id : db->files[it->second].includers) {
+        QueryFile &file1 = db->files[id];
         if (file1.def)
           for (const IndexInclude &include : file1.def->includes)
             if (include.resolved_path == path) {
@@ -117,6 +119,7 @@ void MessageHandler::textDocument_references(JsonReader &reader,
               loc.range.start.line = loc.range.end.line = include.line;
               break;
             }
+      }
   }
 
   if ((int)result.size() >= g_config->xref.maxNum)
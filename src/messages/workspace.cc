@@ -38,10 +38,13 @@ void MessageHandler::workspace_didChangeWatchedFiles(
     if ((g_config->cache.directory.size() &&
          StringRef(path).startswith(g_config->cache.directory)) ||
         lookupExtension(path).first == LanguageId::Unknown)
-      return;
-    for (std::string cur = path; cur.size(); cur = sys::path::parent_path(cur))
-      if (cur[0] == '.')
-        return;
+      continue;
+    bool hidden = false;
+    for (std::string cur = path; cur.size() && !hidden;
+         cur = sys::path::parent_path(cur))
+      hidden = cur[0] == '.';
+    if (hidden)
+      continue;
 
     switch (event.type) {
     case FileChangeType::Created:
@@ -50,6 +53,7 @@ void MessageHandler::workspace_didChangeWatchedFiles(
           wfiles->getFile(path) ? IndexMode::Normal : IndexMode::Background;
       pipeline::index(path, {}, mode, true);
       if (event.type == FileChangeType::Changed) {
+        indexDependents(path);
         if (mode == IndexMode::Normal)
           manager->onSave(path);
         else
@@ -172,16 +176,17 @@ void MessageHandler::workspace_symbol(WorkspaceSymbolParam &param,
                      &cands) &&
            cands.size() >= g_config->workspaceSymbol.maxNum;
   };
-  for (auto &func : db->funcs)
-    if (add({func.usr, Kind::Func}))
-      goto done_add;
-  for (auto &type : db->types)
-    if (add({type.usr, Kind::Type}))
-      goto done_add;
-  for (auto &var : db->vars)
-    if (var.def.size() && !var.def[0].is_local() && add({var.usr, Kind::Var}))
-      goto done_add;
-done_add:
+  // Only names containing every character of the query can match.
+  const std::string &q = query_without_space;
+  if (!db->func_names.forEachCandidate(
+          q, [&](size_t i) { return add({db->funcs[i].usr, Kind::Func}); }) &&
+      !db->type_names.forEachCandidate(
+          q, [&](size_t i) { return add({db->types[i].usr, Kind::Type}); }))
+    db->var_names.forEachCandidate(q, [&](size_t i) {
+      auto &var = db->vars[i];
+      return var.def.size() && !var.def[0].is_local() &&
+             add({var.usr, Kind::Var});
+    });
 
   if (g_config->workspaceSymbol.sort && query.size() <= FuzzyMatcher::kMaxPat) {
     // Sort results with a fuzzy matching algorithm.
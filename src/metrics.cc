@@ -0,0 +1,149 @@
+// Copyright 2017-2018 ccls Authors
+// SPDX-License-Identifier: Apache-2.0
+
+#include "metrics.hh"
+
+#include "log.hh"
+
+#include <llvm/ADT/StringMap.h>
+#include <llvm/Support/MathExtras.h>
+
+#include <algorithm>
+#include <math.h>
+#include <mutex>
+#include <stdio.h>
+
+using namespace llvm;
+namespace chrono = std::chrono;
+
+namespace ccls {
+void Histogram::record(uint64_t v) {
+  int i;
+  if (v < kSubBuckets) {
+    i = v;
+  } else {
+    int shift = Log2_64(v) - kSubBits;
+    i = (shift + 1) * kSubBuckets + (v >> shift & (kSubBuckets - 1));
+  }
+  counts[i]++;
+  count_++;
+  max_ = std::max(max_, v);
+  sum_ += v;
+}
+
+uint64_t Histogram::percentile(double q) const {
+  uint64_t target = std::max<uint64_t>(ceil(q * count_), 1), n = 0;
+  for (int i = 0; i < int(std::size(counts)); i++)
+    if ((n += counts[i]) >= target) {
+      if (i < kSubBuckets)
+        return i;
+      int shift = i / kSubBuckets - 1;
+      uint64_t lo = uint64_t(kSubBuckets + i % kSubBuckets) << shift;
+      return std::min(lo + (uint64_t(1) << shift) - 1, max_);
+    }
+  return max_;
+}
+
+namespace metrics {
+namespace {
+struct Pending {
+  MethodStats *stats;
+  chrono::steady_clock::time_point received;
+};
+
+std::mutex mtx;
+StringMap<MethodStats> method2stats;
+// Requests which have been started but not replied, by RequestId::value.
+StringMap<Pending> pending;
+chrono::steady_clock::time_point last_log = chrono::steady_clock::now();
+
+uint64_t us(chrono::steady_clock::duration d) {
+  return std::max<int64_t>(
+      chrono::duration_cast<chrono::microseconds>(d).count(), 0);
+}
+
+MethodStats &getStats(const std::string &method) {
+  MethodStats &stats = method2stats[method];
+  if (stats.method.empty())
+    stats.method = method;
+  return stats;
+}
+
+std::string ms(uint64_t us) {
+  char buf[32];
+  snprintf(buf, sizeof buf, "%.1fms", us / 1000.0);
+  return buf;
+}
+} // namespace
+
+void started(const InMessage &msg) {
+  if (!msg.id.valid())
+    return;
+  std::lock_guard lock(mtx);
+  // Handlers which never reply would leave their entries behind.
+  if (pending.size() >= 1024)
+    pending.clear();
+  pending[msg.id.value] = {&getStats(msg.method), msg.received};
+}
+
+void handled(const InMessage &msg, chrono::steady_clock::time_point start) {
+  auto end = chrono::steady_clock::now();
+  std::lock_guard lock(mtx);
+  MethodStats &stats = getStats(msg.method);
+  stats.queue.record(us(start - msg.received));
+  stats.handler.record(us(end - start));
+}
+
+void replied(const RequestId &id, chrono::steady_clock::duration serialize,
+             size_t size) {
+  auto now = chrono::steady_clock::now();
+  std::lock_guard lock(mtx);
+  auto it = pending.find(id.value);
+  if (it == pending.end())
+    return;
+  MethodStats &stats = *it->second.stats;
+  stats.serialize.record(us(serialize));
+  stats.size.record(size);
+  stats.total.record(us(now - it->second.received));
+  pending.erase(it);
+}
+
+std::vector<MethodStats> snapshot(bool reset) {
+  std::vector<MethodStats> ret;
+  {
+    std::lock_guard lock(mtx);
+    for (auto &it : method2stats)
+      ret.push_back(it.second);
+    if (reset) {
+      // Pending entries point into |method2stats|.
+      pending.clear();
+      method2stats.clear();
+    }
+  }
+  std::sort(ret.begin(), ret.end(), [](auto &l, auto &r) {
+    return l.method < r.method;
+  });
+  return ret;
+}
+
+void logIfDue() {
+  int interval = g_config->request.statsInterval;
+  auto now = chrono::steady_clock::now();
+  if (interval <= 0 || now - last_log < chrono::seconds(interval))
+    return;
+  last_log = now;
+  for (MethodStats &stats : snapshot(false)) {
+    const Histogram &h = stats.handler;
+    if (!h.count())
+      continue;
+    LOG_S(INFO) << stats.method << ": " << h.count() << " calls, queue p50 "
+                << ms(stats.queue.percentile(.5)) << " p99 "
+                << ms(stats.queue.percentile(.99)) << ", handler p50 "
+                << ms(h.percentile(.5)) << " p99 " << ms(h.percentile(.99))
+                << " max " << ms(h.max()) << ", reply p99 "
+                << ms(stats.total.percentile(.99)) << " "
+                << stats.size.percentile(.99) << " bytes";
+  }
+}
+} // namespace metrics
+} // namespace ccls
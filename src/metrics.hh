@@ -0,0 +1,65 @@
+// Copyright 2017-2018 ccls Authors
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+#include "lsp.hh"
+
+#include <chrono>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace ccls {
+// A histogram of non-negative values with log-linear buckets as in
+// HdrHistogram: every power of two is split into kSubBuckets buckets, so a
+// percentile is reported with a relative error of at most 1/kSubBuckets.
+class Histogram {
+  static constexpr int kSubBits = 3, kSubBuckets = 1 << kSubBits;
+  uint64_t counts[(64 - kSubBits + 1) * kSubBuckets] = {};
+  uint64_t count_ = 0, max_ = 0, sum_ = 0;
+
+public:
+  void record(uint64_t v);
+  uint64_t count() const { return count_; }
+  uint64_t max() const { return max_; }
+  uint64_t sum() const { return sum_; }
+  // The upper bound of the bucket containing the |q|-quantile, 0 <= q <= 1.
+  uint64_t percentile(double q) const;
+};
+
+namespace metrics {
+// Latencies are in microseconds and sizes in bytes. |serialize| and |size|
+// are only recorded for requests.
+struct MethodStats {
+  std::string method;
+  // From receipt to the start of the handler, including the time spent in the
+  // backlog waiting for the document to be indexed.
+  Histogram queue;
+  // The handler on the main thread. Some requests reply later on other
+  // threads, e.g. completion.
+  Histogram handler;
+  // Writing the reply as JSON.
+  Histogram serialize;
+  Histogram size;
+  // From receipt to the reply.
+  Histogram total;
+};
+
+// Called by MessageHandler::run before and after the handler. If the message
+// is moved to the backlog, it is started again when it is retried.
+void started(const InMessage &msg);
+void handled(const InMessage &msg, std::chrono::steady_clock::time_point start);
+
+// Called by pipeline::reply after the reply to |id| has been serialized.
+void replied(const RequestId &id, std::chrono::steady_clock::duration serialize,
+             size_t size);
+
+// The statistics of every method seen, sorted by method name.
+std::vector<MethodStats> snapshot(bool reset);
+
+// Log the statistics every request.statsInterval seconds. Called by the main
+// thread when idle.
+void logIfDue();
+} // namespace metrics
+} // namespace ccls
@@ -3,16 +3,25 @@
 
 #include "pipeline.hh"
 
+#include "cache_store.hh"
 #include "config.hh"
+#include "file_cache.hh"
 #include "include_complete.hh"
+#include "index_cost.hh"
+#include "index_worker.hh"
 #include "log.hh"
+#include "metrics.hh"
 #include "lsp.hh"
 #include "message_handler.hh"
 #include "pipeline.hh"
 #include "platform.hh"
 #include "project.hh"
 #include "query.hh"
+#include "replay.hh"
 #include "sema_manager.hh"
+#include "snapshot.hh"
+#include "trace.hh"
+#include "watcher.hh"
 
 #include <rapidjson/document.h>
 #include <rapidjson/writer.h>
@@ -87,8 +96,24 @@ struct IndexRequest {
   bool must_exist = false;
   RequestId id;
   int64_t ts = tick++;
+  // Compared with pending_index to drop superseded copies.
+  int64_t generation = 0;
+  // Estimated milliseconds, added to stats.pending_cost while queued.
+  int64_t cost = 0;
 };
 
+// Lanes of index_request, in decreasing priority.
+enum class IndexLane {
+  // Files opened or saved by the user.
+  Interactive,
+  // Background requests for files related to open or changed files
+  // (Project::indexRelated, workspace/didChangeWatchedFiles).
+  Dependent,
+  // The initial crawl of the project.
+  Background,
+};
+constexpr int kIndexLanes = 3;
+
 std::mutex thread_mtx;
 std::condition_variable no_active_threads;
 int active_threads;
@@ -97,10 +122,75 @@ MultiQueueWaiter *main_waiter;
 MultiQueueWaiter *indexer_waiter;
 MultiQueueWaiter *stdout_waiter;
 ThreadedQueue<InMessage> *on_request;
-ThreadedQueue<IndexRequest> *index_request;
+WorkStealingQueue<IndexRequest, kIndexLanes> *index_request;
 ThreadedQueue<IndexUpdate> *on_indexed;
 ThreadedQueue<std::string> *for_stdout;
 
+// The latest request for each queued path. A request for a path which is
+// already queued is merged into it instead of being queued again, unless it
+// needs a higher lane; the copy in the lower lane then becomes stale and is
+// dropped when popped.
+struct PendingIndex {
+  IndexRequest request;
+  IndexLane lane;
+  int64_t generation = 0;
+};
+std::mutex pending_mtx;
+std::unordered_map<std::string, PendingIndex> pending_index;
+int64_t pending_generation = 0;
+
+// Returns false if |request| has been superseded. Otherwise it is replaced
+// with the merged request and its path is no longer pending.
+bool takePending(IndexRequest &request) {
+  std::lock_guard lock(pending_mtx);
+  auto it = pending_index.find(request.path);
+  if (it == pending_index.end() ||
+      it->second.generation != request.generation)
+    return false;
+  request = std::move(it->second.request);
+  pending_index.erase(it);
+  return true;
+}
+
+// Memory governor for index.memoryBudget. Indexer threads whose index is not
+// less than |indexer_limit| do not dequeue. The limit is adjusted at most once
+// per kGovernorIntervalMs: halved while over budget and raised by one while
+// below 80% of it.
+constexpr int kGovernorIntervalMs = 1000;
+std::mutex governor_mtx;
+std::condition_variable governor_cv;
+std::atomic<int> indexer_limit{1};
+int n_indexers = 1;
+chrono::steady_clock::time_point governor_last;
+
+void governMemory() {
+  int64_t budget = int64_t(g_config->index.memoryBudget) << 20;
+  if (budget <= 0)
+    return;
+  std::unique_lock lock(governor_mtx, std::try_to_lock);
+  auto now = chrono::steady_clock::now();
+  if (!lock ||
+      now - governor_last < chrono::milliseconds(kGovernorIntervalMs))
+    return;
+  governor_last = now;
+  int64_t rss = getResidentSetSize() + index_worker::residentSetSize();
+  int limit = indexer_limit.load(std::memory_order_relaxed), limit1 = limit;
+  if (rss > budget) {
+    limit1 = std::max(limit / 2, 1);
+    freeUnusedMemory();
+  } else if (rss < budget / 10 * 8 && limit < n_indexers) {
+    limit1 = limit + 1;
+  }
+  if (limit1 == limit)
+    return;
+  LOG_S(INFO) << "RSS " << (rss >> 20) << " MiB, budget " << (budget >> 20)
+              << " MiB: " << limit1 << " active indexers";
+  indexer_limit.store(limit1, std::memory_order_relaxed);
+  stats.concurrency = limit1;
+  if (limit1 > limit)
+    governor_cv.notify_all();
+}
+
 struct InMemoryIndexFile {
   std::string content;
   IndexFile index;
@@ -108,16 +198,29 @@ struct InMemoryIndexFile {
 std::shared_mutex g_index_mutex;
 std::unordered_map<std::string, InMemoryIndexFile> g_index;
 
+// Called after an mtime mismatch, so that unchanged files (e.g. touched by
+// git checkout) are only hashed when needed.
+bool sameContent(const std::string &path, uint64_t hash) {
+  return hash && file_cache::hash(path) == hash;
+}
+
+// If the mtime has changed but the content has not, prev->mtime is updated.
 bool cacheInvalid(VFS *vfs, IndexFile *prev, const std::string &path,
                   const std::vector<const char *> &args,
                   const std::optional<std::string> &from) {
+  int64_t ts;
   {
     std::lock_guard<std::mutex> lock(vfs->mutex);
-    if (prev->mtime < vfs->state[path].timestamp) {
+    ts = vfs->state[path].timestamp;
+  }
+  if (prev->mtime < ts) {
+    if (!sameContent(path, prev->hash)) {
       LOG_V(1) << "timestamp changed for " << path
                << (from ? " (via " + *from + ")" : std::string());
       return true;
     }
+    LOG_V(1) << "content unchanged for " << path;
+    prev->mtime = ts;
   }
 
   // For inferred files, allow -o a a.cc -> -o b b.cc
@@ -144,6 +247,8 @@ std::string appendSerializationFormat(const std::string &base) {
     return base + ".blob";
   case SerializeFormat::Json:
     return base + ".json";
+  case SerializeFormat::Flat:
+    return base + ".flat";
   }
 }
 
@@ -179,15 +284,32 @@ std::unique_ptr<IndexFile> rawCacheLoad(const std::string &path) {
   }
 
   std::string cache_path = getCachePath(path);
-  std::optional<std::string> file_content = readContent(cache_path);
-  std::optional<std::string> serialized_indexed_content =
-      readContent(appendSerializationFormat(cache_path));
-  if (!file_content || !serialized_indexed_content)
+  auto file_content = cache_store::read(cache_path);
+  auto serialized = cache_store::read(appendSerializationFormat(cache_path));
+  if (!file_content || !serialized)
     return nullptr;
+  return ccls::deserialize(
+      g_config->cache.format, path,
+      std::string_view(serialized->getBufferStart(),
+                       serialized->getBufferSize()),
+      file_content->getBuffer().str(), IndexFile::kMajorVersion);
+}
 
-  return ccls::deserialize(g_config->cache.format, path,
-                           *serialized_indexed_content, *file_content,
-                           IndexFile::kMajorVersion);
+// Store refreshed mtimes of a revalidated cache so that the next load does not
+// need to hash again.
+void refreshCache(IndexFile &file) {
+  if (g_config->cache.retainInMemory) {
+    std::lock_guard lock(g_index_mutex);
+    auto it = g_index.find(file.path);
+    if (it != g_index.end()) {
+      it->second.index.mtime = file.mtime;
+      it->second.index.dependencies = file.dependencies;
+    }
+  }
+  // Paths have been mapped by deserialize and cannot be written back.
+  if (g_config->cache.directory.size() && g_config->clang.pathMappings.empty())
+    cache_store::write(appendSerializationFormat(getCachePath(file.path)),
+                       serialize(g_config->cache.format, file));
 }
 
 std::mutex &getFileMutex(const std::string &path) {
@@ -196,25 +318,98 @@ std::mutex &getFileMutex(const std::string &path) {
   return mutexes[std::hash<std::string>()(path) % n_MUTEXES];
 }
 
+// If |update| was computed against the result of a queued update of the same
+// file (A->B followed by B->C), merge them into A->C so that the main thread
+// and the client only see the final state.
+void pushIndexUpdate(IndexUpdate &&update, bool priority) {
+  bool merged = on_indexed->pushBackOrMerge(
+      std::move(update), priority,
+      [](IndexUpdate &queued, IndexUpdate &u) {
+        return queued.files_def_update && u.files_def_update &&
+               queued.files_def_update->first.path ==
+                   u.files_def_update->first.path;
+      },
+      [](IndexUpdate &queued, IndexUpdate &u) {
+        if (!u.has_prev)
+          return false;
+        queued.merge(std::move(u));
+        return true;
+      });
+  if (merged)
+    stats.coalesced++;
+}
+
+// The value of stats.enqueued when a semantic highlight refresh was requested,
+// or -1. The refresh is emitted once as many requests have completed.
+std::atomic<int64_t> refresh_at{-1};
+
+void refreshIfCaughtUp() {
+  int64_t at = refresh_at.load();
+  if (at < 0 || stats.completed < at ||
+      !refresh_at.compare_exchange_strong(at, -1))
+    return;
+  IndexUpdate dummy;
+  dummy.refresh = true;
+  on_indexed->pushBack(std::move(dummy), false);
+}
+
+// Peak growth of the resident set size while a translation unit is parsed
+// in-process. Indexer threads share the process, so it is only known if no
+// other translation unit was parsed in the meantime.
+std::mutex peak_mtx;
+int n_parsing = 0;
+int64_t n_parses = 0;
+
+class PeakRss {
+  int64_t id;
+  int64_t rss0 = 0;
+  bool alone = false;
+
+public:
+  PeakRss() {
+    std::lock_guard lock(peak_mtx);
+    id = ++n_parses;
+    if (!n_parsing++ && resetPeakResidentSetSize()) {
+      alone = true;
+      rss0 = getResidentSetSize();
+    }
+  }
+  ~PeakRss() {
+    std::lock_guard lock(peak_mtx);
+    n_parsing--;
+  }
+  // Returns 0 if unknown.
+  int64_t get() {
+    std::lock_guard lock(peak_mtx);
+    if (!alone || n_parses != id)
+      return 0;
+    return std::max<int64_t>(getPeakResidentSetSize() - rss0, 0);
+  }
+};
+
 bool indexer_Parse(SemaManager *completion, WorkingFiles *wfiles,
-                   Project *project, VFS *vfs, const GroupMatch &matcher) {
-  std::optional<IndexRequest> opt_request = index_request->tryPopFront();
+                   Project *project, VFS *vfs, const GroupMatch &matcher,
+                   int idx) {
+  std::optional<IndexRequest> opt_request = index_request->tryPopFront(idx);
   if (!opt_request)
     return false;
   auto &request = *opt_request;
   bool loud = request.mode != IndexMode::OnChange;
 
-  // Dummy one to trigger refresh semantic highlight.
-  if (request.path.empty()) {
-    IndexUpdate dummy;
-    dummy.refresh = true;
-    on_indexed->pushBack(std::move(dummy), false);
+  if (!takePending(request))
     return false;
-  }
-
   struct RAII {
-    ~RAII() { stats.completed++; }
-  } raii;
+    int64_t cost;
+    bool parsed = false;
+    ~RAII() {
+      stats.pending_cost -= cost;
+      stats.completed_cost += cost;
+      if (parsed)
+        stats.parsed_cost += cost;
+      stats.completed++;
+      refreshIfCaughtUp();
+    }
+  } raii{request.cost};
   if (!matcher.matches(request.path)) {
     LOG_IF_S(INFO, loud) << "skip " << request.path;
     return false;
@@ -263,19 +458,32 @@ bool indexer_Parse(SemaManager *completion, WorkingFiles *wfiles,
                (g_config->index.trackDependency == 1 && request.ts < loaded_ts);
   if (!reparse && !track)
     return true;
+  // Consumed even if reparsed, as the dependencies may change.
+  if (snapshot::unchanged(vfs, path_to_index) && !reparse)
+    return true;
 
   if (reparse < 2)
     do {
+      trace::Span span("load cache", path_to_index);
       std::unique_lock lock(getFileMutex(path_to_index));
       prev = rawCacheLoad(path_to_index);
-      if (!prev || prev->no_linkage < no_linkage ||
+      if (!prev)
+        break;
+      int64_t prev_mtime = prev->mtime;
+      if (prev->no_linkage < no_linkage ||
           cacheInvalid(vfs, prev.get(), path_to_index, entry.args,
                        std::nullopt))
         break;
+      bool refresh = prev->mtime != prev_mtime;
       if (track)
-        for (const auto &dep : prev->dependencies) {
+        for (auto &dep : prev->dependencies) {
           if (auto mtime1 = lastWriteTime(dep.first.val().str())) {
-            if (dep.second < *mtime1) {
+            if (dep.second.mtime < *mtime1) {
+              if (sameContent(dep.first.val().str(), dep.second.hash)) {
+                dep.second.mtime = *mtime1;
+                refresh = true;
+                continue;
+              }
               reparse = 2;
               LOG_V(1) << "timestamp changed for " << path_to_index << " via "
                        << dep.first.val().str();
@@ -288,18 +496,19 @@ bool indexer_Parse(SemaManager *completion, WorkingFiles *wfiles,
             break;
           }
         }
-      if (reparse == 0)
-        return true;
       if (reparse == 2)
         break;
+      if (refresh)
+        refreshCache(*prev);
+      if (reparse == 0)
+        return true;
 
       if (vfs->loaded(path_to_index))
         return true;
       LOG_S(INFO) << "load cache for " << path_to_index;
       auto dependencies = prev->dependencies;
       IndexUpdate update = IndexUpdate::createDelta(nullptr, prev.get());
-      on_indexed->pushBack(std::move(update),
-                           request.mode != IndexMode::Background);
+      pushIndexUpdate(std::move(update), request.mode != IndexMode::Background);
       {
         std::lock_guard lock1(vfs->mutex);
         VFS::State &st = vfs->state[path_to_index];
@@ -311,12 +520,17 @@ bool indexer_Parse(SemaManager *completion, WorkingFiles *wfiles,
 
       for (const auto &dep : dependencies) {
         std::string path = dep.first.val().str();
-        if (!vfs->stamp(path, dep.second, 1))
+        if (!vfs->stamp(path, dep.second.mtime, 1))
           continue;
         std::lock_guard lock1(getFileMutex(path));
         prev = rawCacheLoad(path);
         if (!prev)
           continue;
+        if (prev->mtime < dep.second.mtime && prev->hash &&
+            prev->hash == dep.second.hash) {
+          prev->mtime = dep.second.mtime;
+          refreshCache(*prev);
+        }
         {
           std::lock_guard lock2(vfs->mutex);
           VFS::State &st = vfs->state[path];
@@ -328,8 +542,8 @@ bool indexer_Parse(SemaManager *completion, WorkingFiles *wfiles,
             st.step = 3;
         }
         IndexUpdate update = IndexUpdate::createDelta(nullptr, prev.get());
-        on_indexed->pushBack(std::move(update),
-                             request.mode != IndexMode::Background);
+        pushIndexUpdate(std::move(update),
+                        request.mode != IndexMode::Background);
         if (entry.id >= 0) {
           std::lock_guard lock2(project->mtx);
           project->root2folder[entry.root].path2entry_index[path] = entry.id;
@@ -353,9 +567,19 @@ bool indexer_Parse(SemaManager *completion, WorkingFiles *wfiles,
         remapped.emplace_back(path_to_index, content);
     }
     bool ok;
+    trace::Span span("index", path_to_index);
+    auto start = chrono::steady_clock::now();
+    raii.parsed = true;
+    std::optional<PeakRss> peak;
+    if (!index_worker::enabled())
+      peak.emplace();
     auto result =
-        idx::index(completion, wfiles, vfs, entry.directory, path_to_index,
-                   entry.args, remapped, no_linkage, ok);
+        index_worker::enabled()
+            ? index_worker::index(vfs, entry.directory, path_to_index,
+                                  entry.args, remapped, no_linkage, ok)
+            : idx::index(completion, wfiles, vfs, entry.directory,
+                         path_to_index, entry.args, remapped, no_linkage, ok);
+    span.end();
     indexes = std::move(result.indexes);
     n_errs = result.n_errs;
     first_error = std::move(result.first_error);
@@ -369,6 +593,16 @@ bool indexer_Parse(SemaManager *completion, WorkingFiles *wfiles,
       }
       return true;
     }
+
+    index_cost::Cost cost;
+    cost.ms = chrono::duration_cast<chrono::milliseconds>(
+                  chrono::steady_clock::now() - start)
+                  .count();
+    cost.rss = peak ? peak->get() : result.rss;
+    for (auto &file : indexes)
+      cost.symbols += file->usr2func.size() + file->usr2type.size() +
+                      file->usr2var.size();
+    index_cost::record(path_to_index, cost);
   }
 
   if (loud || n_errs) {
@@ -410,22 +644,23 @@ bool indexer_Parse(SemaManager *completion, WorkingFiles *wfiles,
         std::string().swap(it.first->second.index.file_contents);
       }
       if (g_config->cache.directory.size()) {
+        trace::Span span("write cache", path);
         std::string cache_path = getCachePath(path);
+        snapshot::invalidate();
         if (deleted) {
-          (void)sys::fs::remove(cache_path);
-          (void)sys::fs::remove(appendSerializationFormat(cache_path));
+          cache_store::remove(cache_path);
+          cache_store::remove(appendSerializationFormat(cache_path));
         } else {
-          if (g_config->cache.hierarchicalPath)
-            sys::fs::create_directories(
-                sys::path::parent_path(cache_path, sys::path::Style::posix),
-                true);
-          writeToFile(cache_path, curr->file_contents);
-          writeToFile(appendSerializationFormat(cache_path),
-                      serialize(g_config->cache.format, *curr));
+          cache_store::write(cache_path, curr->file_contents);
+          cache_store::write(appendSerializationFormat(cache_path),
+                             serialize(g_config->cache.format, *curr));
         }
       }
-      on_indexed->pushBack(IndexUpdate::createDelta(prev.get(), curr.get()),
-                           request.mode != IndexMode::Background);
+      {
+        trace::Span span("delta", path);
+        pushIndexUpdate(IndexUpdate::createDelta(prev.get(), curr.get()),
+                        request.mode != IndexMode::Background);
+      }
       {
         std::lock_guard lock1(vfs->mutex);
         vfs->state[path].loaded++;
@@ -448,10 +683,14 @@ void quit(SemaManager &manager) {
 
   { std::lock_guard lock(index_request->mutex_); }
   indexer_waiter->cv.notify_all();
+  { std::lock_guard lock(governor_mtx); }
+  governor_cv.notify_all();
   { std::lock_guard lock(for_stdout->mutex_); }
   stdout_waiter->cv.notify_one();
   std::unique_lock lock(thread_mtx);
   no_active_threads.wait(lock, [] { return !active_threads; });
+  index_cost::save();
+  cache_store::flush();
 }
 
 } // namespace
@@ -467,55 +706,91 @@ void threadLeave() {
     no_active_threads.notify_one();
 }
 
+void wakeMain() {
+  { std::lock_guard lock(on_request->mutex_); }
+  main_waiter->cv.notify_one();
+}
+
 void init() {
   main_waiter = new MultiQueueWaiter;
   on_request = new ThreadedQueue<InMessage>(main_waiter);
   on_indexed = new ThreadedQueue<IndexUpdate>(main_waiter);
 
   indexer_waiter = new MultiQueueWaiter;
-  index_request = new ThreadedQueue<IndexRequest>(indexer_waiter);
+  index_request =
+      new WorkStealingQueue<IndexRequest, kIndexLanes>(indexer_waiter);
 
   stdout_waiter = new MultiQueueWaiter;
   for_stdout = new ThreadedQueue<std::string>(stdout_waiter);
 }
 
+void setIndexers(int n) {
+  index_request->setWorkers(n);
+  {
+    std::lock_guard lock(governor_mtx);
+    n_indexers = n;
+  }
+  indexer_limit = n;
+  stats.concurrency = n;
+}
+
 void indexer_Main(SemaManager *manager, VFS *vfs, Project *project,
-                  WorkingFiles *wfiles) {
+                  WorkingFiles *wfiles, int idx) {
   GroupMatch matcher(g_config->index.whitelist, g_config->index.blacklist);
-  while (true)
-    if (!indexer_Parse(manager, wfiles, project, vfs, matcher))
+  while (true) {
+    governMemory();
+    if (idx >= indexer_limit.load(std::memory_order_relaxed)) {
+      // Paused. Free the memory held by the index worker of this thread.
+      index_worker::release();
+      std::unique_lock lock(governor_mtx);
+      governor_cv.wait_for(lock, chrono::milliseconds(kGovernorIntervalMs));
+      if (g_quit.load(std::memory_order_relaxed))
+        break;
+      continue;
+    }
+    if (!indexer_Parse(manager, wfiles, project, vfs, matcher, idx))
       if (indexer_waiter->wait(g_quit, index_request))
         break;
+  }
 }
 
-void main_OnIndexed(DB *db, WorkingFiles *wfiles, IndexUpdate *update) {
-  if (update->refresh) {
-    LOG_S(INFO)
-        << "loaded project. Refresh semantic highlight for all working file.";
-    std::lock_guard lock(wfiles->mutex);
-    for (auto &[f, wf] : wfiles->files) {
-      std::string path = lowerPathIfInsensitive(f);
-      if (db->name2file_id.find(path) == db->name2file_id.end())
-        continue;
-      QueryFile &file = db->files[db->name2file_id[path]];
-      emitSemanticHighlight(db, wf.get(), file);
+void main_OnIndexed(DB *db, WorkingFiles *wfiles,
+                    std::vector<IndexUpdate> &updates) {
+  trace::Span span("apply index updates");
+  std::vector<IndexUpdate *> to_apply;
+  for (IndexUpdate &update : updates)
+    if (!update.refresh)
+      to_apply.push_back(&update);
+  db->applyIndexUpdates(to_apply);
+
+  for (IndexUpdate &update : updates) {
+    if (update.refresh) {
+      LOG_S(INFO)
+          << "loaded project. Refresh semantic highlight for all working file.";
+      std::lock_guard lock(wfiles->mutex);
+      for (auto &[f, wf] : wfiles->files) {
+        std::string path = lowerPathIfInsensitive(f);
+        if (db->name2file_id.find(path) == db->name2file_id.end())
+          continue;
+        QueryFile &file = db->files[db->name2file_id[path]];
+        emitSemanticHighlight(db, wf.get(), file);
+      }
+      continue;
     }
-    return;
-  }
 
-  db->applyIndexUpdate(update);
-
-  // Update indexed content, skipped ranges, and semantic highlighting.
-  if (update->files_def_update) {
-    auto &def_u = *update->files_def_update;
-    if (WorkingFile *wfile = wfiles->getFile(def_u.first.path)) {
-      // FIXME With index.onChange: true, use buffer_content only for
-      // request.path
-      wfile->setIndexContent(g_config->index.onChange ? wfile->buffer_content
-                                                      : def_u.second);
-      QueryFile &file = db->files[update->file_id];
-      emitSkippedRanges(wfile, file);
-      emitSemanticHighlight(db, wfile, file);
+    // Update indexed content, skipped ranges, and semantic highlighting.
+    if (update.files_def_update) {
+      auto &def_u = *update.files_def_update;
+      watcher::watch(def_u.first.path);
+      if (WorkingFile *wfile = wfiles->getFile(def_u.first.path)) {
+        // FIXME With index.onChange: true, use buffer_content only for
+        // request.path
+        wfile->setIndexContent(g_config->index.onChange ? wfile->buffer_content
+                                                        : def_u.second);
+        QueryFile &file = db->files[update.file_id];
+        emitSkippedRanges(wfile, file);
+        emitSemanticHighlight(db, wfile, file);
+      }
     }
   }
 }
@@ -553,33 +828,11 @@ void launchStdin() {
         str[i] = c;
       }
 
-      auto message = std::make_unique<char[]>(len);
-      std::copy(str.begin(), str.end(), message.get());
-      auto document = std::make_unique<rapidjson::Document>();
-      document->Parse(message.get(), len);
-      assert(!document->HasParseError());
-
-      JsonReader reader{document.get()};
-      if (!reader.m->HasMember("jsonrpc") ||
-          std::string((*reader.m)["jsonrpc"].GetString()) != "2.0")
-        break;
-      RequestId id;
+      replay::record(str);
       std::string method;
-      reflectMember(reader, "id", id);
-      reflectMember(reader, "method", method);
-      if (id.valid())
-        LOG_V(2) << "receive RequestMessage: " << id.value << " " << method;
-      else
-        LOG_V(2) << "receive NotificationMessage " << method;
-      if (method.empty())
-        continue;
+      if (!pushMessage(str, method))
+        break;
       received_exit = method == "exit";
-      // g_config is not available before "initialize". Use 0 in that case.
-      on_request->pushBack(
-          {id, std::move(method), std::move(message), std::move(document),
-           chrono::steady_clock::now() +
-               chrono::milliseconds(g_config ? g_config->request.timeout : 0)});
-
       if (received_exit)
         break;
     }
@@ -599,6 +852,36 @@ void launchStdin() {
   }).detach();
 }
 
+bool pushMessage(std::string_view str, std::string &method) {
+  trace::Span span("parse message");
+  auto message = std::make_unique<char[]>(str.size());
+  std::copy(str.begin(), str.end(), message.get());
+  auto document = std::make_unique<rapidjson::Document>();
+  document->Parse(message.get(), str.size());
+  assert(!document->HasParseError());
+
+  JsonReader reader{document.get()};
+  if (!reader.m->HasMember("jsonrpc") ||
+      std::string((*reader.m)["jsonrpc"].GetString()) != "2.0")
+    return false;
+  RequestId id;
+  method.clear();
+  reflectMember(reader, "id", id);
+  reflectMember(reader, "method", method);
+  if (id.valid())
+    LOG_V(2) << "receive RequestMessage: " << id.value << " " << method;
+  else
+    LOG_V(2) << "receive NotificationMessage " << method;
+  if (method.empty())
+    return true;
+  // g_config is not available before "initialize". Use 0 in that case.
+  on_request->pushBack(
+      {id, method, std::move(message), std::move(document),
+       chrono::steady_clock::now() +
+           chrono::milliseconds(g_config ? g_config->request.timeout : 0)});
+  return true;
+}
+
 void launchStdout() {
   threadEnter();
   std::thread([]() {
@@ -607,6 +890,7 @@ void launchStdout() {
     while (true) {
       std::vector<std::string> messages = for_stdout->dequeueAll();
       for (auto &s : messages) {
+        trace::Span span("write message");
         llvm::outs() << "Content-Length: " << s.size() << "\r\n\r\n" << s;
         llvm::outs().flush();
       }
@@ -683,24 +967,28 @@ void mainLoop() {
         path2backlog[ex.path].push_back(&backlog.back());
       }
 
-    bool indexed = false;
+    std::vector<IndexUpdate> updates;
     for (int i = 20; i--;) {
       std::optional<IndexUpdate> update = on_indexed->tryPopFront();
       if (!update)
         break;
+      updates.push_back(std::move(*update));
+    }
+    bool indexed = updates.size();
+    if (indexed) {
       did_work = true;
-      indexed = true;
-      main_OnIndexed(&db, &wfiles, &*update);
-      if (update->files_def_update) {
-        auto it = path2backlog.find(update->files_def_update->first.path);
-        if (it != path2backlog.end()) {
-          for (auto &message : it->second) {
-            handler.run(*message);
-            message->backlog_path.clear();
+      main_OnIndexed(&db, &wfiles, updates);
+      for (IndexUpdate &update : updates)
+        if (update.files_def_update) {
+          auto it = path2backlog.find(update.files_def_update->first.path);
+          if (it != path2backlog.end()) {
+            for (auto &message : it->second) {
+              handler.run(*message);
+              message->backlog_path.clear();
+            }
+            path2backlog.erase(it);
           }
-          path2backlog.erase(it);
         }
-      }
     }
 
     int64_t completed = stats.completed.load(std::memory_order_relaxed);
@@ -728,11 +1016,29 @@ void mainLoop() {
         param.value.message =
             (Twine(completed - last_idle) + "/" + Twine(enqueued - last_idle))
                 .str();
+        // Estimated from the recorded costs, scaled by the share of the
+        // completed cost that was parsed rather than loaded from cache,
+        // assuming the indexers allowed by the governor are busy.
+        int64_t eta = stats.pending_cost.load(std::memory_order_relaxed),
+                done = stats.completed_cost.load(std::memory_order_relaxed);
+        if (done > 0)
+          eta = eta * stats.parsed_cost.load(std::memory_order_relaxed) / done;
+        eta /= std::max<int64_t>(
+                   stats.concurrency.load(std::memory_order_relaxed), 1) *
+               1000;
+        if (eta >= 60)
+          param.value.message += (", ~" + Twine(eta / 60) + "m" +
+                                  Twine(eta % 60) + "s left")
+                                     .str();
+        else if (eta > 0)
+          param.value.message += (", ~" + Twine(eta) + "s left").str();
         param.value.percentage =
             100 * (completed - last_idle) / (enqueued - last_idle);
         notify("$/progress", param);
       } else if (in_progress) {
         stats.last_idle.store(enqueued, std::memory_order_relaxed);
+        stats.completed_cost.store(0, std::memory_order_relaxed);
+        stats.parsed_cost.store(0, std::memory_order_relaxed);
         WorkDoneProgressParam param;
         param.token = index_progress_token;
         param.value.kind = "end";
@@ -749,19 +1055,34 @@ void mainLoop() {
     } else {
       if (has_indexed) {
         freeUnusedMemory();
+        index_cost::save();
+        cache_store::flush();
         has_indexed = false;
       }
-      if (backlog.empty())
-        main_waiter->wait(g_quit, on_indexed, on_request);
+      metrics::logIfDue();
+      snapshot::saveIfDue(&db, &vfs, [] {
+        return stats.completed == stats.enqueued && !on_indexed->size();
+      });
+      auto deadline = snapshot::nextSave();
+      if (backlog.size() && (!deadline || backlog[0].deadline < *deadline))
+        deadline = backlog[0].deadline;
+      if (deadline)
+        main_waiter->waitUntil(*deadline, on_indexed, on_request);
       else
-        main_waiter->waitUntil(backlog[0].deadline, on_indexed, on_request);
+        main_waiter->wait(g_quit, on_indexed, on_request);
     }
   }
 
   quit(manager);
+  // Indexers have stopped. Apply their remaining updates so that the database
+  // matches the cache files.
+  std::vector<IndexUpdate> updates = on_indexed->dequeueAll();
+  if (updates.size())
+    main_OnIndexed(&db, &wfiles, updates);
+  snapshot::save(&db, &vfs);
 }
 
-void standalone(const std::string &root) {
+void standalone(const std::string &root, DB *db) {
   Project project;
   WorkingFiles wfiles;
   VFS vfs;
@@ -772,6 +1093,7 @@ void standalone(const std::string &root) {
   IncludeComplete complete(&project);
 
   MessageHandler handler;
+  handler.db = db;
   handler.project = &project;
   handler.wfiles = &wfiles;
   handler.vfs = &vfs;
@@ -788,7 +1110,9 @@ void standalone(const std::string &root) {
     printf("entries:   %4d\n", entries);
   }
   while (1) {
-    (void)on_indexed->dequeueAll();
+    std::vector<IndexUpdate> updates = on_indexed->dequeueAll();
+    if (db && updates.size())
+      main_OnIndexed(db, &wfiles, updates);
     int64_t enqueued = stats.enqueued, completed = stats.completed;
     if (tty) {
       printf("\rcompleted: %4" PRId64 "/%" PRId64, completed, enqueued);
@@ -801,14 +1125,57 @@ void standalone(const std::string &root) {
   if (tty)
     puts("");
   quit(manager);
+  if (db) {
+    std::vector<IndexUpdate> updates = on_indexed->dequeueAll();
+    main_OnIndexed(db, &wfiles, updates);
+  }
 }
 
 void index(const std::string &path, const std::vector<const char *> &args,
            IndexMode mode, bool must_exist, RequestId id) {
-  if (!path.empty())
-    stats.enqueued++;
-  index_request->pushBack({path, args, mode, must_exist, std::move(id)},
-                          mode != IndexMode::Background);
+  IndexLane lane = mode != IndexMode::Background ? IndexLane::Interactive
+                   : must_exist                  ? IndexLane::Dependent
+                                                 : IndexLane::Background;
+  // An empty path requests a semantic highlight refresh after the requests
+  // queued so far.
+  if (path.empty()) {
+    refresh_at = stats.enqueued.load();
+    refreshIfCaughtUp();
+    return;
+  }
+  IndexRequest request{path, args, mode, must_exist, std::move(id)};
+  file_cache::invalidate(path);
+  index_worker::invalidate(path);
+  int64_t cost = index_cost::estimate(path);
+  {
+    std::lock_guard lock(pending_mtx);
+    auto [it, inserted] = pending_index.try_emplace(path);
+    PendingIndex &pending = it->second;
+    if (inserted) {
+      request.cost = cost;
+      stats.pending_cost += cost;
+      stats.enqueued++;
+    } else {
+      // The newer request wins. If neither is a deletion, the higher mode
+      // wins; the reply id of the older request is kept if the newer has none.
+      IndexRequest &old = pending.request;
+      if (mode != IndexMode::Delete && old.mode != IndexMode::Delete)
+        request.mode = std::max(mode, old.mode);
+      if (!request.id.valid())
+        request.id = std::move(old.id);
+      request.ts = std::min(request.ts, old.ts);
+      request.cost = old.cost;
+      if (lane >= pending.lane) {
+        request.generation = pending.generation;
+        old = std::move(request);
+        return;
+      }
+    }
+    request.generation = pending.generation = ++pending_generation;
+    pending.request = request;
+    pending.lane = lane;
+  }
+  index_request->pushBack(std::move(request), (int)lane);
 }
 
 void removeCache(const std::string &path) {
@@ -826,7 +1193,9 @@ std::optional<std::string> loadIndexedContent(const std::string &path) {
       return {};
     return it->second.content;
   }
-  return readContent(getCachePath(path));
+  if (auto buf = cache_store::read(getCachePath(path)))
+    return buf->getBuffer().str();
+  return {};
 }
 
 void notifyOrRequest(const char *method, bool request,
@@ -851,6 +1220,28 @@ void notifyOrRequest(const char *method, bool request,
   for_stdout->pushBack(output.GetString());
 }
 
+void pushNotification(const char *method,
+                      const std::function<void(JsonWriter &)> &fn) {
+  rapidjson::StringBuffer output;
+  rapidjson::Writer<rapidjson::StringBuffer> w(output);
+  w.StartObject();
+  w.Key("jsonrpc");
+  w.String("2.0");
+  w.Key("method");
+  w.String(method);
+  w.Key("params");
+  JsonWriter writer(&w);
+  fn(writer);
+  w.EndObject();
+  std::string_view str(output.GetString(), output.GetSize());
+  auto message = std::make_unique<char[]>(str.size());
+  std::copy(str.begin(), str.end(), message.get());
+  auto document = std::make_unique<rapidjson::Document>();
+  document->Parse(message.get(), str.size());
+  on_request->pushBack({RequestId(), std::string(method), std::move(message),
+                        std::move(document), chrono::steady_clock::now()});
+}
+
 static void reply(const RequestId &id, const char *key,
                   const std::function<void(JsonWriter &)> &fn) {
   rapidjson::StringBuffer output;
@@ -872,10 +1263,13 @@ static void reply(const RequestId &id, const char *key,
   }
   w.Key(key);
   JsonWriter writer(&w);
+  auto start = chrono::steady_clock::now();
   fn(writer);
   w.EndObject();
-  if (id.valid())
+  if (id.valid()) {
     LOG_V(2) << "respond to RequestMessage: " << id.value;
+    metrics::replied(id, chrono::steady_clock::now() - start, output.GetSize());
+  }
   for_stdout->pushBack(output.GetString());
 }
 
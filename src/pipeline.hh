@@ -10,6 +10,7 @@
 #include <atomic>
 #include <mutex>
 #include <string>
+#include <string_view>
 #include <unordered_map>
 #include <vector>
 
@@ -28,9 +29,11 @@ struct VFS {
   std::unordered_map<std::string, State> state;
   std::mutex mutex;
 
+  virtual ~VFS() = default;
   void clear();
   int loaded(const std::string &path);
-  bool stamp(const std::string &path, int64_t ts, int step);
+  // Overridden in index workers, which forward the query to the ccls process.
+  virtual bool stamp(const std::string &path, int64_t ts, int step);
 };
 
 enum class IndexMode {
@@ -42,6 +45,15 @@ enum class IndexMode {
 
 struct IndexStats {
   std::atomic<int64_t> last_idle, completed, enqueued;
+  // IndexUpdates merged into a queued update of the same file.
+  std::atomic<int64_t> coalesced;
+  // Estimated milliseconds of the requests which have not completed.
+  std::atomic<int64_t> pending_cost;
+  // Estimated milliseconds of the requests completed since the last idle time,
+  // and of those among them which were parsed rather than loaded from cache.
+  std::atomic<int64_t> completed_cost, parsed_cost;
+  // Indexer threads allowed to parse, limited by index.memoryBudget.
+  std::atomic<int64_t> concurrency;
 };
 
 namespace pipeline {
@@ -52,13 +64,22 @@ extern int64_t tick;
 
 void threadEnter();
 void threadLeave();
+// Wake the main thread so that it re-evaluates its wait deadline.
+void wakeMain();
 void init();
 void launchStdin();
+// Parse a message from the client and queue it for the main thread. |method|
+// is empty for responses. Returns false if it is not JSON-RPC 2.0.
+bool pushMessage(std::string_view str, std::string &method);
 void launchStdout();
+// Must be called before indexer threads are started.
+void setIndexers(int n);
 void indexer_Main(SemaManager *manager, VFS *vfs, Project *project,
-                  WorkingFiles *wfiles);
+                  WorkingFiles *wfiles, int idx);
 void mainLoop();
-void standalone(const std::string &root);
+// Index the project at |root| and exit. If |db| is not null, index updates
+// are applied to it as in the language server.
+void standalone(const std::string &root, DB *db = nullptr);
 
 void index(const std::string &path, const std::vector<const char *> &args,
            IndexMode mode, bool must_exist, RequestId id = {});
@@ -74,6 +95,10 @@ template <typename T> void request(const char *method, T &result) {
   notifyOrRequest(method, true, [&](JsonWriter &w) { reflect(w, result); });
 }
 
+// Queue a notification for the main thread as if it were sent by the client.
+void pushNotification(const char *method,
+                      const std::function<void(JsonWriter &)> &fn);
+
 void reply(const RequestId &id, const std::function<void(JsonWriter &)> &fn);
 
 void replyError(const RequestId &id,
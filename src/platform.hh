@@ -14,6 +14,19 @@ std::string normalizePath(llvm::StringRef path);
 // Free any unused memory and return it to the system.
 void freeUnusedMemory();
 
+// Resident set size in bytes, or 0 if unknown.
+size_t getResidentSetSize();
+
+// Reset the peak resident set size of the process to the current one. Returns
+// false if not supported.
+bool resetPeakResidentSetSize();
+// Peak resident set size in bytes since the last reset, or 0 if unknown.
+size_t getPeakResidentSetSize();
+
+// Take an exclusive advisory lock on |fd| without blocking. Returns false if
+// another process holds it. The lock is released when |fd| is closed.
+bool tryLockFile(int fd);
+
 // Stop self and wait for SIGCONT.
 void traceMe();
 
@@ -18,6 +18,7 @@
 #include <fcntl.h>
 #include <pthread.h>
 #include <signal.h>
+#include <sys/file.h>
 #include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/types.h> // required for stat.h
@@ -52,6 +53,59 @@ void freeUnusedMemory() {
 #endif
 }
 
+size_t getResidentSetSize() {
+#ifdef __linux__
+  FILE *f = fopen("/proc/self/statm", "r");
+  if (!f)
+    return 0;
+  unsigned long size, resident;
+  int n = fscanf(f, "%lu%lu", &size, &resident);
+  fclose(f);
+  return n == 2 ? size_t(resident) * sysconf(_SC_PAGESIZE) : 0;
+#else
+  // Peak rather than current, which is good enough for recycling workers.
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage))
+    return 0;
+#ifdef __APPLE__
+  return usage.ru_maxrss;
+#else
+  return size_t(usage.ru_maxrss) * 1024;
+#endif
+#endif
+}
+
+bool tryLockFile(int fd) { return flock(fd, LOCK_EX | LOCK_NB) == 0; }
+
+bool resetPeakResidentSetSize() {
+#ifdef __linux__
+  FILE *f = fopen("/proc/self/clear_refs", "w");
+  if (!f)
+    return false;
+  bool ok = fputs("5", f) >= 0;
+  return fclose(f) == 0 && ok;
+#else
+  return false;
+#endif
+}
+
+size_t getPeakResidentSetSize() {
+#ifdef __linux__
+  FILE *f = fopen("/proc/self/status", "r");
+  if (!f)
+    return 0;
+  char line[256];
+  size_t kb = 0;
+  while (fgets(line, sizeof line, f))
+    if (sscanf(line, "VmHWM: %zu kB", &kb) == 1)
+      break;
+  fclose(f);
+  return kb * 1024;
+#else
+  return 0;
+#endif
+}
+
 void traceMe() {
   // If the environment variable is defined, wait for a debugger.
   // In gdb, you need to invoke `signal SIGCONT` if you want ccls to continue
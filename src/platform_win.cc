@@ -8,6 +8,7 @@
 #include "utils.hh"
 
 #include <Windows.h>
+#include <Psapi.h>
 #include <direct.h>
 #include <fcntl.h>
 #include <io.h>
@@ -38,6 +39,24 @@ std::string normalizePath(llvm::StringRef path) {
 
 void freeUnusedMemory() {}
 
+size_t getResidentSetSize() {
+  PROCESS_MEMORY_COUNTERS pmc;
+  if (!K32GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc)))
+    return 0;
+  return pmc.WorkingSetSize;
+}
+
+bool tryLockFile(int fd) {
+  OVERLAPPED overlapped = {};
+  return LockFileEx((HANDLE)_get_osfhandle(fd),
+                    LOCKFILE_EXCLUSIVE_LOCK | LOCKFILE_FAIL_IMMEDIATELY, 0,
+                    MAXDWORD, MAXDWORD, &overlapped);
+}
+
+bool resetPeakResidentSetSize() { return false; }
+
+size_t getPeakResidentSetSize() { return 0; }
+
 // TODO Wait for debugger to attach
 void traceMe() {}
 
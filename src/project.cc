@@ -6,6 +6,7 @@
 
 #include "clang_tu.hh" // llvm::vfs
 #include "filesystem.hh"
+#include "index_cost.hh"
 #include "log.hh"
 #include "pipeline.hh"
 #include "platform.hh"
@@ -604,20 +605,17 @@ void Project::index(WorkingFiles *wfiles, const RequestId &id) {
     extra_args.push_back(intern(arg));
   {
     std::lock_guard lock(mtx);
+    // Start the translation units which took the longest last time first, so
+    // that they do not dominate the tail of the crawl. Ties (e.g. on the first
+    // crawl) keep the order of compile_commands.json.
+    std::vector<std::pair<int64_t, const Project::Entry *>> jobs;
     for (auto &[root, folder] : root2folder) {
       int i = 0;
       for (const Project::Entry &entry : folder.entries) {
         std::string reason;
         if (match.matches(entry.filename, &reason) &&
             match_i.matches(entry.filename, &reason)) {
-          bool interactive = wfiles->getFile(entry.filename) != nullptr;
-          args = entry.args;
-          args.insert(args.end(), extra_args.begin(), extra_args.end());
-          args.push_back(intern("-working-directory=" + entry.directory));
-          pipeline::index(entry.filename, args,
-                          interactive ? IndexMode::Normal
-                                      : IndexMode::Background,
-                          false, id);
+          jobs.emplace_back(index_cost::estimate(entry.filename), &entry);
         } else {
           LOG_V(1) << "[" << i << "/" << folder.entries.size()
                    << "]: " << reason << "; skip " << entry.filename;
@@ -625,6 +623,18 @@ void Project::index(WorkingFiles *wfiles, const RequestId &id) {
         i++;
       }
     }
+    std::stable_sort(jobs.begin(), jobs.end(), [](auto &l, auto &r) {
+      return l.first > r.first;
+    });
+    for (auto &[_, entry] : jobs) {
+      bool interactive = wfiles->getFile(entry->filename) != nullptr;
+      args = entry->args;
+      args.insert(args.end(), extra_args.begin(), extra_args.end());
+      args.push_back(intern("-working-directory=" + entry->directory));
+      pipeline::index(entry->filename, args,
+                      interactive ? IndexMode::Normal : IndexMode::Background,
+                      false, id);
+    }
   }
 
   pipeline::loaded_ts = pipeline::tick;
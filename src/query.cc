@@ -11,13 +11,20 @@
 #include <rapidjson/document.h>
 
 #include <llvm/ADT/STLExtras.h>
+#include <llvm/ADT/Twine.h>
+#include <llvm/Support/Threading.h>
 
 #include <assert.h>
+#include <atomic>
+#include <condition_variable>
 #include <functional>
+#include <iterator>
 #include <limits.h>
+#include <mutex>
 #include <optional>
 #include <stdint.h>
 #include <string>
+#include <thread>
 #include <unordered_map>
 #include <unordered_set>
 
@@ -46,6 +53,16 @@ void removeRange(std::vector<T> &from, const std::vector<T> &to_remove) {
   }
 }
 
+template <typename T>
+void addRange(FileSegments<T> &into, const std::vector<T> &from) {
+  into.add(from);
+}
+
+template <typename T>
+void removeRange(FileSegments<T> &from, const std::vector<T> &to_remove) {
+  from.remove(to_remove);
+}
+
 QueryFile::DefUpdate buildFileDefUpdate(IndexFile &&indexed) {
   QueryFile::Def def;
   def.path = std::move(indexed.path);
@@ -120,6 +137,7 @@ QueryType::Def convert(const IndexType::Def &o) {
 IndexUpdate IndexUpdate::createDelta(IndexFile *previous, IndexFile *current) {
   IndexUpdate r;
   static IndexFile empty(current->path, "<empty>", false);
+  r.has_prev = previous;
   if (previous)
     r.prev_lid2path = std::move(previous->lid2path);
   else
@@ -184,6 +202,78 @@ IndexUpdate IndexUpdate::createDelta(IndexFile *previous, IndexFile *current) {
   return r;
 }
 
+void IndexUpdate::merge(IndexUpdate &&next) {
+  // The intermediate state is added by this update and removed by |next|.
+  auto mergeUpdate = [](auto &into, auto &from) {
+    for (auto &[usr, p] : into)
+      p.second.clear();
+    for (auto &[usr, p] : from)
+      into[usr].second = std::move(p.second);
+    for (auto it = into.begin(); it != into.end();)
+      if (it->second.first.empty() && it->second.second.empty())
+        it = into.erase(it);
+      else
+        ++it;
+  };
+
+  lid2path = std::move(next.lid2path);
+  files_def_update = std::move(next.files_def_update);
+
+  funcs_hint += next.funcs_hint;
+  funcs_def_update = std::move(next.funcs_def_update);
+  mergeUpdate(funcs_declarations, next.funcs_declarations);
+  mergeUpdate(funcs_uses, next.funcs_uses);
+  mergeUpdate(funcs_derived, next.funcs_derived);
+
+  types_hint += next.types_hint;
+  types_def_update = std::move(next.types_def_update);
+  mergeUpdate(types_declarations, next.types_declarations);
+  mergeUpdate(types_uses, next.types_uses);
+  mergeUpdate(types_derived, next.types_derived);
+  mergeUpdate(types_instances, next.types_instances);
+
+  vars_hint += next.vars_hint;
+  vars_def_update = std::move(next.vars_def_update);
+  mergeUpdate(vars_declarations, next.vars_declarations);
+  mergeUpdate(vars_uses, next.vars_uses);
+}
+
+int NameIndex::charClass(char c) {
+  if (c >= 'a' && c <= 'z')
+    return c - 'a';
+  if (c >= 'A' && c <= 'Z')
+    return c - 'A';
+  if (c >= '0' && c <= '9')
+    return 26 + (c - '0');
+  return 36 + (unsigned char)c % (kClasses - 36);
+}
+
+void NameIndex::clear() {
+  for (auto &b : bits)
+    b.clear();
+  size_ = 0;
+}
+
+void NameIndex::resize(size_t n) {
+  if (n <= size_)
+    return;
+  size_ = n;
+  for (auto &b : bits)
+    b.resize((n + 63) / 64);
+}
+
+void NameIndex::set(size_t i, std::string_view name) {
+  uint64_t classes = 0;
+  for (char c : name)
+    classes |= uint64_t(1) << charClass(c);
+  uint64_t bit = uint64_t(1) << i % 64;
+  for (int c = 0; c < kClasses; c++)
+    if (classes >> c & 1)
+      bits[c][i / 64] |= bit;
+    else
+      bits[c][i / 64] &= ~bit;
+}
+
 void DB::clear() {
   files.clear();
   name2file_id.clear();
@@ -193,215 +283,474 @@ void DB::clear() {
   funcs.clear();
   types.clear();
   vars.clear();
+  func_names.clear();
+  type_names.clear();
+  var_names.clear();
 }
 
-template <typename Def>
-void DB::removeUsrs(Kind kind, int file_id,
-                    const std::vector<std::pair<Usr, Def>> &to_remove) {
-  switch (kind) {
-  case Kind::Func: {
-    for (auto &[usr, _] : to_remove) {
-      // FIXME
-      if (!hasFunc(usr))
-        continue;
-      QueryFunc &func = getFunc(usr);
-      auto it = llvm::find_if(func.def, [=](const QueryFunc::Def &def) {
-        return def.file_id == file_id;
-      });
-      if (it != func.def.end())
-        func.def.erase(it);
+namespace {
+// Entities are partitioned by USR and files by file_id. The number of shards
+// does not depend on the number of threads so that the result is the same on
+// every machine.
+constexpr int kApplyShards = 16;
+// Batches with fewer symbols are applied on the calling thread.
+constexpr size_t kMinParallelSymbols = 4096;
+
+// A pool of persistent threads running DB::applyIndexUpdates shards. The
+// calling thread participates and run() returns when all shards are done.
+class ApplyPool {
+  std::mutex mutex;
+  std::condition_variable cv, done_cv;
+  const std::function<void(int)> *job = nullptr;
+  int n_jobs = 0;
+  std::atomic<int> next{0};
+  int active = 0, n_threads = 0;
+  uint64_t generation = 0;
+
+  void work(const std::function<void(int)> &fn, int n) {
+    for (int i; (i = next.fetch_add(1, std::memory_order_relaxed)) < n;)
+      fn(i);
+  }
+
+  void worker() {
+    llvm::set_thread_name("apply");
+    uint64_t seen = 0;
+    std::unique_lock lock(mutex);
+    for (;;) {
+      cv.wait(lock, [&]() { return generation != seen; });
+      seen = generation;
+      const std::function<void(int)> *fn = job;
+      int n = n_jobs;
+      lock.unlock();
+      work(*fn, n);
+      lock.lock();
+      if (--active == 0)
+        done_cv.notify_one();
     }
-    break;
   }
-  case Kind::Type: {
-    for (auto &[usr, _] : to_remove) {
-      // FIXME
-      if (!hasType(usr))
-        continue;
-      QueryType &type = getType(usr);
-      auto it = llvm::find_if(type.def, [=](const QueryType::Def &def) {
-        return def.file_id == file_id;
-      });
-      if (it != type.def.end())
-        type.def.erase(it);
+
+public:
+  void run(int n, const std::function<void(int)> &fn) {
+    if (!n_threads) {
+      n_threads = std::max(
+          1, std::min<int>(std::thread::hardware_concurrency(), n) - 1);
+      for (int i = 0; i < n_threads; i++)
+        std::thread([this]() { worker(); }).detach();
     }
-    break;
+    {
+      std::lock_guard lock(mutex);
+      job = &fn;
+      n_jobs = n;
+      next = 0;
+      active = n_threads;
+      generation++;
+    }
+    cv.notify_all();
+    work(fn, n);
+    std::unique_lock lock(mutex);
+    done_cv.wait(lock, [&]() { return active == 0; });
+  }
+};
+
+struct RefDelta {
+  int file_id;
+  ExtentRef sym;
+  int delta;
+};
+
+// A change of QueryFile::call2caller, from FuncDef::callees of |caller|.
+struct CallerDelta {
+  int file_id;
+  Range range;
+  Usr caller;
+  int delta;
+};
+
+// Make ranges of implicit function calls larger (spanning one more column to
+// the left/right). This is hacky but useful. e.g. textDocument/definition on
+// the space/semicolon in `A a;` or ` 42;` will take you to the constructor.
+void widenImplicit(Range &range) {
+  if (range.start.column > 0)
+    range.start.column--;
+  range.end.column++;
+}
+
+// The range of |callee| in QueryFunc::uses.
+Range callRange(const SymbolRef &callee) {
+  Range range = callee.range;
+  if (callee.role & Role::Implicit)
+    widenImplicit(range);
+  return range;
+}
+
+// Counts are kept per (range, caller), so deltas of a call moved to another
+// function commute and may be applied in any order.
+void applyCallerDelta(QueryFile &file, const CallerDelta &d) {
+  auto &callers = file.call2caller[d.range];
+  auto it =
+      llvm::find_if(callers, [&](auto &c) { return c.first == d.caller; });
+  if (it == callers.end())
+    it = &callers.emplace_back(d.caller, 0);
+  it->second += d.delta;
+  if (!it->second)
+    callers.erase(it);
+  if (callers.empty())
+    file.call2caller.erase(d.range);
+}
+
+// An entity whose defs have changed, so its name may have.
+struct Renamed {
+  Kind kind;
+  int idx;
+};
+
+template <typename Q>
+void setName(NameIndex &names, llvm::SmallVector<Q, 0> &entities, int idx) {
+  const auto *def = entities[idx].anyDef();
+  names.set(idx, def ? def->name(true) : std::string_view());
+}
+
+struct ApplyContext {
+  IndexUpdate *u;
+  Lid2file_id prev_lid2file_id, lid2file_id;
+};
+
+using UsrMap = llvm::DenseMap<Usr, int, DenseMapInfoForUsr>;
+
+template <typename Q>
+void ensureEntity(UsrMap &entity_usr, llvm::SmallVector<Q, 0> &entities,
+                  Usr usr) {
+  auto r = entity_usr.try_emplace(usr, entity_usr.size());
+  if (r.second) {
+    entities.emplace_back();
+    entities.back().usr = usr;
+  }
+}
+
+// Applies the entities owned by one USR shard. Reference count changes of
+// QueryFile::symbol2refcnt are recorded in |deltas|, bucketed by file shard.
+struct ShardApplier {
+  int shard;
+  std::vector<RefDelta> (&deltas)[kApplyShards];
+  std::vector<CallerDelta> (&caller_deltas)[kApplyShards];
+  std::vector<Renamed> &renamed;
+  ApplyContext *ctx = nullptr;
+
+  bool owns(Usr usr) const { return usr % kApplyShards == Usr(shard); }
+
+  void emit(int file_id, const ExtentRef &sym, int delta) {
+    deltas[file_id % kApplyShards].push_back({file_id, sym, delta});
+  }
+  // References (Use &use) in this struct are important to update file_id.
+  void ref(const Lid2file_id &lid2fid, Usr usr, Kind kind, Use &use,
+           int delta) {
+    assignFileId(lid2fid, ctx->u->file_id, use);
+    emit(use.file_id, {{use.range, usr, kind, use.role}}, delta);
   }
-  case Kind::Var: {
-    for (auto &[usr, _] : to_remove) {
+  void refDecl(const Lid2file_id &lid2fid, Usr usr, Kind kind, DeclRef &dr,
+               int delta) {
+    assignFileId(lid2fid, ctx->u->file_id, dr);
+    emit(dr.file_id, {{dr.range, usr, kind, dr.role}, dr.extent}, delta);
+  }
+  void callees(Usr usr, const QueryFunc::Def &def, int delta) {
+    int file_id = ctx->u->file_id;
+    for (const SymbolRef &callee : def.callees)
+      caller_deltas[file_id % kApplyShards].push_back(
+          {file_id, callRange(callee), usr, delta});
+  }
+
+  template <typename Q>
+  void applyDefs(Kind kind, UsrMap &entity_usr,
+                 llvm::SmallVector<Q, 0> &entities,
+                 std::vector<std::pair<Usr, typename Q::Def>> &removed,
+                 std::vector<std::pair<Usr, typename Q::Def>> &def_update,
+                 Update<DeclRef> &declarations) {
+    int file_id = ctx->u->file_id;
+    for (auto &[usr, def] : removed) {
+      if (!owns(usr))
+        continue;
+      if (def.spell)
+        refDecl(ctx->prev_lid2file_id, usr, kind, *def.spell, -1);
+      if constexpr (std::is_same_v<Q, QueryFunc>)
+        callees(usr, def, -1);
+    }
+    for (auto &[usr, _] : removed) {
+      if (!owns(usr))
+        continue;
       // FIXME
-      if (!hasVar(usr))
+      auto it = entity_usr.find(usr);
+      if (it == entity_usr.end())
         continue;
-      QueryVar &var = getVar(usr);
-      auto it = llvm::find_if(var.def, [=](const QueryVar::Def &def) {
+      renamed.push_back({kind, it->second});
+      auto &defs = entities[it->second].def;
+      auto it1 = llvm::find_if(defs, [=](const typename Q::Def &def) {
         return def.file_id == file_id;
       });
-      if (it != var.def.end())
-        var.def.erase(it);
+      if (it1 != defs.end())
+        defs.erase(it1);
+    }
+    for (auto &[usr, def] : def_update) {
+      if (!owns(usr))
+        continue;
+      assert(def.detailed_name[0]);
+      def.file_id = file_id;
+      if (def.spell)
+        refDecl(ctx->lid2file_id, usr, kind, *def.spell, 1);
+      if constexpr (std::is_same_v<Q, QueryFunc>)
+        callees(usr, def, 1);
+      int idx = entity_usr.find(usr)->second;
+      renamed.push_back({kind, idx});
+      Q &existing = entities[idx];
+      if (!tryReplaceDef(existing.def, std::move(def)))
+        existing.def.push_back(std::move(def));
+    }
+    for (auto &[usr, del_add] : declarations) {
+      if (!owns(usr))
+        continue;
+      for (DeclRef &dr : del_add.first)
+        refDecl(ctx->prev_lid2file_id, usr, kind, dr, -1);
+      for (DeclRef &dr : del_add.second)
+        refDecl(ctx->lid2file_id, usr, kind, dr, 1);
     }
-    break;
   }
-  default:
-    break;
+
+  template <typename Q, typename C, typename T>
+  void removeAdd(UsrMap &entity_usr, llvm::SmallVector<Q, 0> &entities,
+                 Update<T> &update, C Q::*field) {
+    for (auto &[usr, del_add] : update)
+      if (owns(usr)) {
+        Q &entity = entities[entity_usr.find(usr)->second];
+        removeRange(entity.*field, del_add.first);
+        addRange(entity.*field, del_add.second);
+      }
   }
-}
 
-void DB::applyIndexUpdate(IndexUpdate *u) {
-#define REMOVE_ADD(C, F)                                                       \
-  for (auto &it : u->C##s_##F) {                                               \
-    auto r = C##_usr.try_emplace({it.first}, C##_usr.size());                  \
-    if (r.second) {                                                            \
-      C##s.emplace_back();                                                     \
-      C##s.back().usr = it.first;                                              \
-    }                                                                          \
-    auto &entity = C##s[r.first->second];                                      \
-    removeRange(entity.F, it.second.first);                                    \
-    addRange(entity.F, it.second.second);                                      \
-  }
-
-  std::unordered_map<int, int> prev_lid2file_id, lid2file_id;
-  for (auto &[lid, path] : u->prev_lid2path)
-    prev_lid2file_id[lid] = getFileId(path);
-  for (auto &[lid, path] : u->lid2path) {
-    int file_id = getFileId(path);
-    lid2file_id[lid] = file_id;
-    if (!files[file_id].def) {
-      files[file_id].def = QueryFile::Def();
-      files[file_id].def->path = path;
+  template <typename Q>
+  void applyUses(Kind kind, UsrMap &entity_usr,
+                 llvm::SmallVector<Q, 0> &entities, Update<Use> &uses,
+                 bool hint_implicit) {
+    for (auto &[usr, p] : uses) {
+      if (!owns(usr))
+        continue;
+      Q &entity = entities[entity_usr.find(usr)->second];
+      for (Use &use : p.first) {
+        if (hint_implicit && use.role & Role::Implicit)
+          widenImplicit(use.range);
+        ref(ctx->prev_lid2file_id, usr, kind, use, -1);
+      }
+      removeRange(entity.uses, p.first);
+      for (Use &use : p.second) {
+        if (hint_implicit && use.role & Role::Implicit)
+          widenImplicit(use.range);
+        ref(ctx->lid2file_id, usr, kind, use, 1);
+      }
+      addRange(entity.uses, p.second);
     }
   }
+};
+} // namespace
 
-  // References (Use &use) in this function are important to update file_id.
-  auto ref = [&](std::unordered_map<int, int> &lid2fid, Usr usr, Kind kind,
-                 Use &use, int delta) {
-    use.file_id =
-        use.file_id == -1 ? u->file_id : lid2fid.find(use.file_id)->second;
-    ExtentRef sym{{use.range, usr, kind, use.role}};
-    int &v = files[use.file_id].symbol2refcnt[sym];
-    v += delta;
-    assert(v >= 0);
-    if (!v)
-      files[use.file_id].symbol2refcnt.erase(sym);
-  };
-  auto refDecl = [&](std::unordered_map<int, int> &lid2fid, Usr usr, Kind kind,
-                     DeclRef &dr, int delta) {
-    dr.file_id =
-        dr.file_id == -1 ? u->file_id : lid2fid.find(dr.file_id)->second;
-    ExtentRef sym{{dr.range, usr, kind, dr.role}, dr.extent};
-    int &v = files[dr.file_id].symbol2refcnt[sym];
-    v += delta;
-    assert(v >= 0);
-    if (!v)
-      files[dr.file_id].symbol2refcnt.erase(sym);
+void DB::applyIndexUpdates(llvm::ArrayRef<IndexUpdate *> updates) {
+  // Intentionally leaked: destroying the condition variables would wait for
+  // the detached workers.
+  static ApplyPool *pool = new ApplyPool;
+
+  // Phase 1 (serial): files, lid maps and entity creation. Entities are
+  // created in the same order as when updates are applied one by one, which
+  // keeps entity indices (used as semantic highlight ids) deterministic.
+  std::vector<ApplyContext> ctxs(updates.size());
+  size_t n_symbols = 0;
+  for (size_t i = 0; i < updates.size(); i++) {
+    IndexUpdate *u = ctxs[i].u = updates[i];
+    for (auto &[lid, path] : u->prev_lid2path)
+      ctxs[i].prev_lid2file_id[lid] = getFileId(path);
+    for (auto &[lid, path] : u->lid2path) {
+      int file_id = getFileId(path);
+      ctxs[i].lid2file_id[lid] = file_id;
+      if (!files[file_id].def) {
+        files[file_id].def = QueryFile::Def();
+        files[file_id].def->path = path;
+      }
+    }
+
+    if (u->files_removed) {
+      int file_id = name2file_id[lowerPathIfInsensitive(*u->files_removed)];
+      std::optional<QueryFile::Def> prev = std::move(files[file_id].def);
+      files[file_id].def = std::nullopt;
+      linkFile(file_id, prev ? &*prev : nullptr);
+    }
+    u->file_id =
+        u->files_def_update ? update(std::move(*u->files_def_update)) : -1;
+
+    const double grow = 1.3;
+    size_t t;
+    if ((t = funcs.size() + u->funcs_hint) > funcs.capacity()) {
+      t = size_t(t * grow);
+      funcs.reserve(t);
+      func_usr.reserve(t);
+    }
+    for (auto &it : u->funcs_def_update)
+      ensureEntity(func_usr, funcs, it.first);
+    for (auto &it : u->funcs_declarations)
+      ensureEntity(func_usr, funcs, it.first);
+    for (auto &it : u->funcs_derived)
+      ensureEntity(func_usr, funcs, it.first);
+    for (auto &it : u->funcs_uses)
+      ensureEntity(func_usr, funcs, it.first);
+
+    if ((t = types.size() + u->types_hint) > types.capacity()) {
+      t = size_t(t * grow);
+      types.reserve(t);
+      type_usr.reserve(t);
+    }
+    for (auto &it : u->types_def_update)
+      ensureEntity(type_usr, types, it.first);
+    for (auto &it : u->types_declarations)
+      ensureEntity(type_usr, types, it.first);
+    for (auto *m : {&u->types_derived, &u->types_instances})
+      for (auto &it : *m)
+        ensureEntity(type_usr, types, it.first);
+    for (auto &it : u->types_uses)
+      ensureEntity(type_usr, types, it.first);
+
+    if ((t = vars.size() + u->vars_hint) > vars.capacity()) {
+      t = size_t(t * grow);
+      vars.reserve(t);
+      var_usr.reserve(t);
+    }
+    for (auto &it : u->vars_def_update)
+      ensureEntity(var_usr, vars, it.first);
+    for (auto &it : u->vars_declarations)
+      ensureEntity(var_usr, vars, it.first);
+    for (auto &it : u->vars_uses)
+      ensureEntity(var_usr, vars, it.first);
+
+    n_symbols += u->funcs_uses.size() + u->types_uses.size() +
+                 u->vars_uses.size();
+  }
+
+  // Phase 2: each USR shard applies defs, declarations, derived, instances and
+  // uses of its entities, in update order. The hash maps are only read.
+  std::vector<RefDelta> deltas[kApplyShards][kApplyShards];
+  std::vector<CallerDelta> caller_deltas[kApplyShards][kApplyShards];
+  std::vector<Renamed> renamed[kApplyShards];
+  std::function<void(int)> apply_entities = [&](int shard) {
+    ShardApplier a{shard, deltas[shard], caller_deltas[shard], renamed[shard]};
+    for (ApplyContext &ctx : ctxs) {
+      IndexUpdate *u = ctx.u;
+      a.ctx = &ctx;
+      a.applyDefs(Kind::Func, func_usr, funcs, u->funcs_removed,
+                  u->funcs_def_update, u->funcs_declarations);
+      a.removeAdd(func_usr, funcs, u->funcs_declarations,
+                  &QueryFunc::declarations);
+      a.removeAdd(func_usr, funcs, u->funcs_derived, &QueryFunc::derived);
+      a.applyUses(Kind::Func, func_usr, funcs, u->funcs_uses, true);
+
+      a.applyDefs(Kind::Type, type_usr, types, u->types_removed,
+                  u->types_def_update, u->types_declarations);
+      a.removeAdd(type_usr, types, u->types_declarations,
+                  &QueryType::declarations);
+      a.removeAdd(type_usr, types, u->types_derived, &QueryType::derived);
+      a.removeAdd(type_usr, types, u->types_instances, &QueryType::instances);
+      a.applyUses(Kind::Type, type_usr, types, u->types_uses, false);
+
+      a.applyDefs(Kind::Var, var_usr, vars, u->vars_removed,
+                  u->vars_def_update, u->vars_declarations);
+      a.removeAdd(var_usr, vars, u->vars_declarations, &QueryVar::declarations);
+      a.applyUses(Kind::Var, var_usr, vars, u->vars_uses, false);
+    }
   };
 
-  auto updateUses =
-      [&](Usr usr, Kind kind,
-          llvm::DenseMap<Usr, int, DenseMapInfoForUsr> &entity_usr,
-          auto &entities, auto &p, bool hint_implicit) {
-        auto r = entity_usr.try_emplace(usr, entity_usr.size());
-        if (r.second) {
-          entities.emplace_back();
-          entities.back().usr = usr;
+  // Phase 3: each file shard applies the reference count changes. All changes
+  // of one ExtentRef come from the same USR shard in update order, and USR
+  // shards are visited in a fixed order. Changes of a call's callers may come
+  // from different USR shards but are counted per caller, so order does not
+  // matter. The ExtentRefs appearing or disappearing are then merged into the
+  // position tables of their files. Renamed entities are indexed by groups of
+  // 64, which share words of the name bitmaps.
+  std::function<void(int)> apply_refcnt = [&](int shard) {
+    for (int i = 0; i < kApplyShards; i++)
+      for (Renamed r : renamed[i])
+        if (r.idx / 64 % kApplyShards == shard) {
+          if (r.kind == Kind::Func)
+            setName(func_names, funcs, r.idx);
+          else if (r.kind == Kind::Type)
+            setName(type_names, types, r.idx);
+          else
+            setName(var_names, vars, r.idx);
         }
-        auto &entity = entities[r.first->second];
-        for (Use &use : p.first) {
-          if (hint_implicit && use.role & Role::Implicit) {
-            // Make ranges of implicit function calls larger (spanning one more
-            // column to the left/right). This is hacky but useful. e.g.
-            // textDocument/definition on the space/semicolon in `A a;` or `
-            // 42;` will take you to the constructor.
-            if (use.range.start.column > 0)
-              use.range.start.column--;
-            use.range.end.column++;
-          }
-          ref(prev_lid2file_id, usr, kind, use, -1);
-        }
-        removeRange(entity.uses, p.first);
-        for (Use &use : p.second) {
-          if (hint_implicit && use.role & Role::Implicit) {
-            if (use.range.start.column > 0)
-              use.range.start.column--;
-            use.range.end.column++;
-          }
-          ref(lid2file_id, usr, kind, use, 1);
-        }
-        addRange(entity.uses, p.second);
+    llvm::DenseMap<int, std::vector<ExtentRef>> touched;
+    for (int i = 0; i < kApplyShards; i++)
+      for (CallerDelta &d : caller_deltas[i][shard])
+        applyCallerDelta(files[d.file_id], d);
+    for (int i = 0; i < kApplyShards; i++)
+      for (RefDelta &d : deltas[i][shard]) {
+        auto &symbol2refcnt = files[d.file_id].symbol2refcnt;
+        int &v = symbol2refcnt[d.sym];
+        bool was = v > 0;
+        v += d.delta;
+        assert(v >= 0);
+        if (was != (v > 0))
+          touched[d.file_id].push_back(d.sym);
+        if (!v)
+          symbol2refcnt.erase(d.sym);
+      }
+    for (auto &[file_id, syms] : touched) {
+      QueryFile &file = files[file_id];
+      auto present = [&](const ExtentRef &sym) {
+        return file.symbol2refcnt.count(sym) > 0;
       };
+      file.occurrences.update(syms, present);
+      file.extents.update(std::move(syms), present);
+    }
+  };
+
+  auto run = [&](const std::function<void(int)> &fn) {
+    if (n_symbols < kMinParallelSymbols)
+      for (int i = 0; i < kApplyShards; i++)
+        fn(i);
+    else
+      pool->run(kApplyShards, fn);
+  };
+  run(apply_entities);
+  func_names.resize(funcs.size());
+  type_names.resize(types.size());
+  var_names.resize(vars.size());
+  run(apply_refcnt);
+}
+
+void DB::linkCallers() {
+  for (QueryFile &file : files)
+    file.call2caller.clear();
+  for (QueryFunc &func : funcs)
+    for (const QueryFunc::Def &def : func.def)
+      for (const SymbolRef &callee : def.callees)
+        applyCallerDelta(files[def.file_id],
+                         {def.file_id, callRange(callee), func.usr, 1});
+}
+
+void DB::indexNames() {
+  func_names.clear();
+  type_names.clear();
+  var_names.clear();
+  func_names.resize(funcs.size());
+  type_names.resize(types.size());
+  var_names.resize(vars.size());
+  for (size_t i = 0; i < funcs.size(); i++)
+    setName(func_names, funcs, i);
+  for (size_t i = 0; i < types.size(); i++)
+    setName(type_names, types, i);
+  for (size_t i = 0; i < vars.size(); i++)
+    setName(var_names, vars, i);
+}
 
-  if (u->files_removed)
-    files[name2file_id[lowerPathIfInsensitive(*u->files_removed)]].def =
-        std::nullopt;
-  u->file_id =
-      u->files_def_update ? update(std::move(*u->files_def_update)) : -1;
-
-  const double grow = 1.3;
-  size_t t;
-
-  if ((t = funcs.size() + u->funcs_hint) > funcs.capacity()) {
-    t = size_t(t * grow);
-    funcs.reserve(t);
-    func_usr.reserve(t);
-  }
-  for (auto &[usr, def] : u->funcs_removed)
-    if (def.spell)
-      refDecl(prev_lid2file_id, usr, Kind::Func, *def.spell, -1);
-  removeUsrs(Kind::Func, u->file_id, u->funcs_removed);
-  update(lid2file_id, u->file_id, std::move(u->funcs_def_update));
-  for (auto &[usr, del_add] : u->funcs_declarations) {
-    for (DeclRef &dr : del_add.first)
-      refDecl(prev_lid2file_id, usr, Kind::Func, dr, -1);
-    for (DeclRef &dr : del_add.second)
-      refDecl(lid2file_id, usr, Kind::Func, dr, 1);
-  }
-  REMOVE_ADD(func, declarations);
-  REMOVE_ADD(func, derived);
-  for (auto &[usr, p] : u->funcs_uses)
-    updateUses(usr, Kind::Func, func_usr, funcs, p, true);
-
-  if ((t = types.size() + u->types_hint) > types.capacity()) {
-    t = size_t(t * grow);
-    types.reserve(t);
-    type_usr.reserve(t);
-  }
-  for (auto &[usr, def] : u->types_removed)
-    if (def.spell)
-      refDecl(prev_lid2file_id, usr, Kind::Type, *def.spell, -1);
-  removeUsrs(Kind::Type, u->file_id, u->types_removed);
-  update(lid2file_id, u->file_id, std::move(u->types_def_update));
-  for (auto &[usr, del_add] : u->types_declarations) {
-    for (DeclRef &dr : del_add.first)
-      refDecl(prev_lid2file_id, usr, Kind::Type, dr, -1);
-    for (DeclRef &dr : del_add.second)
-      refDecl(lid2file_id, usr, Kind::Type, dr, 1);
-  }
-  REMOVE_ADD(type, declarations);
-  REMOVE_ADD(type, derived);
-  REMOVE_ADD(type, instances);
-  for (auto &[usr, p] : u->types_uses)
-    updateUses(usr, Kind::Type, type_usr, types, p, false);
-
-  if ((t = vars.size() + u->vars_hint) > vars.capacity()) {
-    t = size_t(t * grow);
-    vars.reserve(t);
-    var_usr.reserve(t);
-  }
-  for (auto &[usr, def] : u->vars_removed)
-    if (def.spell)
-      refDecl(prev_lid2file_id, usr, Kind::Var, *def.spell, -1);
-  removeUsrs(Kind::Var, u->file_id, u->vars_removed);
-  update(lid2file_id, u->file_id, std::move(u->vars_def_update));
-  for (auto &[usr, del_add] : u->vars_declarations) {
-    for (DeclRef &dr : del_add.first)
-      refDecl(prev_lid2file_id, usr, Kind::Var, dr, -1);
-    for (DeclRef &dr : del_add.second)
-      refDecl(lid2file_id, usr, Kind::Var, dr, 1);
-  }
-  REMOVE_ADD(var, declarations);
-  for (auto &[usr, p] : u->vars_uses)
-    updateUses(usr, Kind::Var, var_usr, vars, p, false);
-
-#undef REMOVE_ADD
+QueryFunc *DB::getCaller(const Use &use) {
+  auto &call2caller = files[use.file_id].call2caller;
+  auto it = call2caller.find(use.range);
+  if (it == call2caller.end())
+    return nullptr;
+  auto it1 = func_usr.find(it->second[0].first);
+  return it1 == func_usr.end() ? nullptr : &funcs[it1->second];
 }
 
 int DB::getFileId(const std::string &path) {
@@ -415,75 +764,93 @@ int DB::getFileId(const std::string &path) {
 
 int DB::update(QueryFile::DefUpdate &&u) {
   int file_id = getFileId(u.first.path);
+  std::optional<QueryFile::Def> prev = std::move(files[file_id].def);
   files[file_id].def = u.first;
+  linkFile(file_id, prev ? &*prev : nullptr);
   return file_id;
 }
 
-void DB::update(const Lid2file_id &lid2file_id, int file_id,
-                std::vector<std::pair<Usr, QueryFunc::Def>> &&us) {
-  for (auto &u : us) {
-    auto &def = u.second;
-    assert(def.detailed_name[0]);
-    u.second.file_id = file_id;
-    if (def.spell) {
-      assignFileId(lid2file_id, file_id, *def.spell);
-      files[def.spell->file_id].symbol2refcnt[{
-          {def.spell->range, u.first, Kind::Func, def.spell->role},
-          def.spell->extent}]++;
+void DB::linkFile(int file_id, const QueryFile::Def *prev) {
+  // Paths are interned. Collect them first as getFileId may grow |files|.
+  std::vector<const char *> paths[2][2];
+  auto collect = [&](const QueryFile::Def *def, std::vector<const char *> *v) {
+    if (!def)
+      return;
+    for (const IndexInclude &include : def->includes)
+      v[0].push_back(include.resolved_path);
+    v[1] = def->dependencies;
+  };
+  collect(prev, paths[0]);
+  collect(files[file_id].def ? &*files[file_id].def : nullptr, paths[1]);
+  std::vector<int> ids[2][2];
+  for (int i = 0; i < 2; i++)
+    for (int j = 0; j < 2; j++) {
+      std::vector<int> &v = ids[i][j];
+      for (const char *path : paths[i][j])
+        v.push_back(getFileId(path));
+      llvm::sort(v);
+      v.erase(std::unique(v.begin(), v.end()), v.end());
     }
 
-    auto r = func_usr.try_emplace({u.first}, func_usr.size());
-    if (r.second)
-      funcs.emplace_back();
-    QueryFunc &existing = funcs[r.first->second];
-    existing.usr = u.first;
-    if (!tryReplaceDef(existing.def, std::move(def)))
-      existing.def.push_back(std::move(def));
-  }
-}
-
-void DB::update(const Lid2file_id &lid2file_id, int file_id,
-                std::vector<std::pair<Usr, QueryType::Def>> &&us) {
-  for (auto &u : us) {
-    auto &def = u.second;
-    assert(def.detailed_name[0]);
-    u.second.file_id = file_id;
-    if (def.spell) {
-      assignFileId(lid2file_id, file_id, *def.spell);
-      files[def.spell->file_id].symbol2refcnt[{
-          {def.spell->range, u.first, Kind::Type, def.spell->role},
-          def.spell->extent}]++;
+  auto link = [&](const std::vector<int> &prev, const std::vector<int> &cur,
+                  std::vector<int> QueryFile::*edges) {
+    std::vector<int> diff;
+    std::set_difference(prev.begin(), prev.end(), cur.begin(), cur.end(),
+                        std::back_inserter(diff));
+    for (int id : diff) {
+      std::vector<int> &v = files[id].*edges;
+      auto it = std::lower_bound(v.begin(), v.end(), file_id);
+      if (it != v.end() && *it == file_id)
+        v.erase(it);
     }
-    auto r = type_usr.try_emplace({u.first}, type_usr.size());
-    if (r.second)
-      types.emplace_back();
-    QueryType &existing = types[r.first->second];
-    existing.usr = u.first;
-    if (!tryReplaceDef(existing.def, std::move(def)))
-      existing.def.push_back(std::move(def));
-  }
-}
-
-void DB::update(const Lid2file_id &lid2file_id, int file_id,
-                std::vector<std::pair<Usr, QueryVar::Def>> &&us) {
-  for (auto &u : us) {
-    auto &def = u.second;
-    assert(def.detailed_name[0]);
-    u.second.file_id = file_id;
-    if (def.spell) {
-      assignFileId(lid2file_id, file_id, *def.spell);
-      files[def.spell->file_id].symbol2refcnt[{
-          {def.spell->range, u.first, Kind::Var, def.spell->role},
-          def.spell->extent}]++;
+    diff.clear();
+    std::set_difference(cur.begin(), cur.end(), prev.begin(), prev.end(),
+                        std::back_inserter(diff));
+    for (int id : diff) {
+      std::vector<int> &v = files[id].*edges;
+      auto it = std::lower_bound(v.begin(), v.end(), file_id);
+      if (it == v.end() || *it != file_id)
+        v.insert(it, file_id);
     }
-    auto r = var_usr.try_emplace({u.first}, var_usr.size());
-    if (r.second)
-      vars.emplace_back();
-    QueryVar &existing = vars[r.first->second];
-    existing.usr = u.first;
-    if (!tryReplaceDef(existing.def, std::move(def)))
-      existing.def.push_back(std::move(def));
+  };
+  link(ids[0][0], ids[1][0], &QueryFile::includers);
+  link(ids[0][1], ids[1][1], &QueryFile::dependents);
+}
+
+std::vector<int> DB::getIncluders(int file_id, bool transitive) {
+  if (!transitive)
+    return files[file_id].includers;
+  // Breadth-first search, so that nearer files come first.
+  std::vector<int> ret;
+  std::unordered_set<int> seen{file_id};
+  for (size_t i = 0;; i++) {
+    for (int id : files[file_id].includers)
+      if (seen.insert(id).second)
+        ret.push_back(id);
+    if (i >= ret.size())
+      break;
+    file_id = ret[i];
   }
+  return ret;
+}
+
+std::vector<int> DB::getDependents(int file_id) {
+  const std::vector<int> &dependents = files[file_id].dependents;
+  if (dependents.empty())
+    return {};
+  std::unordered_map<int, int> order;
+  std::vector<int> includers = getIncluders(file_id, true);
+  for (size_t i = 0; i < includers.size(); i++)
+    order[includers[i]] = i;
+  // Dependents not reached by includes (e.g. the includer has not been
+  // indexed yet) come last.
+  std::vector<int> ret = dependents;
+  std::stable_sort(ret.begin(), ret.end(), [&](int l, int r) {
+    auto il = order.find(l), ir = order.find(r);
+    return (il == order.end() ? INT_MAX : il->second) <
+           (ir == order.end() ? INT_MAX : ir->second);
+  });
+  return ret;
 }
 
 std::string_view DB::getSymbolName(SymbolIdx sym, bool qualified) {
@@ -553,7 +920,7 @@ getDeclarations(llvm::DenseMap<Usr, int, DenseMapInfoForUsr> &entity_usr,
         break;
       }
     if (!has_def && entity.declarations.size())
-      ret.push_back(entity.declarations[0]);
+      ret.push_back(entity.declarations.front());
   }
   return ret;
 }
@@ -599,13 +966,13 @@ std::vector<DeclRef> getVarDeclarations(DB *db, const std::vector<Usr> &usrs,
         break;
       }
     if (!has_def && var.declarations.size())
-      ret.push_back(var.declarations[0]);
+      ret.push_back(var.declarations.front());
   }
   return ret;
 }
 
-std::vector<DeclRef> &getNonDefDeclarations(DB *db, SymbolIdx sym) {
-  static std::vector<DeclRef> empty;
+FileSegments<DeclRef> &getNonDefDeclarations(DB *db, SymbolIdx sym) {
+  static FileSegments<DeclRef> empty;
   switch (sym.kind) {
   case Kind::Func:
     return db->getFunc(sym).declarations;
@@ -799,9 +1166,11 @@ std::vector<SymbolRef> findSymbolsAtLocation(WorkingFile *wfile,
     }
   }
 
-  for (auto [sym, refcnt] : file->symbol2refcnt)
-    if (refcnt > 0 && sym.range.contains(ls_pos.line, ls_pos.character))
-      symbols.push_back(sym);
+  if (ls_pos.line >= 0 && ls_pos.line <= UINT16_MAX)
+    file->occurrences.forEachContaining(
+        Pos{(uint16_t)ls_pos.line,
+            (int16_t)std::min<int>(ls_pos.character, INT16_MAX)},
+        [&](const ExtentRef &sym) { symbols.push_back(sym); });
 
   // Order shorter ranges first, since they are more detailed/precise. This is
   // important for macros which generate code so that we can resolving the
@@ -8,9 +8,14 @@
 #include "serializer.hh"
 #include "working_files.hh"
 
+#include <llvm/ADT/ArrayRef.h>
 #include <llvm/ADT/DenseMap.h>
 #include <llvm/ADT/SmallVector.h>
 #include <llvm/ADT/StringMap.h>
+#include <llvm/Support/MathExtras.h>
+
+#include <algorithm>
+#include <unordered_set>
 
 namespace llvm {
 template <> struct DenseMapInfo<ccls::ExtentRef> {
@@ -23,9 +28,163 @@ template <> struct DenseMapInfo<ccls::ExtentRef> {
   }
   static bool isEqual(ccls::ExtentRef l, ccls::ExtentRef r) { return l == r; }
 };
+template <> struct DenseMapInfo<ccls::Range> {
+  static inline ccls::Range getEmptyKey() { return {}; }
+  static inline ccls::Range getTombstoneKey() { return {{0, -2}, {0, -2}}; }
+  static unsigned getHashValue(ccls::Range r) {
+    return std::hash<ccls::Range>()(r);
+  }
+  static bool isEqual(ccls::Range l, ccls::Range r) { return l == r; }
+};
 } // namespace llvm
 
 namespace ccls {
+struct RangeOf {
+  const Range &operator()(const ExtentRef &sym) const { return sym.range; }
+};
+struct ExtentOf {
+  const Range &operator()(const ExtentRef &sym) const { return sym.extent; }
+};
+
+// ExtentRefs sorted by the Range selected by Key (entries whose Range is
+// invalid are not stored), laid out as an implicit interval tree as in
+// cgranges: the entries are the nodes of a complete binary tree in in-order,
+// and max_end[i] is the maximum end of the subtree rooted at i. Queries by
+// position or by range cost O(log n + k).
+template <typename Key> class IntervalTable {
+  std::vector<ExtentRef> items;
+  std::vector<Pos> max_end;
+  int max_level = -1;
+
+  static const Range &key(const ExtentRef &sym) { return Key()(sym); }
+  static bool less(const ExtentRef &l, const ExtentRef &r) {
+    const Range &a = key(l), &b = key(r);
+    if (!(a == b))
+      return a < b;
+    return l.toTuple() < r.toTuple();
+  }
+
+  void build() {
+    const size_t n = items.size();
+    max_end.resize(n);
+    max_level = -1;
+    if (!n)
+      return;
+    size_t last_i = 0;
+    Pos last;
+    for (size_t i = 0; i < n; i += 2)
+      max_end[last_i = i] = last = key(items[i]).end;
+    int k = 1;
+    for (; size_t(1) << k <= n; k++) {
+      size_t x = size_t(1) << (k - 1), step = x << 2;
+      for (size_t i = (x << 1) - 1; i < n; i += step)
+        max_end[i] = std::max({key(items[i]).end, max_end[i - x],
+                               i + x < n ? max_end[i + x] : last});
+      last_i = last_i >> k & 1 ? last_i - x : last_i + x;
+      if (last_i < n && last < max_end[last_i])
+        last = max_end[last_i];
+    }
+    max_level = k - 1;
+  }
+
+  // Call fn on the entries with start < en (<= en if |closed|) and st < end.
+  template <typename Fn>
+  void visit(Pos st, Pos en, bool closed, Fn &fn) const {
+    struct Frame {
+      int k;
+      size_t x;
+      bool left_done;
+    } stack[2 * sizeof(size_t) * 8];
+    auto before = [&](const Range &r) {
+      return closed ? r.start <= en : r.start < en;
+    };
+    const size_t n = items.size();
+    if (max_level < 0)
+      return;
+    int t = 0;
+    stack[t++] = {max_level, (size_t(1) << max_level) - 1, false};
+    while (t) {
+      Frame z = stack[--t];
+      if (z.k <= 3) {
+        // Small subtrees are scanned linearly.
+        size_t i = z.x >> z.k << z.k,
+               i1 = std::min(i + (size_t(2) << z.k) - 1, n);
+        for (; i < i1 && before(key(items[i])); i++)
+          if (st < key(items[i]).end)
+            fn(items[i]);
+      } else if (!z.left_done) {
+        size_t y = z.x - (size_t(1) << (z.k - 1));
+        stack[t++] = {z.k, z.x, true};
+        if (y >= n || st < max_end[y])
+          stack[t++] = {z.k - 1, y, false};
+      } else if (z.x < n && before(key(items[z.x]))) {
+        if (st < key(items[z.x]).end)
+          fn(items[z.x]);
+        stack[t++] = {z.k - 1, z.x + (size_t(1) << (z.k - 1)), false};
+      }
+    }
+  }
+
+public:
+  using const_iterator = std::vector<ExtentRef>::const_iterator;
+  const_iterator begin() const { return items.begin(); }
+  const_iterator end() const { return items.end(); }
+  size_t size() const { return items.size(); }
+
+  // The first entry whose Range starts at or after |pos|.
+  const_iterator lowerBound(Pos pos) const {
+    return std::lower_bound(
+        items.begin(), items.end(), pos,
+        [](const ExtentRef &sym, Pos pos) { return key(sym).start < pos; });
+  }
+  // The first entry whose Range starts after |pos|.
+  const_iterator upperBound(Pos pos) const {
+    return std::upper_bound(
+        items.begin(), items.end(), pos,
+        [](Pos pos, const ExtentRef &sym) { return pos < key(sym).start; });
+  }
+
+  // Call fn on the entries whose Range contains |pos|, in the half-open sense
+  // of Range::contains.
+  template <typename Fn> void forEachContaining(Pos pos, Fn &&fn) const {
+    visit(pos, pos, true, fn);
+  }
+  // Call fn on the entries whose Range overlaps [st, en).
+  template <typename Fn>
+  void forEachOverlapping(Pos st, Pos en, Fn &&fn) const {
+    visit(st, en, false, fn);
+  }
+
+  void assign(std::vector<ExtentRef> syms) {
+    llvm::erase_if(syms,
+                   [](const ExtentRef &sym) { return !key(sym).valid(); });
+    std::sort(syms.begin(), syms.end(), less);
+    items = std::move(syms);
+    build();
+  }
+  // Remove the entries in |touched|, then re-insert those for which
+  // |present| returns true. O(n + k log k) for k touched entries.
+  template <typename Pred>
+  void update(std::vector<ExtentRef> touched, Pred &&present) {
+    std::sort(touched.begin(), touched.end(), less);
+    touched.erase(std::unique(touched.begin(), touched.end()), touched.end());
+    std::vector<ExtentRef> merged;
+    merged.reserve(items.size() + touched.size());
+    auto it = items.begin();
+    for (const ExtentRef &sym : touched) {
+      while (it != items.end() && less(*it, sym))
+        merged.push_back(*it++);
+      if (it != items.end() && *it == sym)
+        ++it;
+      if (key(sym).valid() && present(sym))
+        merged.push_back(sym);
+    }
+    merged.insert(merged.end(), it, items.end());
+    items = std::move(merged);
+    build();
+  }
+};
+
 struct QueryFile {
   struct Def {
     std::string path;
@@ -43,8 +202,21 @@ struct QueryFile {
 
   int id = -1;
   std::optional<Def> def;
+  // Sorted ids of the files with an #include resolved to this file, and of
+  // the translation units depending on this file. Maintained by DB::linkFile.
+  std::vector<int> includers, dependents;
   // `extent` is valid => declaration; invalid => regular reference
   llvm::DenseMap<ExtentRef, int> symbol2refcnt;
+  // The keys of symbol2refcnt ordered by range, and those with a valid extent
+  // ordered by extent, for lookups by position. Maintained by
+  // DB::applyIndexUpdates.
+  IntervalTable<RangeOf> occurrences;
+  IntervalTable<ExtentOf> extents;
+  // The functions containing each call in the file with their reference
+  // counts, keyed by the range of the call in QueryFunc::uses. Usually there is
+  // one. This is the inverse of FuncDef::callees, maintained by
+  // DB::applyIndexUpdates.
+  llvm::DenseMap<Range, llvm::SmallVector<std::pair<Usr, int>, 1>> call2caller;
 };
 
 template <typename Q, typename QDef> struct QueryEntity {
@@ -67,28 +239,131 @@ template <typename T>
 using Update =
     std::unordered_map<Usr, std::pair<std::vector<T>, std::vector<T>>>;
 
+// References of an entity, grouped into one segment per file_id. Re-indexing a
+// file only scans and replaces the segment of that file, instead of all
+// references of the entity (which may be millions for std::string). Iteration
+// visits segments in the order of file_id.
+template <typename T> class FileSegments {
+  struct Segment {
+    int file_id;
+    std::vector<T> items;
+  };
+  // Sorted by file_id. A segment is never empty.
+  std::vector<Segment> segs;
+  size_t size_ = 0;
+
+  typename std::vector<Segment>::iterator find(int file_id) {
+    return std::lower_bound(
+        segs.begin(), segs.end(), file_id,
+        [](const Segment &seg, int id) { return seg.file_id < id; });
+  }
+
+public:
+  template <typename S, typename V> class Iterator {
+    S *seg;
+    size_t i;
+
+  public:
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = T;
+    using difference_type = std::ptrdiff_t;
+    using pointer = V *;
+    using reference = V &;
+
+    Iterator(S *seg, size_t i) : seg(seg), i(i) {}
+    V &operator*() const { return seg->items[i]; }
+    V *operator->() const { return &seg->items[i]; }
+    Iterator &operator++() {
+      if (++i == seg->items.size()) {
+        ++seg;
+        i = 0;
+      }
+      return *this;
+    }
+    Iterator operator++(int) {
+      Iterator ret = *this;
+      ++*this;
+      return ret;
+    }
+    bool operator==(const Iterator &o) const {
+      return seg == o.seg && i == o.i;
+    }
+    bool operator!=(const Iterator &o) const { return !(*this == o); }
+  };
+  using iterator = Iterator<Segment, T>;
+  using const_iterator = Iterator<const Segment, const T>;
+
+  iterator begin() { return {segs.data(), 0}; }
+  iterator end() { return {segs.data() + segs.size(), 0}; }
+  const_iterator begin() const { return {segs.data(), 0}; }
+  const_iterator end() const { return {segs.data() + segs.size(), 0}; }
+  size_t size() const { return size_; }
+  bool empty() const { return !size_; }
+  const T &front() const { return segs[0].items[0]; }
+
+  void add(const std::vector<T> &from) {
+    for (size_t i = 0; i < from.size();) {
+      int file_id = from[i].file_id;
+      auto it = find(file_id);
+      if (it == segs.end() || it->file_id != file_id)
+        it = segs.insert(it, {file_id, {}});
+      size_t j = i;
+      while (j < from.size() && from[j].file_id == file_id)
+        j++;
+      it->items.insert(it->items.end(), from.begin() + i, from.begin() + j);
+      size_ += j - i;
+      i = j;
+    }
+  }
+
+  void remove(const std::vector<T> &to_remove) {
+    for (size_t i = 0; i < to_remove.size();) {
+      int file_id = to_remove[i].file_id;
+      size_t j = i;
+      while (j < to_remove.size() && to_remove[j].file_id == file_id)
+        j++;
+      auto it = find(file_id);
+      if (it != segs.end() && it->file_id == file_id) {
+        std::unordered_set<T> to_remove_set(to_remove.begin() + i,
+                                            to_remove.begin() + j);
+        auto &items = it->items;
+        size_t n = items.size();
+        items.erase(std::remove_if(items.begin(), items.end(),
+                                   [&](const T &t) {
+                                     return to_remove_set.count(t) > 0;
+                                   }),
+                    items.end());
+        size_ -= n - items.size();
+        if (items.empty())
+          segs.erase(it);
+      }
+      i = j;
+    }
+  }
+};
+
 struct QueryFunc : QueryEntity<QueryFunc, FuncDef<Vec>> {
   Usr usr;
   llvm::SmallVector<Def, 1> def;
-  std::vector<DeclRef> declarations;
+  FileSegments<DeclRef> declarations;
   std::vector<Usr> derived;
-  std::vector<Use> uses;
+  FileSegments<Use> uses;
 };
 
 struct QueryType : QueryEntity<QueryType, TypeDef<Vec>> {
   Usr usr;
   llvm::SmallVector<Def, 1> def;
-  std::vector<DeclRef> declarations;
+  FileSegments<DeclRef> declarations;
   std::vector<Usr> derived;
   std::vector<Usr> instances;
-  std::vector<Use> uses;
+  FileSegments<Use> uses;
 };
 
 struct QueryVar : QueryEntity<QueryVar, VarDef> {
   Usr usr;
   llvm::SmallVector<Def, 1> def;
-  std::vector<DeclRef> declarations;
-  std::vector<Use> uses;
+  FileSegments<DeclRef> declarations;
+  FileSegments<Use> uses;
 };
 
 struct IndexUpdate {
@@ -96,10 +371,16 @@ struct IndexUpdate {
   // no delta computation should be done just pass null for previous.
   static IndexUpdate createDelta(IndexFile *previous, IndexFile *current);
 
+  // Merge |next|, which was computed against the result of this update, so
+  // that applying the result is equivalent to applying both.
+  void merge(IndexUpdate &&next);
+
   int file_id;
 
   // Dummy one to refresh all semantic highlight.
   bool refresh = false;
+  // Whether the delta was computed against a previous IndexFile.
+  bool has_prev = false;
 
   decltype(IndexFile::lid2path) prev_lid2path;
   decltype(IndexFile::lid2path) lid2path;
@@ -142,6 +423,48 @@ struct DenseMapInfoForUsr {
 
 using Lid2file_id = std::unordered_map<int, int>;
 
+// An inverted index from characters to the entities whose qualified names
+// contain them: one bitmap over entity indices per character class. A name
+// can only match a pattern as a subsequence (or equal it) if it contains every
+// character of the pattern, so intersecting the bitmaps of the pattern narrows
+// workspace/symbol and name lookups to a few words per 64 entities.
+class NameIndex {
+  static constexpr int kClasses = 64;
+  std::vector<uint64_t> bits[kClasses];
+  size_t size_ = 0;
+
+  static unsigned lowestBit(uint64_t x) { return llvm::Log2_64(x & (~x + 1)); }
+
+public:
+  // Case-insensitive, so that the result is a superset for either case
+  // sensitivity.
+  static int charClass(char c);
+  void clear();
+  // Make room for entities [0, n). Not thread-safe.
+  void resize(size_t n);
+  // Replace the name of entity |i|. Calls for entities in different groups of
+  // 64 may run in parallel.
+  void set(size_t i, std::string_view name);
+
+  // Call fn(i) in increasing order for the entities whose names contain every
+  // character of |pat|, until fn returns true. Returns whether it did.
+  template <typename Fn> bool forEachCandidate(std::string_view pat, Fn &&fn) {
+    uint64_t classes = 0;
+    for (char c : pat)
+      classes |= uint64_t(1) << charClass(c);
+    for (size_t w = 0; w * 64 < size_; w++) {
+      uint64_t m = w * 64 + 64 <= size_ ? ~uint64_t(0)
+                                        : (uint64_t(1) << size_ % 64) - 1;
+      for (uint64_t c = classes; c && m; c &= c - 1)
+        m &= bits[lowestBit(c)][w];
+      for (; m; m &= m - 1)
+        if (fn(w * 64 + lowestBit(m)))
+          return true;
+    }
+    return false;
+  }
+};
+
 // The query database is heavily optimized for fast queries. It is stored
 // in-memory.
 struct DB {
@@ -151,22 +474,32 @@ struct DB {
   llvm::SmallVector<QueryFunc, 0> funcs;
   llvm::SmallVector<QueryType, 0> types;
   llvm::SmallVector<QueryVar, 0> vars;
+  // Qualified names of funcs, types and vars. Maintained by
+  // DB::applyIndexUpdates.
+  NameIndex func_names, type_names, var_names;
 
   void clear();
 
-  template <typename Def>
-  void removeUsrs(Kind kind, int file_id,
-                  const std::vector<std::pair<Usr, Def>> &to_remove);
-  // Insert the contents of |update| into |db|.
-  void applyIndexUpdate(IndexUpdate *update);
+  // Insert the contents of |updates| into |db|. The result is the same as
+  // applying them one by one; large batches are applied in parallel.
+  void applyIndexUpdates(llvm::ArrayRef<IndexUpdate *> updates);
   int getFileId(const std::string &path);
   int update(QueryFile::DefUpdate &&u);
-  void update(const Lid2file_id &, int file_id,
-              std::vector<std::pair<Usr, QueryType::Def>> &&us);
-  void update(const Lid2file_id &, int file_id,
-              std::vector<std::pair<Usr, QueryFunc::Def>> &&us);
-  void update(const Lid2file_id &, int file_id,
-              std::vector<std::pair<Usr, QueryVar::Def>> &&us);
+  // Update the reverse include graph after the def of |file_id| has been
+  // replaced. |prev| is the previous def, if any.
+  void linkFile(int file_id, const QueryFile::Def *prev);
+  // Files including |file_id| directly, or also indirectly if |transitive|,
+  // nearest first.
+  std::vector<int> getIncluders(int file_id, bool transitive);
+  // Translation units depending on |file_id|, nearest first.
+  std::vector<int> getDependents(int file_id);
+  // Rebuild QueryFile::call2caller from the defs of all functions.
+  void linkCallers();
+  // The function whose body contains |use|, a reference to a function, or
+  // nullptr.
+  QueryFunc *getCaller(const Use &use);
+  // Rebuild the name indexes from the defs of all entities.
+  void indexNames();
   std::string_view getSymbolName(SymbolIdx sym, bool qualified);
   std::vector<uint8_t> getFileSet(const std::vector<std::string> &folders);
 
@@ -195,7 +528,7 @@ std::vector<DeclRef> getVarDeclarations(DB *, const std::vector<Usr> &,
                                         unsigned);
 
 // Get non-defining declarations.
-std::vector<DeclRef> &getNonDefDeclarations(DB *db, SymbolIdx sym);
+FileSegments<DeclRef> &getNonDefDeclarations(DB *db, SymbolIdx sym);
 
 std::vector<Use> getUsesForAllBases(DB *db, QueryFunc &root);
 std::vector<Use> getUsesForAllDerived(DB *db, QueryFunc &root);
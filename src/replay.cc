@@ -0,0 +1,194 @@
+// Copyright 2017-2018 ccls Authors
+// SPDX-License-Identifier: Apache-2.0
+
+#include "replay.hh"
+
+#include "log.hh"
+#include "metrics.hh"
+#include "pipeline.hh"
+#include "utils.hh"
+
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/ADT/StringRef.h>
+#include <llvm/ADT/Twine.h>
+#include <llvm/Support/Threading.h>
+
+#include <rapidjson/document.h>
+
+#include <chrono>
+#include <inttypes.h>
+#include <stdio.h>
+#include <thread>
+
+using namespace llvm;
+namespace chrono = std::chrono;
+
+namespace ccls::replay {
+namespace {
+FILE *file;
+chrono::steady_clock::time_point origin;
+
+struct Message {
+  int64_t time;
+  std::string text;
+  bool request;
+  bool exit;
+};
+
+std::vector<Message> parse(StringRef buf) {
+  std::vector<Message> ret;
+  while (buf.size()) {
+    size_t end = buf.find("\r\n\r\n");
+    if (end == StringRef::npos)
+      break;
+    SmallVector<StringRef, 2> headers;
+    buf.take_front(end).split(headers, "\r\n");
+    buf = buf.drop_front(end + 4);
+    int64_t time = 0;
+    size_t len = buf.size() + 1;
+    for (StringRef line : headers)
+      if (line.consume_front("Time: "))
+        line.getAsInteger(10, time);
+      else if (line.consume_front("Content-Length: "))
+        line.getAsInteger(10, len);
+    if (len > buf.size())
+      break;
+    std::string text = buf.take_front(len).str();
+    buf = buf.drop_front(len);
+
+    // Responses to server requests are ignored by the main loop.
+    rapidjson::Document doc;
+    doc.Parse(text.data(), text.size());
+    if (doc.HasParseError() || !doc.IsObject()) {
+      LOG_S(WARNING) << "skip malformed message at " << time << "ms";
+      continue;
+    }
+    auto it = doc.FindMember("method");
+    if (it == doc.MemberEnd() || !it->value.IsString())
+      continue;
+    ret.push_back({time, std::move(text), doc.HasMember("id"),
+                   StringRef(it->value.GetString()) == "exit"});
+  }
+  return ret;
+}
+
+std::string ms(uint64_t us) {
+  char buf[32];
+  snprintf(buf, sizeof buf, "%.1fms", us / 1000.0);
+  return buf;
+}
+
+void feed(const std::vector<Message> &messages) {
+  auto start = chrono::steady_clock::now(), index_end = start;
+  int64_t completed = 0;
+  // Sleep until |until|, noting when the last index request completed.
+  // Returns false if ccls is quitting.
+  auto sleepUntil = [&](chrono::steady_clock::time_point until) {
+    while (!pipeline::g_quit.load(std::memory_order_relaxed)) {
+      auto now = chrono::steady_clock::now();
+      int64_t c = pipeline::stats.completed.load(std::memory_order_relaxed);
+      if (c != completed) {
+        completed = c;
+        index_end = now;
+      }
+      if (now >= until)
+        return true;
+      std::this_thread::sleep_for(std::min<chrono::steady_clock::duration>(
+          until - now, chrono::milliseconds(20)));
+    }
+    return false;
+  };
+
+  uint64_t requests = 0;
+  std::string method;
+  for (const Message &msg : messages) {
+    if (msg.exit)
+      break;
+    if (!sleepUntil(start + chrono::milliseconds(msg.time)))
+      return;
+    requests += msg.request;
+    pipeline::pushMessage(msg.text, method);
+  }
+
+  // Wait for the replies and for indexing to complete. Give up if nothing
+  // happens for a minute, e.g. a handler never replies.
+  uint64_t replied = 0;
+  auto progress = chrono::steady_clock::now();
+  while (true) {
+    if (!sleepUntil(chrono::steady_clock::now() + chrono::milliseconds(100)))
+      return;
+    uint64_t n = 0;
+    for (metrics::MethodStats &stats : metrics::snapshot(false))
+      n += stats.total.count();
+    auto now = chrono::steady_clock::now();
+    if (n != replied || index_end > progress) {
+      replied = n;
+      progress = now;
+    }
+    if (replied >= requests &&
+        pipeline::stats.completed == pipeline::stats.enqueued)
+      break;
+    if (now - progress > chrono::minutes(1)) {
+      LOG_S(WARNING) << requests - replied << " requests were not replied";
+      break;
+    }
+  }
+
+  // Requests are measured from receipt to the reply, notifications until the
+  // handler returns.
+  fprintf(stderr, "%-40s %7s %9s %9s %9s %9s\n", "method", "count", "p50",
+          "p95", "p99", "max");
+  for (metrics::MethodStats &stats : metrics::snapshot(false)) {
+    const Histogram &h = stats.total.count() ? stats.total : stats.handler;
+    if (!h.count())
+      continue;
+    fprintf(stderr, "%-40s %7" PRIu64 " %9s %9s %9s %9s\n",
+            stats.method.c_str(), h.count(), ms(h.percentile(.5)).c_str(),
+            ms(h.percentile(.95)).c_str(), ms(h.percentile(.99)).c_str(),
+            ms(h.max()).c_str());
+  }
+  double secs = chrono::duration<double>(index_end - start).count();
+  fprintf(stderr,
+          "completed %" PRId64 " index requests in %.1fs (%.1f/s)\n",
+          completed, secs, secs > 0 ? completed / secs : 0.0);
+
+  pipeline::pushMessage(R"({"jsonrpc":"2.0","method":"exit"})", method);
+}
+} // namespace
+
+bool startRecording(const std::string &path) {
+  file = fopen(path.c_str(), "wb");
+  if (!file)
+    return false;
+  origin = chrono::steady_clock::now();
+  return true;
+}
+
+void record(std::string_view message) {
+  if (!file)
+    return;
+  int64_t time = chrono::duration_cast<chrono::milliseconds>(
+                     chrono::steady_clock::now() - origin)
+                     .count();
+  fprintf(file, "Time: %" PRId64 "\r\nContent-Length: %zu\r\n\r\n", time,
+          message.size());
+  fwrite(message.data(), 1, message.size(), file);
+  // Keep the recording usable if ccls crashes.
+  fflush(file);
+}
+
+bool launch(const std::string &path) {
+  std::optional<std::string> content = readContent(path);
+  if (!content)
+    return false;
+  std::vector<Message> messages = parse(*content);
+  LOG_S(INFO) << "replay " << messages.size() << " messages from " << path;
+  pipeline::threadEnter();
+  std::thread([messages = std::move(messages)]() {
+    set_thread_name("replay");
+    feed(messages);
+    pipeline::threadLeave();
+  }).detach();
+  return true;
+}
+} // namespace ccls::replay
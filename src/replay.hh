@@ -0,0 +1,28 @@
+// Copyright 2017-2018 ccls Authors
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+#include <string>
+#include <string_view>
+
+// A recording is the stream of messages read from the client, framed as in the
+// base protocol with an additional "Time" header: the milliseconds since the
+// recording was started.
+//
+//   Time: 1520\r\n
+//   Content-Length: 52\r\n
+//   \r\n
+//   {"jsonrpc":"2.0","id":1,"method":"shutdown",...}
+namespace ccls::replay {
+// Record every message read by launchStdin to |path|. Returns false if it
+// cannot be opened.
+bool startRecording(const std::string &path);
+void record(std::string_view message);
+
+// Instead of launchStdin, feed the messages of a recording to the main loop
+// at their recorded times. "exit" is held back until every request has been
+// replied and indexing has completed, then per-method latencies and indexing
+// throughput are printed to stderr. Returns false if |path| cannot be read.
+bool launch(const std::string &path);
+} // namespace ccls::replay
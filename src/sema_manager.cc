@@ -9,6 +9,7 @@
 #include "log.hh"
 #include "pipeline.hh"
 #include "platform.hh"
+#include "trace.hh"
 
 #include <clang/Basic/TargetInfo.h>
 #include <clang/Lex/PreprocessorOptions.h>
@@ -437,6 +438,7 @@ void *preambleMain(void *manager_) {
     if (pipeline::g_quit.load(std::memory_order_relaxed))
       break;
 
+    trace::Span span("preamble", task.path);
     bool created = false;
     std::shared_ptr<Session> session =
         manager->ensureSession(task.path, &created);
@@ -482,6 +484,7 @@ void *completionMain(void *manager_) {
         break;
     }
 
+    trace::Span span("completion", task->path);
     std::shared_ptr<Session> session = manager->ensureSession(task->path);
     std::shared_ptr<PreambleData> preamble = session->getPreamble();
     IntrusiveRefCntPtr<llvm::vfs::FileSystem> fs =
@@ -576,6 +579,7 @@ void *diagnosticMain(void *manager_) {
       std::this_thread::sleep_for(
           chrono::duration<int64_t, std::milli>(std::min(wait, task.debounce)));
 
+    trace::Span span("diagnostics", task.path);
     std::shared_ptr<Session> session = manager->ensureSession(task.path);
     std::shared_ptr<PreambleData> preamble = session->getPreamble();
     IntrusiveRefCntPtr<llvm::vfs::FileSystem> fs =
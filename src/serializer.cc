@@ -5,6 +5,7 @@
 #include "serializer.hh"
 
 #include "filesystem.hh"
+#include "flat_index.hh"
 #include "indexer.hh"
 #include "log.hh"
 #include "message_handler.hh"
@@ -13,11 +14,8 @@
 #include <rapidjson/prettywriter.h>
 
 #include <llvm/ADT/CachedHashString.h>
-#include <llvm/ADT/DenseSet.h>
 #include <llvm/ADT/STLExtras.h>
-#include <llvm/Support/Allocator.h>
 
-#include <mutex>
 #include <stdexcept>
 
 using namespace llvm;
@@ -179,33 +177,47 @@ void reflect(BinaryWriter &vis, std::unordered_map<Usr, V> &v) {
 }
 
 // Used by IndexFile::dependencies.
-void reflect(JsonReader &vis, DenseMap<CachedHashStringRef, int64_t> &v) {
-  std::string name;
-  for (auto it = vis.m->MemberBegin(); it != vis.m->MemberEnd(); ++it)
-    v[internH(it->name.GetString())] = it->value.GetInt64();
+// An entry is "path": [mtime, hash].
+void reflect(JsonReader &vis,
+             DenseMap<CachedHashStringRef, IndexDependency> &v) {
+  for (auto it = vis.m->MemberBegin(); it != vis.m->MemberEnd(); ++it) {
+    auto &a = it->value;
+    if (!a.IsArray() || a.Size() != 2 || !a[0].IsInt64() || !a[1].IsUint64())
+      throw std::invalid_argument("dependency");
+    v[internH(it->name.GetString())] = {a[0].GetInt64(), a[1].GetUint64()};
+  }
 }
-void reflect(JsonWriter &vis, DenseMap<CachedHashStringRef, int64_t> &v) {
+void reflect(JsonWriter &vis,
+             DenseMap<CachedHashStringRef, IndexDependency> &v) {
   vis.startObject();
   for (auto &it : v) {
     vis.m->Key(it.first.val().data()); // llvm 8 -> data()
-    vis.m->Int64(it.second);
+    vis.m->StartArray();
+    vis.m->Int64(it.second.mtime);
+    vis.m->Uint64(it.second.hash);
+    vis.m->EndArray();
   }
   vis.endObject();
 }
-void reflect(BinaryReader &vis, DenseMap<CachedHashStringRef, int64_t> &v) {
+void reflect(BinaryReader &vis,
+             DenseMap<CachedHashStringRef, IndexDependency> &v) {
   std::string name;
   for (auto n = vis.varUInt(); n; n--) {
     reflect(vis, name);
-    reflect(vis, v[internH(name)]);
+    IndexDependency &dep = v[internH(name)];
+    reflect(vis, dep.mtime);
+    reflect(vis, dep.hash);
   }
 }
-void reflect(BinaryWriter &vis, DenseMap<CachedHashStringRef, int64_t> &v) {
+void reflect(BinaryWriter &vis,
+             DenseMap<CachedHashStringRef, IndexDependency> &v) {
   std::string key;
   vis.varUInt(v.size());
   for (auto &it : v) {
     key = it.first.val().str();
     reflect(vis, key);
-    reflect(vis, it.second);
+    reflect(vis, it.second.mtime);
+    reflect(vis, it.second.hash);
   }
 }
 
@@ -364,6 +376,7 @@ template <typename TVisitor> void reflect1(TVisitor &vis, IndexFile &v) {
   reflectMemberStart(vis);
   if (!gTestOutputMode) {
     REFLECT_MEMBER(mtime);
+    REFLECT_MEMBER(hash);
     REFLECT_MEMBER(language);
     REFLECT_MEMBER(no_linkage);
     REFLECT_MEMBER(lid2path);
@@ -384,8 +397,16 @@ void reflectFile(BinaryReader &vis, IndexFile &v) { reflect1(vis, v); }
 void reflectFile(BinaryWriter &vis, IndexFile &v) { reflect1(vis, v); }
 
 void reflect(JsonReader &vis, SerializeFormat &v) {
-  v = vis.getString()[0] == 'j' ? SerializeFormat::Json
-                                : SerializeFormat::Binary;
+  switch (vis.getString()[0]) {
+  case 'j':
+    v = SerializeFormat::Json;
+    break;
+  case 'f':
+    v = SerializeFormat::Flat;
+    break;
+  default:
+    v = SerializeFormat::Binary;
+  }
 }
 
 void reflect(JsonWriter &vis, SerializeFormat &v) {
@@ -396,6 +417,9 @@ void reflect(JsonWriter &vis, SerializeFormat &v) {
   case SerializeFormat::Json:
     vis.string("json");
     break;
+  case SerializeFormat::Flat:
+    vis.string("flat");
+    break;
   }
 }
 
@@ -404,27 +428,6 @@ void reflectMemberStart(JsonReader &vis) {
     throw std::invalid_argument("object");
 }
 
-static BumpPtrAllocator alloc;
-static DenseSet<CachedHashStringRef> strings;
-static std::mutex allocMutex;
-
-CachedHashStringRef internH(StringRef s) {
-  if (s.empty())
-    s = "";
-  CachedHashString hs(s);
-  std::lock_guard lock(allocMutex);
-  auto r = strings.insert(hs);
-  if (r.second) {
-    char *p = alloc.Allocate<char>(s.size() + 1);
-    memcpy(p, s.data(), s.size());
-    p[s.size()] = '\0';
-    *r.first = CachedHashStringRef(StringRef(p, s.size()), hs.hash());
-  }
-  return *r.first;
-}
-
-const char *intern(StringRef s) { return internH(s).val().data(); }
-
 std::string serialize(SerializeFormat format, IndexFile &file) {
   switch (format) {
   case SerializeFormat::Binary: {
@@ -452,13 +455,15 @@ std::string serialize(SerializeFormat format, IndexFile &file) {
     reflectFile(json_writer, file);
     return output.GetString();
   }
+  case SerializeFormat::Flat:
+    return serializeFlat(file);
   }
   return "";
 }
 
 std::unique_ptr<IndexFile>
 deserialize(SerializeFormat format, const std::string &path,
-            const std::string &serialized_index_content,
+            std::string_view serialized_index_content,
             const std::string &file_content,
             std::optional<int> expected_version) {
   if (serialized_index_content.empty())
@@ -487,16 +492,16 @@ deserialize(SerializeFormat format, const std::string &path,
   }
   case SerializeFormat::Json: {
     rapidjson::Document reader;
-    if (gTestOutputMode || !expected_version) {
-      reader.Parse(serialized_index_content.c_str());
-    } else {
-      const char *p = strchr(serialized_index_content.c_str(), '\n');
-      if (!p)
+    std::string_view json = serialized_index_content;
+    if (!gTestOutputMode && expected_version) {
+      size_t p = json.find('\n');
+      if (p == std::string_view::npos)
         return nullptr;
-      if (atoi(serialized_index_content.c_str()) != *expected_version)
+      if (atoi(json.data()) != *expected_version)
         return nullptr;
-      reader.Parse(p + 1);
+      json.remove_prefix(p + 1);
     }
+    reader.Parse(json.data(), json.size());
     if (reader.HasParseError())
       return nullptr;
 
@@ -511,6 +516,11 @@ deserialize(SerializeFormat format, const std::string &path,
     }
     break;
   }
+  case SerializeFormat::Flat:
+    file = deserializeFlat(serialized_index_content, path, file_content);
+    if (!file)
+      return nullptr;
+    break;
   }
 
   // Restore non-serialized state.
@@ -4,6 +4,7 @@
 
 #pragma once
 
+#include "intern.hh"
 #include "utils.hh"
 
 #include <llvm/Support/Compiler.h>
@@ -27,7 +28,7 @@ template <typename Fn> class function_ref;
 } // namespace llvm
 
 namespace ccls {
-enum class SerializeFormat { Binary, Json };
+enum class SerializeFormat { Binary, Json, Flat };
 
 struct JsonNull {};
 
@@ -367,6 +368,19 @@ template <typename T> void reflect(BinaryWriter &vis, std::vector<T> &v) {
     reflect(vis, it);
 }
 
+// Vec
+template <typename T> void reflect(BinaryReader &vis, Vec<T> &v) {
+  v.s = vis.varUInt();
+  v.a = std::make_unique<T[]>(v.s);
+  for (auto &it : v)
+    reflect(vis, it);
+}
+template <typename T> void reflect(BinaryWriter &vis, Vec<T> &v) {
+  vis.varUInt(v.size());
+  for (auto &it : v)
+    reflect(vis, it);
+}
+
 // reflectMember
 
 void reflectMemberStart(JsonReader &);
@@ -396,12 +410,10 @@ void reflectMember(BinaryWriter &vis, const char *, T &v) {
 
 // API
 
-const char *intern(llvm::StringRef str);
-llvm::CachedHashStringRef internH(llvm::StringRef str);
 std::string serialize(SerializeFormat format, IndexFile &file);
 std::unique_ptr<IndexFile>
 deserialize(SerializeFormat format, const std::string &path,
-            const std::string &serialized_index_content,
+            std::string_view serialized_index_content,
             const std::string &file_content,
             std::optional<int> expected_version);
 } // namespace ccls
\ No newline at end of file
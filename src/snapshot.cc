@@ -0,0 +1,457 @@
+// Copyright 2017-2018 ccls Authors
+// SPDX-License-Identifier: Apache-2.0
+
+#include "snapshot.hh"
+
+#include "config.hh"
+#include "log.hh"
+#include "message_handler.hh"
+#include "pipeline.hh"
+#include "platform.hh"
+#include "project.hh"
+#include "query.hh"
+
+#include <llvm/ADT/StringMap.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/Threading.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string.h>
+
+using namespace llvm;
+namespace chrono = std::chrono;
+
+namespace ccls {
+REFLECT_STRUCT(QueryFunc::Def, detailed_name, hover, comments, spell, bases,
+               vars, callees, qual_name_offset, short_name_offset,
+               short_name_size, kind, parent_kind, storage);
+REFLECT_STRUCT(QueryType::Def, detailed_name, hover, comments, spell, bases,
+               funcs, types, vars, alias_of, qual_name_offset,
+               short_name_offset, short_name_size, kind, parent_kind);
+
+namespace {
+// Bump when the layout of the snapshot changes.
+constexpr int kVersion = 1;
+constexpr char kMagic[8] = {'c', 'c', 'l', 's', 'd', 'b', 0, 0};
+
+// The snapshot is only usable with cache files of the same version and format.
+struct Header {
+  char magic[8];
+  int32_t version, index_version, format, reserved;
+  uint64_t size, hash;
+};
+
+// Cache writes by indexers. Compared with |saved_writes| to tell whether the
+// snapshot is up to date.
+std::atomic<int64_t> g_writes{0};
+// Whether $directory/db.snapshot is valid.
+std::atomic<bool> g_saved{false};
+// Whether a background thread is writing the snapshot.
+std::atomic<bool> g_storing{false};
+// Accessed by the main thread only.
+int64_t saved_writes = 0;
+chrono::steady_clock::time_point last_save;
+// Dependencies of the translation units restored from the snapshot, each
+// consumed by the first index request of the unit.
+std::mutex deps_mutex;
+StringMap<std::vector<const char *>> path2deps;
+
+bool enabled() {
+  return g_config->cache.snapshot && g_config->cache.directory.size();
+}
+
+std::string getPath() { return g_config->cache.directory + "db.snapshot"; }
+
+template <typename T>
+void writeSegments(BinaryWriter &w, const FileSegments<T> &segs) {
+  w.varUInt(segs.size());
+  for (T v : segs)
+    reflect(w, v);
+}
+
+template <typename T>
+void readSegments(BinaryReader &r, FileSegments<T> &segs) {
+  std::vector<T> items(r.varUInt());
+  for (T &v : items)
+    reflect(r, v);
+  segs.add(items);
+}
+
+template <typename Q>
+void writeEntities(BinaryWriter &w, SmallVectorImpl<Q> &entities) {
+  w.varUInt(entities.size());
+  for (Q &e : entities) {
+    reflect(w, e.usr);
+    w.varUInt(e.def.size());
+    for (auto &def : e.def) {
+      reflect(w, def);
+      reflect(w, def.file_id);
+    }
+    writeSegments(w, e.declarations);
+    if constexpr (!std::is_same_v<Q, QueryVar>)
+      reflect(w, e.derived);
+    if constexpr (std::is_same_v<Q, QueryType>)
+      reflect(w, e.instances);
+    writeSegments(w, e.uses);
+  }
+}
+
+template <typename Q>
+void readEntities(BinaryReader &r, SmallVectorImpl<Q> &entities,
+                  DenseMap<Usr, int, DenseMapInfoForUsr> &entity_usr) {
+  size_t n = r.varUInt();
+  entities.resize(n);
+  entity_usr.reserve(n);
+  for (size_t i = 0; i < n; i++) {
+    Q &e = entities[i];
+    reflect(r, e.usr);
+    e.def.resize(r.varUInt());
+    for (auto &def : e.def) {
+      reflect(r, def);
+      reflect(r, def.file_id);
+    }
+    readSegments(r, e.declarations);
+    if constexpr (!std::is_same_v<Q, QueryVar>)
+      reflect(r, e.derived);
+    if constexpr (std::is_same_v<Q, QueryType>)
+      reflect(r, e.instances);
+    readSegments(r, e.uses);
+    entity_usr[e.usr] = i;
+  }
+}
+
+void writeFile(BinaryWriter &w, QueryFile &file) {
+  bool has_def = file.def.has_value();
+  reflect(w, has_def);
+  if (has_def) {
+    QueryFile::Def &def = *file.def;
+    reflect(w, def.path);
+    reflect(w, def.args);
+    reflect(w, def.language);
+    w.varUInt(def.includes.size());
+    for (IndexInclude &include : def.includes) {
+      reflect(w, include.line);
+      reflect(w, include.resolved_path);
+    }
+    reflect(w, def.skipped_ranges);
+    reflect(w, def.dependencies);
+  }
+  w.varUInt(file.symbol2refcnt.size());
+  for (auto &it : file.symbol2refcnt) {
+    ExtentRef sym = it.first;
+    reflect(w, static_cast<SymbolRef &>(sym));
+    reflect(w, sym.extent);
+    reflect(w, it.second);
+  }
+}
+
+void readFile(BinaryReader &r, QueryFile &file) {
+  bool has_def;
+  reflect(r, has_def);
+  if (has_def) {
+    QueryFile::Def &def = file.def.emplace();
+    reflect(r, def.path);
+    reflect(r, def.args);
+    reflect(r, def.language);
+    def.includes.resize(r.varUInt());
+    for (IndexInclude &include : def.includes) {
+      reflect(r, include.line);
+      reflect(r, include.resolved_path);
+    }
+    reflect(r, def.skipped_ranges);
+    reflect(r, def.dependencies);
+  }
+  size_t n = r.varUInt();
+  file.symbol2refcnt.reserve(n);
+  std::vector<ExtentRef> syms(n);
+  for (ExtentRef &sym : syms) {
+    int refcnt;
+    reflect(r, static_cast<SymbolRef &>(sym));
+    reflect(r, sym.extent);
+    reflect(r, refcnt);
+    file.symbol2refcnt[sym] = refcnt;
+  }
+  file.occurrences.assign(syms);
+  file.extents.assign(std::move(syms));
+}
+
+// A serialized snapshot to be hashed and written.
+struct Job {
+  std::string body;
+  int64_t writes;
+  size_t files;
+  chrono::steady_clock::time_point start;
+};
+
+void store(const Job &job) {
+  Header h{};
+  memcpy(h.magic, kMagic, sizeof kMagic);
+  h.version = kVersion;
+  h.index_version = IndexFile::kMajorVersion;
+  h.format = int(g_config->cache.format);
+  h.size = job.body.size();
+  h.hash = hashContent(job.body);
+  std::string path = getPath(), tmp = path + ".tmp";
+  {
+    std::error_code ec;
+    raw_fd_ostream os(tmp, ec, sys::fs::OF_None);
+    if (ec) {
+      LOG_S(ERROR) << "failed to open " << tmp << ": " << ec.message();
+      return;
+    }
+    os.write(reinterpret_cast<const char *>(&h), sizeof h);
+    os << job.body;
+    os.close();
+    if (os.has_error()) {
+      os.clear_error();
+      LOG_S(ERROR) << "failed to write " << tmp;
+      (void)sys::fs::remove(tmp);
+      return;
+    }
+  }
+  if (std::error_code ec = sys::fs::rename(tmp, path)) {
+    LOG_S(ERROR) << "failed to rename " << tmp << ": " << ec.message();
+    return;
+  }
+  g_saved = true;
+  // Cache files written while saving may not be reflected in the snapshot.
+  if (g_writes.load() != job.writes && g_saved.exchange(false))
+    (void)sys::fs::remove(path);
+  LOG_S(INFO) << "saved snapshot of " << job.files << " files ("
+              << job.body.size() << " bytes) in "
+              << chrono::duration_cast<chrono::milliseconds>(
+                     chrono::steady_clock::now() - job.start)
+                     .count()
+              << "ms";
+}
+
+void *storeMain(void *arg) {
+  set_thread_name("snapshot");
+  std::unique_ptr<Job> job(static_cast<Job *>(arg));
+  store(*job);
+  g_storing = false;
+  // Cache writes during the store may have made another save due.
+  pipeline::wakeMain();
+  pipeline::threadLeave();
+  return nullptr;
+}
+
+// Serialize |db| on the main thread. Unless |sync|, hashing and writing the
+// file are left to a background thread so that requests are not stalled.
+void write(DB *db, VFS *vfs, int64_t writes, bool sync) {
+  auto job = std::make_unique<Job>();
+  job->start = chrono::steady_clock::now();
+  BinaryWriter w;
+  w.varUInt(db->files.size());
+  for (QueryFile &file : db->files)
+    writeFile(w, file);
+  w.varUInt(db->name2file_id.size());
+  for (auto &it : db->name2file_id) {
+    std::string name = it.first().str();
+    reflect(w, name);
+    reflect(w, it.second);
+  }
+  {
+    std::lock_guard lock(vfs->mutex);
+    std::vector<std::pair<std::string, VFS::State>> states;
+    for (QueryFile &file : db->files)
+      if (file.def) {
+        auto it = vfs->state.find(file.def->path);
+        if (it != vfs->state.end() && it->second.loaded)
+          states.emplace_back(it->first, it->second);
+      }
+    w.varUInt(states.size());
+    for (auto &[path, st] : states) {
+      reflect(w, path);
+      reflect(w, st.timestamp);
+      reflect(w, st.step);
+    }
+  }
+  writeEntities(w, db->funcs);
+  writeEntities(w, db->types);
+  writeEntities(w, db->vars);
+  job->body = w.take();
+  job->writes = writes;
+  job->files = db->files.size();
+
+  // If storing fails, g_saved remains false and the next save retries.
+  saved_writes = writes;
+  last_save = job->start;
+  if (sync) {
+    store(*job);
+  } else {
+    g_storing = true;
+    spawnThread(storeMain, job.release());
+  }
+}
+} // namespace
+
+namespace snapshot {
+bool load(DB *db, VFS *vfs, Project *project) {
+  if (g_config->cache.directory.empty())
+    return false;
+  std::string path = getPath();
+  if (!g_config->cache.snapshot) {
+    // A snapshot left by a previous session would be stale when re-enabled.
+    (void)sys::fs::remove(path);
+    return false;
+  }
+  auto start = chrono::steady_clock::now();
+  auto buf = mapFile(path);
+  if (!buf)
+    return false;
+  StringRef data = buf->getBuffer();
+  Header h;
+  if (data.size() < sizeof h)
+    return false;
+  memcpy(&h, data.data(), sizeof h);
+  data = data.drop_front(sizeof h);
+  if (memcmp(h.magic, kMagic, sizeof kMagic) || h.version != kVersion ||
+      h.index_version != IndexFile::kMajorVersion ||
+      h.format != int(g_config->cache.format) || h.size != data.size() ||
+      h.hash != hashContent(data)) {
+    LOG_S(INFO) << "ignore stale " << path;
+    (void)sys::fs::remove(path);
+    return false;
+  }
+
+  db->clear();
+  BinaryReader r(std::string_view(data.data(), data.size()));
+  db->files.resize(r.varUInt());
+  for (size_t i = 0; i < db->files.size(); i++) {
+    db->files[i].id = i;
+    readFile(r, db->files[i]);
+  }
+  for (size_t n = r.varUInt(); n; n--) {
+    std::string name;
+    int id;
+    reflect(r, name);
+    reflect(r, id);
+    db->name2file_id[name] = id;
+  }
+  for (size_t i = 0; i < db->files.size(); i++)
+    if (db->files[i].def)
+      db->linkFile(i, nullptr);
+  std::vector<std::pair<std::string, VFS::State>> states(r.varUInt());
+  for (auto &[path, st] : states) {
+    reflect(r, path);
+    reflect(r, st.timestamp);
+    reflect(r, st.step);
+    st.loaded = 1;
+  }
+  readEntities(r, db->funcs, db->func_usr);
+  readEntities(r, db->types, db->type_usr);
+  readEntities(r, db->vars, db->var_usr);
+  if (r.p_ != data.end()) {
+    LOG_S(ERROR) << "malformed " << path;
+    db->clear();
+    (void)sys::fs::remove(path);
+    return false;
+  }
+  db->linkCallers();
+  db->indexNames();
+  {
+    std::lock_guard lock(deps_mutex);
+    path2deps.clear();
+    for (QueryFile &file : db->files)
+      if (file.def && file.def->dependencies.size())
+        path2deps[file.def->path] = file.def->dependencies;
+  }
+
+  {
+    std::lock_guard lock(vfs->mutex);
+    for (auto &[path, st] : states)
+      vfs->state[path] = st;
+  }
+  // Dependencies are normally mapped to their project entries when the cache
+  // of the entry is loaded.
+  {
+    std::lock_guard lock(project->mtx);
+    for (auto &[root, folder] : project->root2folder)
+      for (QueryFile &file : db->files)
+        if (file.def) {
+          auto it = folder.path2entry_index.find(file.def->path);
+          if (it == folder.path2entry_index.end())
+            continue;
+          int id = it->second;
+          for (const char *dep : file.def->dependencies)
+            folder.path2entry_index[dep] = id;
+        }
+  }
+
+  g_saved = true;
+  saved_writes = g_writes.load();
+  last_save = chrono::steady_clock::now();
+  LOG_S(INFO) << "loaded snapshot of " << db->files.size() << " files, "
+              << db->funcs.size() << " funcs, " << db->types.size()
+              << " types, " << db->vars.size() << " vars in "
+              << chrono::duration_cast<chrono::milliseconds>(last_save - start)
+                     .count()
+              << "ms";
+  return true;
+}
+
+void saveIfDue(DB *db, VFS *vfs, function_ref<bool()> idle) {
+  if (!enabled())
+    return;
+  // Read before |idle| so that writes after the check invalidate the result.
+  int64_t writes = g_writes.load();
+  if ((g_saved && writes == saved_writes) ||
+      chrono::steady_clock::now() - last_save <
+          chrono::seconds(g_config->cache.snapshotInterval) ||
+      g_storing || !idle())
+    return;
+  write(db, vfs, writes, false);
+}
+
+std::optional<chrono::steady_clock::time_point> nextSave() {
+  if (!enabled() || (g_saved && g_writes.load() == saved_writes))
+    return {};
+  // If already due, saveIfDue is waiting for indexers to become idle.
+  return std::max(last_save + chrono::seconds(g_config->cache.snapshotInterval),
+                  chrono::steady_clock::now() + chrono::seconds(1));
+}
+
+void save(DB *db, VFS *vfs) {
+  if (!enabled())
+    return;
+  int64_t writes = g_writes.load();
+  // pipeline::quit has waited for a background write to finish.
+  if (!g_saved || writes != saved_writes)
+    write(db, vfs, writes, true);
+}
+
+void invalidate() {
+  g_writes++;
+  if (g_saved.exchange(false))
+    (void)sys::fs::remove(getPath());
+}
+
+bool unchanged(VFS *vfs, const std::string &path) {
+  std::vector<const char *> deps;
+  {
+    std::lock_guard lock(deps_mutex);
+    auto it = path2deps.find(path);
+    if (it == path2deps.end())
+      return false;
+    deps = std::move(it->second);
+    path2deps.erase(it);
+  }
+  for (const char *dep : deps) {
+    std::optional<int64_t> mtime = lastWriteTime(dep);
+    if (!mtime)
+      return false;
+    std::lock_guard lock(vfs->mutex);
+    auto it = vfs->state.find(dep);
+    if (it == vfs->state.end() || it->second.timestamp < *mtime)
+      return false;
+  }
+  return true;
+}
+} // namespace snapshot
+} // namespace ccls
@@ -0,0 +1,52 @@
+// Copyright 2017-2018 ccls Authors
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+#include <llvm/ADT/STLExtras.h>
+
+#include <chrono>
+#include <optional>
+#include <string>
+
+namespace ccls {
+struct DB;
+struct Project;
+struct VFS;
+
+// A snapshot of the query database and of the VFS state of its files, stored
+// in $directory/db.snapshot if cache.snapshot is true. Loading it replaces
+// loading and applying every cache file on startup; initial index requests
+// then only re-index files whose mtimes have changed.
+//
+// A snapshot is only valid as long as the cache files match the database, so
+// it is removed before the first cache write after it is saved.
+namespace snapshot {
+// Must be called on the main thread before indexer threads are started.
+// Returns false if there is no usable snapshot.
+bool load(DB *db, VFS *vfs, Project *project);
+
+// Save if there is no valid snapshot or cache files have been written since
+// the last save, and cache.snapshotInterval seconds have passed. |idle| is
+// checked last and should return true if every IndexUpdate whose cache files
+// have been written has been applied to |db|. |db| is serialized on the calling
+// thread; the file is hashed and written on a background thread.
+void saveIfDue(DB *db, VFS *vfs, llvm::function_ref<bool()> idle);
+
+// When saveIfDue should be called again if there are pending changes to save.
+std::optional<std::chrono::steady_clock::time_point> nextSave();
+
+// Called on exit after indexer threads have stopped and their IndexUpdates
+// have been applied.
+void save(DB *db, VFS *vfs);
+
+// Called by indexers before writing cache files.
+void invalidate();
+
+// Called by indexers for each index request of |path|. Returns true for the
+// first request if |path| was restored from the snapshot and none of its
+// dependencies are newer than their VFS timestamps, so that its cache file need
+// not be loaded to check them.
+bool unchanged(VFS *vfs, const std::string &path);
+} // namespace snapshot
+} // namespace ccls
@@ -6,6 +6,7 @@
 
 #include "utils.hh"
 
+#include <algorithm>
 #include <atomic>
 #include <chrono>
 #include <condition_variable>
@@ -103,6 +104,35 @@ public:
     push<&std::deque<T>::push_back>(std::move(t), priority);
   }
 
+  // Find the last queued element (in dequeue order) for which |match| returns
+  // true. If |merge| succeeds in merging |t| into it, it is moved to the
+  // priority queue if |priority| is true. Otherwise |t| is pushed. Returns true
+  // if |t| has been merged.
+  template <typename Match, typename Merge>
+  bool pushBackOrMerge(T &&t, bool priority, Match &&match, Merge &&merge) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (std::deque<T> *q : {&queue_, &priority_}) {
+      auto it = std::find_if(q->rbegin(), q->rend(),
+                             [&](T &queued) { return match(queued, t); });
+      if (it == q->rend())
+        continue;
+      if (!merge(*it, t))
+        break;
+      if (priority && q == &queue_) {
+        priority_.push_back(std::move(*it));
+        queue_.erase(std::next(it).base());
+      }
+      return true;
+    }
+    if (priority)
+      priority_.push_back(std::move(t));
+    else
+      queue_.push_back(std::move(t));
+    ++total_count_;
+    waiter_->cv.notify_one();
+    return false;
+  }
+
   // Return all elements in the queue.
   std::vector<T> dequeueAll() {
     std::lock_guard<std::mutex> lock(mutex_);
@@ -179,4 +209,90 @@ private:
   MultiQueueWaiter *waiter_;
   std::unique_ptr<MultiQueueWaiter> owned_waiter_;
 };
+
+// A work-stealing queue shared by a fixed number of workers. Each worker owns
+// one deque per lane, where lane 0 has the highest priority. Elements are
+// distributed round-robin; a worker pops from its own deques first and steals
+// from the others otherwise, but never takes an element from a lower lane
+// while a higher lane is non-empty.
+template <class T, int Lanes> struct WorkStealingQueue : BaseThreadQueue {
+public:
+  explicit WorkStealingQueue(MultiQueueWaiter *waiter) : waiter_(waiter) {
+    setWorkers(1);
+  }
+
+  // Resize the worker set. Queued elements are redistributed. Must not race
+  // with pushBack or tryPopFront.
+  void setWorkers(int n) {
+    std::vector<std::pair<T, int>> old;
+    for (int i = 0; i < n_workers_; i++)
+      for (int lane = 0; lane < Lanes; lane++)
+        for (T &t : workers_[i].lanes[lane])
+          old.emplace_back(std::move(t), lane);
+    n_workers_ = std::max(n, 1);
+    workers_ = std::make_unique<Worker[]>(n_workers_);
+    for (int lane = 0; lane < Lanes; lane++)
+      lane_count_[lane] = 0;
+    total_count_ = 0;
+    for (auto &[t, lane] : old)
+      pushBack(std::move(t), lane);
+  }
+
+  // Returns the number of elements in the queue. This is lock-free.
+  size_t size() const { return total_count_; }
+
+  // Returns true if the queue is empty. This is lock-free.
+  bool isEmpty() override { return total_count_ == 0; }
+
+  void pushBack(T &&t, int lane) {
+    Worker &w =
+        workers_[next_.fetch_add(1, std::memory_order_relaxed) % n_workers_];
+    {
+      std::lock_guard lock(w.mutex);
+      w.lanes[lane].push_back(std::move(t));
+      ++lane_count_[lane];
+      ++total_count_;
+    }
+    // Synchronize with MultiQueueWaiter::wait, which checks isEmpty() while
+    // holding mutex_.
+    { std::lock_guard lock(mutex_); }
+    waiter_->cv.notify_one();
+  }
+
+  // Get the front element of the highest non-empty lane, preferring the
+  // deque owned by |worker|. Returns a null value if the queue is empty.
+  std::optional<T> tryPopFront(int worker) {
+    for (int lane = 0; lane < Lanes; lane++)
+      while (lane_count_[lane].load(std::memory_order_acquire) > 0)
+        for (int i = 0; i < n_workers_; i++) {
+          Worker &w = workers_[(worker + i) % n_workers_];
+          std::lock_guard lock(w.mutex);
+          std::deque<T> &q = w.lanes[lane];
+          if (q.empty())
+            continue;
+          std::optional<T> ret(std::move(q.front()));
+          q.pop_front();
+          --lane_count_[lane];
+          --total_count_;
+          return ret;
+        }
+    return std::nullopt;
+  }
+
+  // Only used by MultiQueueWaiter. The deques are protected by per-worker
+  // mutexes.
+  mutable std::mutex mutex_;
+
+private:
+  struct Worker {
+    std::mutex mutex;
+    std::deque<T> lanes[Lanes];
+  };
+  std::unique_ptr<Worker[]> workers_;
+  int n_workers_ = 0;
+  std::atomic<unsigned> next_{0};
+  std::atomic<int> lane_count_[Lanes] = {};
+  std::atomic<int> total_count_{0};
+  MultiQueueWaiter *waiter_;
+};
 } // namespace ccls
\ No newline at end of file
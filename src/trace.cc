@@ -0,0 +1,114 @@
+// Copyright 2017-2018 ccls Authors
+// SPDX-License-Identifier: Apache-2.0
+
+#include "trace.hh"
+
+#include <llvm/ADT/SmallString.h>
+#include <llvm/Support/Threading.h>
+
+#include <chrono>
+#include <mutex>
+#include <stdio.h>
+
+using namespace llvm;
+namespace chrono = std::chrono;
+
+namespace ccls::trace {
+std::atomic<bool> g_enabled{false};
+
+namespace {
+std::mutex mtx;
+FILE *file;
+chrono::steady_clock::time_point origin;
+int n_threads = 0;
+thread_local int tid = -1;
+
+int64_t now() {
+  return chrono::duration_cast<chrono::microseconds>(
+             chrono::steady_clock::now() - origin)
+      .count();
+}
+
+void escape(std::string &out, StringRef s) {
+  for (char c : s) {
+    if (c == '"' || c == '\\') {
+      out += '\\';
+      out += c;
+    } else if ((unsigned char)c < 0x20) {
+      char buf[8];
+      snprintf(buf, sizeof buf, "\\u%04x", c);
+      out += buf;
+    } else {
+      out += c;
+    }
+  }
+}
+
+// The caller holds |mtx|. The thread name is emitted as metadata before the
+// first event of a thread.
+int threadId() {
+  if (tid < 0) {
+    tid = n_threads++;
+    SmallString<32> name;
+    get_thread_name(name);
+    std::string meta;
+    escape(meta, name);
+    fprintf(file,
+            ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":%d,"
+            "\"args\":{\"name\":\"%s\"}}",
+            tid, meta.c_str());
+  }
+  return tid;
+}
+} // namespace
+
+bool init(const std::string &path) {
+  std::lock_guard lock(mtx);
+  file = fopen(path.c_str(), "wb");
+  if (!file)
+    return false;
+  origin = chrono::steady_clock::now();
+  // The array starts with a dummy event so that every event can be preceded
+  // by a comma.
+  fputs("[{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":0,"
+        "\"args\":{\"name\":\"ccls\"}}",
+        file);
+  g_enabled = true;
+  return true;
+}
+
+void finish() {
+  std::lock_guard lock(mtx);
+  g_enabled = false;
+  if (file) {
+    fputs("\n]\n", file);
+    fclose(file);
+    file = nullptr;
+  }
+}
+
+void Span::begin(StringRef detail) {
+  this->detail = detail.str();
+  start = now();
+}
+
+void Span::emit() {
+  int64_t end = now();
+  // |name| may be a method name sent by the client.
+  std::string name1, args;
+  escape(name1, name);
+  if (detail.size()) {
+    args = ",\"args\":{\"detail\":\"";
+    escape(args, detail);
+    args += "\"}";
+  }
+  std::lock_guard lock(mtx);
+  if (file)
+    fprintf(file,
+            ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":0,\"tid\":%d,"
+            "\"ts\":%lld,\"dur\":%lld%s}",
+            name1.c_str(), threadId(), (long long)start, (long long)(end - start),
+            args.c_str());
+  start = -1;
+}
+} // namespace ccls::trace
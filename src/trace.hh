@@ -0,0 +1,47 @@
+// Copyright 2017-2018 ccls Authors
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+#include <llvm/ADT/StringRef.h>
+
+#include <atomic>
+#include <stdint.h>
+#include <string>
+
+namespace ccls::trace {
+// Spans of thread activity written to the file given by --trace in the Chrome
+// Trace Event format, viewable in chrome://tracing or Perfetto.
+extern std::atomic<bool> g_enabled;
+
+// Returns false if |path| cannot be opened.
+bool init(const std::string &path);
+// Terminate the JSON array and close the file. Later spans are discarded.
+void finish();
+
+// A complete event from construction to end() or destruction. If tracing is
+// disabled, only a relaxed load is paid.
+class Span {
+  const char *name;
+  std::string detail;
+  int64_t start = -1;
+
+public:
+  Span(const char *name, llvm::StringRef detail = {}) : name(name) {
+    if (g_enabled.load(std::memory_order_relaxed))
+      begin(detail);
+  }
+  ~Span() { end(); }
+  Span(const Span &) = delete;
+  Span &operator=(const Span &) = delete;
+
+  void end() {
+    if (start >= 0)
+      emit();
+  }
+
+private:
+  void begin(llvm::StringRef detail);
+  void emit();
+};
+} // namespace ccls::trace
@@ -11,7 +11,9 @@
 #include <siphash.h>
 
 #include <llvm/ADT/StringRef.h>
+#include <llvm/Config/llvm-config.h>
 #include <llvm/Support/FileSystem.h>
+#include <llvm/Support/MemoryBuffer.h>
 #include <llvm/Support/Path.h>
 
 #include <algorithm>
@@ -95,6 +97,19 @@ uint64_t hashUsr(llvm::StringRef s) {
   return ret;
 }
 
+uint64_t hashContent(llvm::StringRef s) {
+  union {
+    uint64_t ret;
+    uint8_t out[8];
+  };
+  // Stored in cache files. Don't change it.
+  const uint8_t k[16] = {0x63, 0x6f, 0x6e, 0x74, 0x65, 0x6e, 0x74, 0x20,
+                         0x68, 0x61, 0x73, 0x68, 0x20, 0x6b, 0x65, 0x79};
+  (void)siphash(reinterpret_cast<const uint8_t *>(s.data()), s.size(), k, out,
+                8);
+  return ret ? ret : 1;
+}
+
 std::string lowerPathIfInsensitive(const std::string &path) {
 #if defined(_WIN32)
   std::string ret = path;
@@ -170,6 +185,17 @@ std::optional<std::string> readContent(const std::string &filename) {
   return ret;
 }
 
+std::unique_ptr<MemoryBuffer> mapFile(const std::string &path) {
+#if LLVM_VERSION_MAJOR >= 13
+  auto buf = MemoryBuffer::getFile(path, false, false);
+#else
+  auto buf = MemoryBuffer::getFile(path, -1, false);
+#endif
+  if (!buf)
+    return nullptr;
+  return std::move(*buf);
+}
+
 void writeToFile(const std::string &filename, const std::string &content) {
   FILE *f = fopen(filename.c_str(), "wb");
   if (!f ||
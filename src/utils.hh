@@ -14,6 +14,7 @@
 #include <vector>
 
 namespace llvm {
+class MemoryBuffer;
 class StringRef;
 }
 
@@ -39,6 +40,8 @@ struct GroupMatch {
 };
 
 uint64_t hashUsr(llvm::StringRef s);
+// Hash of file contents for cache validation. Never 0, which means unknown.
+uint64_t hashContent(llvm::StringRef s);
 
 std::string lowerPathIfInsensitive(const std::string &path);
 
@@ -56,6 +59,8 @@ bool normalizeFolder(std::string &path);
 
 std::optional<int64_t> lastWriteTime(const std::string &path);
 std::optional<std::string> readContent(const std::string &filename);
+// Read or mmap |path| without requiring a null terminator.
+std::unique_ptr<llvm::MemoryBuffer> mapFile(const std::string &path);
 void writeToFile(const std::string &filename, const std::string &content);
 
 int reverseSubseqMatch(std::string_view pat, std::string_view text,
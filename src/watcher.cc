@@ -0,0 +1,275 @@
+// Copyright 2017-2018 ccls Authors
+// SPDX-License-Identifier: Apache-2.0
+
+#include "watcher.hh"
+
+#include "config.hh"
+#include "log.hh"
+#include "message_handler.hh"
+#include "pipeline.hh"
+#include "platform.hh"
+#include "project.hh"
+
+#include <llvm/ADT/MapVector.h>
+#include <llvm/ADT/StringMap.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/Threading.h>
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <unordered_map>
+
+#ifdef __linux__
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+using namespace llvm;
+namespace chrono = std::chrono;
+
+namespace ccls::watcher {
+namespace {
+std::atomic<bool> started{false}, exhausted{false};
+
+#ifdef __linux__
+constexpr uint32_t kMask = IN_CLOSE_WRITE | IN_CREATE | IN_DELETE |
+                           IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR;
+// A batch is dispatched after no event has arrived for kQuietMs, or kMaxDelayMs
+// after its first event during a steady stream of events (e.g. git checkout).
+constexpr int kQuietMs = 200, kMaxDelayMs = 2000;
+
+using Pending =
+    MapVector<std::string, FileChangeType,
+              std::unordered_map<std::string, unsigned>>;
+
+int inotify_fd = -1;
+std::vector<std::string> roots;
+std::function<void()> on_exhausted;
+std::mutex mtx;
+// Directories end with a slash.
+std::unordered_map<int, std::string> wd2dir;
+StringMap<int> dir2wd;
+
+// Returns false if |dir| cannot be watched. The caller holds |mtx|.
+bool addWatch(const std::string &dir) {
+  if (dir2wd.count(dir))
+    return true;
+  if (exhausted)
+    return false;
+  int wd = inotify_add_watch(inotify_fd, dir.c_str(), kMask);
+  if (wd < 0) {
+    if (errno == ENOSPC && !exhausted.exchange(true)) {
+      LOG_S(WARNING) << "inotify watch limit reached after " << dir2wd.size()
+                     << " directories; fall back to "
+                        "workspace/didChangeWatchedFiles";
+      on_exhausted();
+    }
+    return false;
+  }
+  wd2dir[wd] = dir;
+  dir2wd[dir] = wd;
+  return true;
+}
+
+bool ignored(StringRef path) {
+  return (g_config->cache.directory.size() &&
+          path.startswith(g_config->cache.directory)) ||
+         sys::path::filename(sys::path::parent_path(path)).startswith(".");
+}
+
+bool inRoots(StringRef path) {
+  for (auto &root : roots)
+    if (path.startswith(root))
+      return true;
+  return false;
+}
+
+void addEvent(Pending &pending, const std::string &path, FileChangeType type) {
+  if (lookupExtension(path).first == LanguageId::Unknown)
+    return;
+  auto [it, inserted] = pending.insert({path, type});
+  // A file in a new directory stays Created.
+  if (!inserted && !(it->second == FileChangeType::Created &&
+                     type == FileChangeType::Changed))
+    it->second = type;
+}
+
+// Watch |root| and its non-hidden subdirectories. If |pending| is not null,
+// files found are reported as created, since they may have been created
+// before the watch was added.
+void addTree(const std::string &root, Pending *pending) {
+  std::vector<std::string> stack{root};
+  while (stack.size()) {
+    std::string dir = std::move(stack.back());
+    stack.pop_back();
+    {
+      std::lock_guard lock(mtx);
+      if (!addWatch(dir))
+        continue;
+    }
+    std::error_code ec;
+    for (sys::fs::directory_iterator it(dir, ec), end; it != end && !ec;
+         it.increment(ec)) {
+      std::string path = it->path();
+      if (it->type() == sys::fs::file_type::directory_file) {
+        ensureEndsInSlash(path);
+        if (!sys::path::filename(it->path()).startswith(".") &&
+            !ignored(path))
+          stack.push_back(path);
+      } else if (pending && it->type() == sys::fs::file_type::regular_file) {
+        addEvent(*pending, path, FileChangeType::Created);
+      }
+    }
+  }
+}
+
+void dispatch(Pending &pending) {
+  LOG_S(INFO) << "watcher: " << pending.size() << " changed files";
+  pipeline::pushNotification(
+      "workspace/didChangeWatchedFiles", [&](JsonWriter &w) {
+        w.startObject();
+        w.key("changes");
+        w.startArray();
+        for (auto &[path, type] : pending) {
+          std::string uri = DocumentUri::fromPath(path).raw_uri;
+          w.startObject();
+          w.key("uri");
+          w.string(uri.c_str(), uri.size());
+          w.key("type");
+          w.int64(int(type));
+          w.endObject();
+        }
+        w.endArray();
+        w.endObject();
+      });
+}
+
+void handle(const inotify_event &ev, Pending &pending) {
+  // Events were lost. Report every file under the roots as created: index
+  // requests skip files whose mtimes (and those of their dependencies) match
+  // the index, so only what actually changed is reindexed.
+  if (ev.mask & IN_Q_OVERFLOW) {
+    LOG_S(WARNING) << "watcher: event queue overflowed, rescan roots";
+    for (auto &root : roots)
+      addTree(root, &pending);
+    return;
+  }
+  std::string dir;
+  {
+    std::lock_guard lock(mtx);
+    auto it = wd2dir.find(ev.wd);
+    if (it == wd2dir.end())
+      return;
+    if (ev.mask & IN_IGNORED) {
+      dir2wd.erase(it->second);
+      wd2dir.erase(it);
+      return;
+    }
+    dir = it->second;
+  }
+  if (!ev.len)
+    return;
+  std::string path = dir + ev.name;
+  if (ignored(path))
+    return;
+  if (ev.mask & IN_ISDIR) {
+    ensureEndsInSlash(path);
+    if (ev.mask & (IN_CREATE | IN_MOVED_TO) && ev.name[0] != '.' &&
+        inRoots(path))
+      addTree(path, &pending);
+  } else if (ev.mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) {
+    addEvent(pending, path, FileChangeType::Changed);
+  } else if (ev.mask & (IN_DELETE | IN_MOVED_FROM)) {
+    addEvent(pending, path, FileChangeType::Deleted);
+  }
+}
+
+void *watcherMain(void *) {
+  set_thread_name("watcher");
+  for (auto &root : roots)
+    addTree(root, nullptr);
+  {
+    std::lock_guard lock(mtx);
+    LOG_S(INFO) << "watcher: watching " << dir2wd.size() << " directories";
+  }
+
+  Pending pending;
+  chrono::steady_clock::time_point first, last;
+  alignas(inotify_event) char buf[64 * 1024];
+  while (!pipeline::g_quit.load(std::memory_order_relaxed)) {
+    auto now = chrono::steady_clock::now();
+    int timeout = kQuietMs;
+    if (pending.size()) {
+      auto left = [&](chrono::steady_clock::time_point t, int delay) {
+        return delay - int(chrono::duration_cast<chrono::milliseconds>(now - t)
+                               .count());
+      };
+      timeout = std::max(
+          0, std::min(left(last, kQuietMs), left(first, kMaxDelayMs)));
+      if (!timeout) {
+        dispatch(pending);
+        pending.clear();
+        continue;
+      }
+    }
+    pollfd pfd{inotify_fd, POLLIN, 0};
+    if (poll(&pfd, 1, timeout) <= 0)
+      continue;
+    ssize_t len = read(inotify_fd, buf, sizeof buf);
+    if (len <= 0)
+      continue;
+    size_t n = pending.size();
+    for (char *p = buf; p < buf + len;) {
+      auto *ev = reinterpret_cast<inotify_event *>(p);
+      handle(*ev, pending);
+      p += sizeof(inotify_event) + ev->len;
+    }
+    if (pending.size() && !n)
+      first = chrono::steady_clock::now();
+    last = chrono::steady_clock::now();
+  }
+  close(inotify_fd);
+  pipeline::threadLeave();
+  return nullptr;
+}
+#endif
+} // namespace
+
+bool start(const std::vector<std::string> &roots_,
+           std::function<void()> on_exhausted_) {
+  if (!g_config->index.watch)
+    return false;
+#ifdef __linux__
+  inotify_fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+  if (inotify_fd < 0) {
+    LOG_S(ERROR) << "inotify_init1: " << strerror(errno);
+    return false;
+  }
+  roots = roots_;
+  on_exhausted = std::move(on_exhausted_);
+  started = true;
+  spawnThread(watcherMain, nullptr);
+  return true;
+#else
+  return false;
+#endif
+}
+
+bool active() { return started && !exhausted; }
+
+void watch(const std::string &path) {
+#ifdef __linux__
+  if (!active())
+    return;
+  std::string dir = sys::path::parent_path(path).str();
+  ensureEndsInSlash(dir);
+  std::lock_guard lock(mtx);
+  addWatch(dir);
+#endif
+}
+} // namespace ccls::watcher
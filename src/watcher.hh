@@ -0,0 +1,24 @@
+// Copyright 2017-2018 ccls Authors
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace ccls::watcher {
+// Watch |roots| recursively, skipping hidden directories and cache.directory,
+// on a background thread. Changes are debounced, batched, and sent to the main
+// thread as workspace/didChangeWatchedFiles. |on_exhausted| is called, at most
+// once and possibly from another thread, if the watch limit is reached.
+// Returns false if index.watch is false or watching is not supported.
+bool start(const std::vector<std::string> &roots,
+           std::function<void()> on_exhausted);
+
+// Whether the watcher was started and has not reached the watch limit.
+bool active();
+
+// Watch the directory of an indexed file, e.g. a dependency outside the roots.
+void watch(const std::string &path);
+} // namespace ccls::watcher